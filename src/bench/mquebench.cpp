@@ -0,0 +1,321 @@
+/**
+ * Benchmarks MQue between two processes, over each transport it offers: the shared memory rings,
+ * and the socket that peers without an inbox are reached through. For each payload size it measures
+ * ping-pong round trips, and one-way throughput with messages sent one at a time and in batches.
+ *
+ * usage: mquebench [-n messages] [-r round trips] [-m max size] [-j]
+ *
+ * Results are printed as CSV, or as one JSON object per line with -j, so that runs can be compared
+ * over time. Every message gets a payload of its own from the shared heap, written by the sender
+ * and read by the receiver a byte per cache line, so that larger sizes cost what they would in
+ * real use.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <vector>
+#include "mque.cpp"
+
+template<>
+FILE* mem::shmlog::logfile = nullptr;
+
+template<>
+FILE* log::logfile = nullptr;
+
+constexpr int latency_buckets = 256;
+
+constexpr uint8_t DATA = 1;
+constexpr uint8_t PING = 2;
+constexpr uint8_t PONG = 3;
+constexpr uint8_t QUIT = 4;
+
+// payloads that the sender may have in flight at once hold no more than this in total
+constexpr uint64_t window_budget = 8 << 20;
+
+/**
+ * Latencies are kept in log-linear buckets: exact below 16ns, then four per power of two.
+ */
+int bucket (uint64_t ns)
+{
+	if (ns < 16) return ns;
+	int lg = 63 - __builtin_clzll(ns);
+	int sub = (ns >> (lg - 2)) & 3;
+	return std::min(latency_buckets - 1, 16 + (lg - 4) * 4 + sub);
+}
+
+uint64_t bucket_floor (int b)
+{
+	if (b < 16) return b;
+	int lg = (b - 16) / 4 + 4;
+	int sub = (b - 16) % 4;
+	return (uint64_t)(4 + sub) << (lg - 2);
+}
+
+uint64_t now_ns ()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct config
+{
+	uint64_t messages = 100000;
+	uint64_t rounds = 10000;
+	uint32_t max_size = 1 << 20;
+	bool json = false;
+};
+
+struct transport
+{
+	const char* name;
+	int options;
+};
+
+const transport transports[] = {
+	{ "ring", MQue::initialize_default },
+	{ "socket", MQue::socket_only },
+};
+
+volatile uint8_t sink;
+
+void touch (const MQue::Message& msg)
+{
+	uint8_t sum = 0;
+	for (uint32_t i = 0; i < msg.size; i += 64) {
+		sum += msg.data[i];
+	}
+	sink = sum;
+}
+
+void fill (MQue::Message& msg, uint8_t value)
+{
+	for (uint32_t i = 0; i < msg.size; i += 64) {
+		msg.data[i] = value;
+	}
+}
+
+
+/**
+ * The receiving process reads data messages, and echoes pings back to their sender in place.
+ */
+void on_data (const MQue::Message& msg, void* ctx)
+{
+	touch(msg);
+}
+
+void on_ping (const MQue::Message& msg, void* ctx)
+{
+	touch(msg);
+	MQue::Message echo = msg;
+	echo.code = PONG;
+	MQue::send(msg.from_pid, echo);
+}
+
+void on_quit (const MQue::Message& msg, void* ctx)
+{
+	MQue::stop();
+}
+
+void receiver (const transport& t, int ready)
+{
+	MQue::initialize(t.options);
+	MQue::handle(DATA, on_data);
+	MQue::handle(PING, on_ping);
+	MQue::handle(QUIT, on_quit);
+	write(ready, "r", 1);
+	MQue::run();
+	MQue::finalize();
+	_exit(0);
+}
+
+
+bool ponged = false;
+
+void on_pong (const MQue::Message& msg, void* ctx)
+{
+	ponged = true;
+}
+
+/**
+ * Sends a ping and runs the event loop until its pong comes back. Since pings queue behind the
+ * data sent before them, the pong also means that all of that data has been received.
+ */
+void ping (pid_t peer, const MQue::Message& msg)
+{
+	ponged = false;
+	MQue::send(peer, msg);
+	while (!ponged) {
+		MQue::run_once(-1);
+	}
+}
+
+void report (const config& cfg, const transport& t, const char* test, uint32_t size, uint64_t count, uint64_t ns, const uint64_t* hist)
+{
+	double seconds = ns / 1e9;
+	double rate = count / seconds;
+	double mbps = rate * size / (1 << 20);
+
+	uint64_t p50 = 0, p99 = 0, p999 = 0, seen = 0;
+	if (hist) {
+		for (int b = 0; b < latency_buckets; b++) {
+			seen += hist[b];
+			if (!p50 && seen * 2 >= count) p50 = bucket_floor(b);
+			if (!p99 && seen * 100 >= count * 99) p99 = bucket_floor(b);
+			if (!p999 && seen * 1000 >= count * 999) p999 = bucket_floor(b);
+		}
+	}
+
+	if (cfg.json) {
+		printf("{\"transport\":\"%s\",\"test\":\"%s\",\"size\":%u,\"count\":%lu,\"seconds\":%.6f,"
+		       "\"msgs_per_s\":%.1f,\"mb_per_s\":%.2f", t.name, test, size, (unsigned long)count, seconds, rate, mbps);
+		if (hist) {
+			printf(",\"p50_ns\":%lu,\"p99_ns\":%lu,\"p999_ns\":%lu", (unsigned long)p50, (unsigned long)p99, (unsigned long)p999);
+		}
+		printf("}\n");
+	} else if (hist) {
+		printf("%s,%s,%u,%lu,%.6f,%.1f,%.2f,%lu,%lu,%lu\n", t.name, test, size, (unsigned long)count, seconds, rate, mbps,
+		       (unsigned long)p50, (unsigned long)p99, (unsigned long)p999);
+	} else {
+		printf("%s,%s,%u,%lu,%.6f,%.1f,%.2f,,,\n", t.name, test, size, (unsigned long)count, seconds, rate, mbps);
+	}
+	fflush(stdout);
+}
+
+
+void run_pingpong (const config& cfg, const transport& t, pid_t peer, uint32_t size)
+{
+	uint64_t rounds = std::max<uint64_t>(100, std::min<uint64_t>(cfg.rounds, (256ULL << 20) / size));
+	uint64_t hist[latency_buckets] = {};
+
+	uint64_t start = now_ns();
+	for (uint64_t i = 0; i < rounds; i++) {
+		uint64_t t0 = now_ns();
+		MQue::Message msg = MQue::create(PING, size);
+		fill(msg, i);
+		ping(peer, msg);
+		MQue::release(msg);
+		hist[bucket(now_ns() - t0)]++;
+	}
+	uint64_t elapsed = now_ns() - start;
+
+	report(cfg, t, "pingpong", size, rounds, elapsed, hist);
+}
+
+
+/**
+ * Creates, writes and sends a new payload for every message, as a real sender does. The sender
+ * keeps a window of the payloads it sent last, and waits for the receiver to be done with the
+ * oldest before it goes on, so that a slow receiver bounds what is in flight.
+ */
+void run_oneway (const config& cfg, const transport& t, pid_t peer, uint32_t size, MQue::Message& sync, bool batched)
+{
+	uint64_t messages = std::max<uint64_t>(256, std::min<uint64_t>(cfg.messages, (1ULL << 30) / size));
+	std::vector<MQue::Message> window(std::max<uint64_t>(1, std::min<uint64_t>(256, window_budget / size)));
+
+	uint64_t start = now_ns();
+	for (uint64_t i = 0; i < messages; i++) {
+		MQue::Message& sent = window[i % window.size()];
+		if (sent.data) {
+			if (MQue::header_of(sent)->refs.load(std::memory_order_acquire) > 1) {
+				MQue::flush();
+				while (MQue::header_of(sent)->refs.load(std::memory_order_acquire) > 1) {
+					MQue::poll();
+					sched_yield();
+				}
+			}
+			MQue::release(sent);
+		}
+		sent = MQue::create(DATA, size);
+		fill(sent, i);
+		if (batched) {
+			MQue::queue(peer, sent);
+		} else {
+			MQue::send(peer, sent);
+		}
+	}
+	MQue::flush();
+	ping(peer, sync);
+	uint64_t elapsed = now_ns() - start;
+	for (auto& sent : window) {
+		if (sent.data) {
+			MQue::release(sent);
+		}
+	}
+
+	report(cfg, t, batched ? "oneway-batched" : "oneway", size, messages, elapsed, nullptr);
+}
+
+
+/**
+ * Runs every test for one transport and size against a fresh receiver, so that each starts with
+ * empty pools.
+ */
+void run (const config& cfg, const transport& t, uint32_t size)
+{
+	int ready[2];
+	pipe(ready);
+	pid_t peer = fork();
+	if (peer == 0) {
+		close(ready[0]);
+		receiver(t, ready[1]);
+	}
+	close(ready[1]);
+	char c;
+	read(ready[0], &c, 1);
+	close(ready[0]);
+
+	MQue::initialize(t.options);
+	MQue::handle(PONG, on_pong);
+
+	MQue::Message sync = MQue::create(PING, 16);
+	run_pingpong(cfg, t, peer, size);
+	run_oneway(cfg, t, peer, size, sync, false);
+	run_oneway(cfg, t, peer, size, sync, true);
+	MQue::release(sync);
+
+	MQue::send(peer, MQue::Message { (MQue::proc_t)getpid(), QUIT, 0, nullptr });
+	int status;
+	waitpid(peer, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "the receiving process failed\n");
+	}
+	MQue::finalize();
+}
+
+
+int main (int argc, char* argv[])
+{
+	config cfg;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:r:m:j")) != -1) {
+		switch (opt) {
+		case 'n': cfg.messages = strtoull(optarg, nullptr, 10); break;
+		case 'r': cfg.rounds = strtoull(optarg, nullptr, 10); break;
+		case 'm': cfg.max_size = strtoul(optarg, nullptr, 10); break;
+		case 'j': cfg.json = true; break;
+		default:
+			fprintf(stderr, "usage: %s [-n messages] [-r round trips] [-m max size] [-j]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	log::initialize();
+	mem::shmlog::initialize();
+
+	if (!cfg.json) {
+		printf("transport,test,size,count,seconds,msgs_per_s,mb_per_s,p50_ns,p99_ns,p999_ns\n");
+	}
+	for (const transport& t : transports) {
+		for (uint32_t size = 16; size <= cfg.max_size; size *= 4) {
+			run(cfg, t, size);
+		}
+	}
+	return 0;
+}
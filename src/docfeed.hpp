@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stdint.h>
+#include <cassert>
+#include <vector>
+#include "docreg.hpp"
+#include "mque_messages.hpp"
+#include "util/skiparraylist.hpp"
+
+/**
+ * Broadcasts the edits made to a document to the processes that subscribed to it in DocReg, so
+ * that indexers, linters and mirrors can follow the document without reading it again. Each edit
+ * of the text becomes an EditDelta as the skiparraylist makes it, and costs one message per
+ * subscriber whatever the size of the document.
+ *
+ *     DocReg::Publisher feed(doc, text);
+ *     doc.begin_write();
+ *     text.insert(pos, "abc", 3);
+ *     doc.end_write();
+ *     feed.publish();
+ *
+ * Deltas are only collected during the write, and go out when the owner publishes them after it,
+ * so that the write is never held up by a subscriber. Nor is publishing: a subscriber that has
+ * fallen so far behind that it has no room for a delta misses it, and can tell from the versions
+ * of the deltas it receives that it has to read the document again.
+ *
+ * Requires MQue and DocReg to be initialized. Edits must be made between begin_write and
+ * end_write, by the owner of the document. The document is pinned while it is published, as the
+ * Publisher holds on to the text, and subscribers that died are dropped as it starts.
+ */
+
+namespace DocReg
+{
+
+class Publisher
+{
+public:
+	Publisher (Doc doc, util::skiparraylist<char>& text) : doc(doc), text(text) {
+		pin(doc);
+		unsubscribe_dead(doc);
+		text.observe(on_edit, this);
+	}
+
+	Publisher (const Publisher&) = delete;
+	Publisher& operator= (const Publisher&) = delete;
+
+	~Publisher () {
+		text.observe(nullptr, nullptr);
+		publish();
+		unpin(doc);
+	}
+
+	/**
+	 * Offers the deltas collected since the last call to the document's subscribers, and returns how
+	 * many of them a subscriber missed.
+	 */
+	size_t publish () {
+		size_t missed = 0;
+		for (auto& delta : deltas) {
+			doc.each_subscriber([&] (uint32_t pid) { missed += !MQue::offer(pid, delta); });
+			MQue::release(delta);
+		}
+		deltas.clear();
+		return missed;
+	}
+
+private:
+	static void on_edit (void* ctx, int pos, int removed, const char* inserted, int length) {
+		auto self = static_cast<Publisher*>(ctx);
+		uint64_t version = self->doc.current_version();
+		assert(version & 1);
+
+		bool any = false;
+		self->doc.each_subscriber([&] (uint32_t) { any = true; });
+		if (!any) {
+			return;
+		}
+
+		// one payload is shared by every subscriber
+		MQue::Builder<MQue::EditDelta> delta(MQue::Builder<MQue::EditDelta>::room<char>(length));
+		delta->doc = self->doc.id();
+		delta->version = version + 1;
+		delta->position = pos;
+		delta->removed = removed;
+		delta.append(delta->inserted, inserted, length);
+		MQue::retain(delta.message());
+		self->deltas.push_back(delta.message());
+	}
+
+	Doc doc;
+	util::skiparraylist<char>& text;
+	std::vector<MQue::Message> deltas; // made by the write in progress, or by writes not yet published
+};
+
+}
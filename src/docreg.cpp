@@ -1,17 +1,826 @@
+#include <atomic>
+#include <cassert>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
 #include "docreg.hpp"
+#include "util/log.hpp"
+#include "util/errno_exception.hpp"
+#include "mem/shmallocator.hpp"
 
 namespace DocReg
 {
 
+/**
+ * A slot of the open addressing table. Once a slot has been named for a path it keeps the name, and
+ * only its root changes as the document is registered and removed again; a removed document
+ * therefore finds its old slot when it is opened again, and lookups never have to skip over
+ * tombstones. Only once the table has no empty slot left is a removed document's slot named anew
+ * for another path, which moves it to its next generation.
+ *
+ * The state word names the slot at once: its kind, its generation and the length of its path, or,
+ * while a process is still writing the path, that process's pid.
+ */
+struct alignas(64) slot
+{
+	constexpr static uint64_t empty = 0;
+	constexpr static uint64_t pending = 1; // being named by the process in the low bits
+	constexpr static uint64_t named = 2;
+
+	std::atomic<uint64_t> id;    // valid once the slot is named
+	std::atomic<uint64_t> root;  // 0 while the document is not registered
+	std::atomic<uint64_t> version; // odd while the document's owner is editing it
+	std::atomic<uint64_t> state; // kind, generation, path length and claimer
+	char path[max_path];
+
+	static uint64_t make (uint64_t kind, uint64_t generation, size_t length, uint32_t claimer) {
+		return kind << 62 | (generation & 0x3fffff) << 40 | (uint64_t)length << 32 | claimer;
+	}
+
+	static uint64_t kind_of (uint64_t st) { return st >> 62; }
+	static uint64_t generation_of (uint64_t st) { return (st >> 40) & 0x3fffff; }
+	static size_t length_of (uint64_t st) { return (st >> 32) & 0xff; }
+	static uint32_t claimer_of (uint64_t st) { return (uint32_t)st; }
+};
+
+static_assert(sizeof(slot) == 256, "Slots should keep their ids, roots and versions in the first cache line of four.");
+static_assert(max_path < 256, "Path lengths are kept in a byte of the slot state.");
+static_assert((capacity & (capacity - 1)) == 0, "The capacity must be a power of two.");
+
+/**
+ * The processes following a document, kept apart from its slot so that probing does not pay for
+ * them. Entries are pids, or 0 where there are none.
+ */
+struct alignas(64) subscription
+{
+	std::atomic<uint32_t> pid[max_subscribers];
+};
+
+/**
+ * The reads of a document in progress, with the version each started from, so that its owner knows
+ * what it has retired that they may still reach. Free entries have no pid.
+ */
+struct alignas(64) readership
+{
+	struct entry
+	{
+		std::atomic<uint32_t> pid;
+		std::atomic<uint64_t> since; // may be stale until the read announces itself, which only holds releases back
+	};
+
+	entry readers[max_readers];
+};
+
+/**
+ * What a document takes in memory, and what the CLOCK knows of it. A document's bytes stay charged
+ * to it while it is spilled, but are only counted in the ledger while it is resident.
+ */
+struct residency
+{
+	std::atomic<uint64_t> bytes;
+	std::atomic<uint64_t> former;     // the root the document had when it was spilled
+	std::atomic<uint32_t> owner;      // the process that registered the document
+	std::atomic<uint32_t> referenced; // set when the document is used, cleared as the hand passes
+	std::atomic<uint32_t> pinned;     // how often the owner holds on to the root, which keeps it resident
+};
+
+struct ledger
+{
+	std::atomic<uint64_t> budget;
+	std::atomic<uint64_t> resident;
+	std::atomic<uint32_t> hand;
+	std::atomic<uint32_t> registered; // documents registered at the moment
+	residency docs[capacity];
+};
+
+typedef mem::shmfixedpool<slot, docreg_addr_traits> slot_pool;
+typedef mem::shmfixedpool<subscription, docreg_addr_traits> subscription_pool;
+typedef mem::shmfixedpool<ledger, docreg_addr_traits> ledger_pool;
+typedef mem::shmfixedpool<readership, docreg_addr_traits> readership_pool;
+
+slot_pool slots;
+slot* table = nullptr;
+
+subscription_pool subscriptions;
+subscription* followers = nullptr;
+
+ledger_pool ledgers;
+ledger* books = nullptr;
+
+readership_pool readerships;
+readership* reads = nullptr;
+
+/**
+ * Memory this process retired, which it releases once every read of the document that started
+ * before version after has finished.
+ */
+struct retired
+{
+	uint32_t index;
+	uint64_t after;
+	void* p;
+	void (*release) (void*);
+};
+
+std::vector<retired> limbo;
+
+std::string spill_dir;
+Spiller spiller = { nullptr, nullptr };
+
+// set when a sweep that kept fruitless_keep found nothing of this process's that it could spill
+bool fruitless = false;
+uint32_t fruitless_keep = 0;
+
+// a document of this process may have become spillable
+static void spillable ()
+{
+	fruitless = false;
+}
+
+
+/**
+ * The id of a path is its 64 bit FNV-1a hash. 0 is reserved for free slots.
+ */
+uint64_t id_of (const char* path)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (const char* p = path; *p; p++) {
+		h = (h ^ (uint8_t)*p) * 0x100000001b3ULL;
+	}
+	return h ? h : 1;
+}
+
+
+static bool dead (uint32_t pid)
+{
+	return kill(pid, 0) == -1 && errno == ESRCH;
+}
+
+
+/**
+ * What a probe for a path found: its slot and the state it was named in, or else the empty slot that
+ * ended the probe, and the first slot of a removed document that it passed.
+ */
+struct probe_result
+{
+	slot* found = nullptr;
+	uint64_t stamp = 0;
+	slot* empty = nullptr;
+	slot* removed = nullptr;
+	uint64_t removed_stamp = 0;
+};
+
+/**
+ * Probes for the slot named path. A slot that is still being named is skipped, unless wait is set,
+ * in which case the probe waits for it, since it may be being named path; one whose claimer died
+ * first is left named for no path, so that nobody waits for it again.
+ */
+static probe_result probe (const char* path, size_t length, uint64_t id, bool wait)
+{
+	probe_result r;
+	for (uint32_t i = 0; i < capacity; i++) {
+		slot& s = table[(id + i) & (capacity - 1)];
+		uint64_t st = s.state.load(std::memory_order_acquire);
+		while (slot::kind_of(st) == slot::pending) {
+			if (dead(slot::claimer_of(st))) {
+				s.state.compare_exchange_strong(st, slot::make(slot::named, slot::generation_of(st), 0, 0));
+			} else if (!wait) {
+				break;
+			} else {
+				sched_yield();
+			}
+			st = s.state.load(std::memory_order_acquire);
+		}
+		if (slot::kind_of(st) == slot::empty) {
+			r.empty = &s;
+			return r;
+		}
+		if (slot::kind_of(st) != slot::named) {
+			continue;
+		}
+		// the slot may be named anew while its path is compared, which changes its state
+		if (s.id.load(std::memory_order_relaxed) == id && slot::length_of(st) == length &&
+		    memcmp(s.path, path, length) == 0 && s.state.load(std::memory_order_acquire) == st) {
+			r.found = &s;
+			r.stamp = st;
+			return r;
+		}
+		if (!r.removed && s.root.load(std::memory_order_relaxed) == 0) {
+			r.removed = &s;
+			r.removed_stamp = st;
+		}
+	}
+	return r;
+}
+
+
+/**
+ * Finds the slot of a path, naming one for it if claim is set: the empty slot that ends its probe,
+ * or if there is none, the slot of a removed document. Returns nullptr if the path has no slot, or
+ * if the table is full, and otherwise leaves the state that the slot is named in at stamp.
+ */
+static slot* find (const char* path, bool claim, uint64_t* stamp = nullptr)
+{
+	size_t length = strlen(path);
+	if (length > max_path) {
+		log::warning("A document path is too long for the registry.");
+		return nullptr;
+	}
+	uint64_t id = id_of(path);
+	for (;;) {
+		probe_result r = probe(path, length, id, claim);
+		if (r.found || !claim) {
+			if (stamp) {
+				*stamp = r.stamp;
+			}
+			return r.found;
+		}
+		slot* s = r.empty ? r.empty : r.removed;
+		if (!s) {
+			log::warning("The registry has no slot left for another path, so the document is not registered.");
+			return nullptr;
+		}
+		uint64_t was = r.empty ? slot::empty : r.removed_stamp;
+		uint64_t generation = slot::generation_of(was) + (r.empty ? 0 : 1);
+		uint64_t expected = was;
+		if (!s->state.compare_exchange_strong(expected, slot::make(slot::pending, generation, 0, getpid()), std::memory_order_seq_cst)) {
+			continue;
+		}
+		if (s->root.load(std::memory_order_seq_cst) != 0) {
+			// the removed document was registered again before its slot could be taken
+			s->state.store(was, std::memory_order_release);
+			continue;
+		}
+		s->id.store(id, std::memory_order_relaxed);
+		memcpy(s->path, path, length);
+		for (auto& pid : followers[s - table].pid) {
+			pid.store(0, std::memory_order_relaxed);
+		}
+		uint64_t st = slot::make(slot::named, generation, length, 0);
+		s->state.store(st, std::memory_order_release);
+
+		// another process may have named a slot for the same path at the same time, and only the
+		// first of them in probe order is kept
+		probe_result first = probe(path, length, id, true);
+		if (first.found != s) {
+			s->state.compare_exchange_strong(st, slot::make(slot::named, generation + 1, 0, 0));
+			if (!first.found) {
+				continue;
+			}
+		}
+		if (stamp) {
+			*stamp = first.stamp;
+		}
+		return first.found;
+	}
+}
+
+
+/**
+ * Registers the root of a document. Returns false if the document is already registered, or if the
+ * registry is full.
+ */
+bool insert (const char* path, void* root)
+{
+	assert(root != nullptr);
+	slot* s;
+	for (;;) {
+		uint64_t stamp;
+		s = find(path, true, &stamp);
+		if (!s) {
+			return false;
+		}
+		uint64_t expected = 0;
+		if (!s->root.compare_exchange_strong(expected, (uint64_t)root, std::memory_order_seq_cst)) {
+			return false;
+		}
+		if (s->state.load(std::memory_order_seq_cst) == stamp) {
+			break;
+		}
+		// the slot was named for another path as the document was being registered in it
+		expected = (uint64_t)root;
+		s->root.compare_exchange_strong(expected, 0, std::memory_order_relaxed);
+	}
+	books->registered.fetch_add(1, std::memory_order_relaxed);
+	// the ledger entry is left alone by removal until now, with no owner to spill it
+	residency& r = books->docs[s - table];
+	r.bytes.store(0, std::memory_order_relaxed);
+	r.referenced.store(1, std::memory_order_relaxed);
+	r.pinned.store(0, std::memory_order_relaxed);
+	r.owner.store(getpid(), std::memory_order_relaxed);
+	spillable();
+	return true;
+}
+
+
+// the root of the document that the slot held while it was named in stamp
+static void* root_of (const slot& s, uint64_t stamp)
+{
+	uint64_t root = s.root.load(std::memory_order_acquire);
+	if (root == spilled_root || s.state.load(std::memory_order_acquire) != stamp) {
+		return nullptr;
+	}
+	return reinterpret_cast<void*>(root);
+}
+
+
+void* lookup (const char* path)
+{
+	uint64_t stamp;
+	slot* s = find(path, false, &stamp);
+	return s ? root_of(*s, stamp) : nullptr;
+}
+
+
+/**
+ * Looks a document up by id alone, which touches nothing but the first cache line of each slot
+ * probed. Paths whose hashes collide are told apart only by lookups by path.
+ */
+void* lookup (uint64_t id)
+{
+	for (uint32_t i = 0; i < capacity; i++) {
+		slot& s = table[(id + i) & (capacity - 1)];
+		uint64_t st = s.state.load(std::memory_order_acquire);
+		if (slot::kind_of(st) == slot::empty) {
+			return nullptr;
+		}
+		if (slot::kind_of(st) == slot::named && s.id.load(std::memory_order_relaxed) == id) {
+			return root_of(s, st);
+		}
+	}
+	return nullptr;
+}
+
+
+/**
+ * The image of a spilled document is named for its slot as well as its id, as paths whose hashes
+ * collide share the id.
+ */
+static std::string spill_path (uint32_t index)
+{
+	char name[48];
+	snprintf(name, sizeof(name), "/%05u-%016lx.img", index, (unsigned long)table[index].id.load(std::memory_order_relaxed));
+	return spill_dir + name;
+}
+
+
+/**
+ * Removes a document, if it is still registered with the given root. A spilled document is
+ * removed with the root it had before it was spilled, and its image is deleted.
+ */
+bool remove (const char* path, void* root)
+{
+	slot* s = find(path, false);
+	if (!s) {
+		return false;
+	}
+	residency& r = books->docs[s - table];
+	uint64_t expected = (uint64_t)root;
+	if (s->root.compare_exchange_strong(expected, 0, std::memory_order_release)) {
+		r.owner.store(0, std::memory_order_relaxed);
+		books->registered.fetch_sub(1, std::memory_order_relaxed);
+		books->resident.fetch_sub(r.bytes.exchange(0, std::memory_order_relaxed), std::memory_order_relaxed);
+		return true;
+	}
+	expected = spilled_root;
+	if (r.former.load(std::memory_order_relaxed) == (uint64_t)root &&
+	    s->root.compare_exchange_strong(expected, 0, std::memory_order_release)) {
+		r.owner.store(0, std::memory_order_relaxed);
+		r.bytes.store(0, std::memory_order_relaxed);
+		books->registered.fetch_sub(1, std::memory_order_relaxed);
+		unlink(spill_path(s - table).c_str());
+		return true;
+	}
+	return false;
+}
+
+
+/**
+ * Finds a registered document. The handle stays valid for as long as the registry is attached,
+ * though once the document is removed and its slot named for another path, it has no root.
+ */
+Doc open (const char* path)
+{
+	uint64_t stamp;
+	slot* s = find(path, false, &stamp);
+	if (!s || !s->root.load(std::memory_order_acquire)) {
+		return Doc();
+	}
+	return Doc(s - table, s->id.load(std::memory_order_relaxed), &s->root, &s->version, &s->state, stamp,
+	           followers[s - table].pid);
+}
+
+/**
+ * Clears the entries of subscribers that exited without unsubscribing, and returns how many.
+ */
+static uint32_t unsubscribe_dead (std::atomic<uint32_t>* subs)
+{
+	uint32_t reaped = 0;
+	for (uint32_t i = 0; i < max_subscribers; i++) {
+		uint32_t pid = subs[i].load(std::memory_order_relaxed);
+		if (pid != 0 && dead(pid) && subs[i].compare_exchange_strong(pid, 0, std::memory_order_relaxed)) {
+			reaped++;
+		}
+	}
+	return reaped;
+}
+
+
+/**
+ * Has pid told of the edits to a registered document. Returns false if the document is not
+ * registered, or already has as many live subscribers as it can take.
+ */
+bool subscribe (const char* path, uint32_t pid)
+{
+	assert(pid != 0);
+	uint64_t stamp;
+	slot* s = find(path, false, &stamp);
+	if (!s || !s->root.load(std::memory_order_acquire)) {
+		return false;
+	}
+	std::atomic<uint32_t>* subs = followers[s - table].pid;
+	unsubscribe_dead(subs);
+	for (uint32_t i = 0; i < max_subscribers; i++) {
+		if (subs[i].load(std::memory_order_relaxed) == pid) {
+			return true;
+		}
+	}
+	for (uint32_t i = 0; i < max_subscribers; i++) {
+		uint32_t expected = 0;
+		if (subs[i].compare_exchange_strong(expected, pid, std::memory_order_seq_cst)) {
+			// a slot named anew clears its subscribers, which may have missed this one
+			if (s->state.load(std::memory_order_seq_cst) != stamp) {
+				expected = pid;
+				subs[i].compare_exchange_strong(expected, 0, std::memory_order_relaxed);
+				return false;
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+
+bool unsubscribe (const char* path, uint32_t pid)
+{
+	slot* s = find(path, false);
+	if (!s) {
+		return false;
+	}
+	std::atomic<uint32_t>* subs = followers[s - table].pid;
+	for (uint32_t i = 0; i < max_subscribers; i++) {
+		uint32_t expected = pid;
+		if (subs[i].compare_exchange_strong(expected, 0, std::memory_order_release)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+
+uint32_t unsubscribe_dead (const Doc& doc)
+{
+	return unsubscribe_dead(doc.subs);
+}
+
+
+/**
+ * Takes an entry among the document's readers, freeing those of readers that died first if they
+ * are all taken, and waiting for one otherwise.
+ */
+Doc::reading::reading (const Doc& doc) : doc(doc)
+{
+	readership::entry* entries = reads[doc.index].readers;
+	uint32_t me = getpid();
+	for (;;) {
+		for (uint32_t i = 0; i < max_readers; i++) {
+			uint32_t expected = 0;
+			if (entries[i].pid.compare_exchange_strong(expected, me, std::memory_order_acquire)) {
+				pid = &entries[i].pid;
+				since = &entries[i].since;
+				return;
+			}
+		}
+		for (uint32_t i = 0; i < max_readers; i++) {
+			uint32_t other = entries[i].pid.load(std::memory_order_relaxed);
+			if (other != 0 && dead(other)) {
+				entries[i].since.store(UINT64_MAX, std::memory_order_relaxed);
+				entries[i].pid.compare_exchange_strong(other, 0, std::memory_order_release);
+			}
+		}
+		sched_yield();
+	}
+}
+
+Doc::reading::~reading ()
+{
+	since->store(UINT64_MAX, std::memory_order_release);
+	pid->store(0, std::memory_order_release);
+}
+
+/**
+ * The owner looks at the entries after an edit, so either it sees v or the read sees the edit, and
+ * retries before it reaches anything that the edit retired.
+ */
+bool Doc::reading::announce (uint64_t v)
+{
+	since->store(v, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	return doc.version->load(std::memory_order_relaxed) == v;
+}
+
+
+/**
+ * An edit takes a moment, so the owner is only asked after as long as a few time slices, and a
+ * document whose owner died in the middle of one is given up.
+ */
+uint64_t Doc::wait_for_writer () const
+{
+	for (uint32_t spins = 1;; spins++) {
+		uint64_t v = version->load(std::memory_order_acquire);
+		if (!(v & 1)) {
+			return v;
+		}
+		if (spins % 1024 == 0) {
+			uint32_t owner = books->docs[index].owner.load(std::memory_order_relaxed);
+			if (owner == 0 || dead(owner)) {
+				throw std::runtime_error("The owner of a document died in the middle of an edit.");
+			}
+		}
+		sched_yield();
+	}
+}
+
+
+/**
+ * Reads that announce a version at or after the end of the edit in progress start after it, and
+ * cannot reach what it unlinked.
+ */
+void retire (const Doc& doc, void* p, void (*release) (void*))
+{
+	uint64_t v = doc.version->load(std::memory_order_relaxed);
+	limbo.push_back(retired { doc.index, (v + 1) & ~(uint64_t)1, p, release });
+	reclaim();
+}
+
+
+static bool reachable (const retired& r)
+{
+	for (auto& e : reads[r.index].readers) {
+		uint32_t pid = e.pid.load(std::memory_order_relaxed);
+		if (pid != 0 && e.since.load(std::memory_order_relaxed) < r.after && !dead(pid)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+size_t reclaim ()
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	size_t kept = 0;
+	for (auto& r : limbo) {
+		if (reachable(r)) {
+			limbo[kept++] = r;
+		} else {
+			r.release(r.p);
+		}
+	}
+	limbo.resize(kept);
+	return kept;
+}
+
+
+void set_budget (uint64_t bytes)
+{
+	books->budget.store(bytes, std::memory_order_relaxed);
+}
+
+
+void spill_with (const char* dir, Spiller s)
+{
+	spill_dir = dir;
+	spiller = s;
+}
+
+
+uint32_t free_slots ()
+{
+	return capacity - books->registered.load(std::memory_order_relaxed);
+}
+
+
+uint64_t resident_bytes ()
+{
+	return books->resident.load(std::memory_order_relaxed);
+}
+
+
+static void evict (uint32_t keep);
+
+void charge (const Doc& doc, uint64_t bytes)
+{
+	residency& r = books->docs[doc.index];
+	uint64_t old = r.bytes.exchange(bytes, std::memory_order_relaxed);
+	r.referenced.store(1, std::memory_order_relaxed);
+	if (doc.rootp->load(std::memory_order_relaxed) != spilled_root) {
+		books->resident.fetch_add(bytes - old, std::memory_order_relaxed);
+		evict(doc.index);
+	}
+}
+
+
+/**
+ * Writes a document of this process out and frees it. Readers that raced the spill see the
+ * version move, and find no root when they retry.
+ */
+static bool spill (uint32_t index)
+{
+	slot& s = table[index];
+	residency& r = books->docs[index];
+	uint64_t root = s.root.load(std::memory_order_relaxed);
+	std::string path = spill_path(index);
+
+	int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		log::warning("Could not create a spill image, so the document stays in memory.");
+		return false;
+	}
+	uint64_t v = s.version.load(std::memory_order_relaxed);
+	s.version.store(v + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	bool spilled = spiller.spill(reinterpret_cast<void*>(root), fd);
+	close(fd);
+	if (spilled) {
+		r.former.store(root, std::memory_order_relaxed);
+		s.root.store(spilled_root, std::memory_order_release);
+		books->resident.fetch_sub(r.bytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	} else {
+		unlink(path.c_str());
+		log::warning("Could not write a spill image, so the document stays in memory.");
+	}
+	s.version.store(v + 2, std::memory_order_release);
+	return spilled;
+}
+
+
+/**
+ * The hand is shared by all processes, and each spills only its own documents as it passes them.
+ * A sweep stops after one turn of the clock, so documents that were used since the hand last
+ * passed survive it, and the budget may stay exceeded until the next one. The document at keep,
+ * which the caller is using, is never spilled, and neither are pinned ones. A turn that passes
+ * none of this process's documents that it could spill is not taken again for the same keep until
+ * one of them may have become spillable, as it would only find the same.
+ */
+static void evict (uint32_t keep)
+{
+	uint64_t budget = books->budget.load(std::memory_order_relaxed);
+	if (!budget || !spiller.spill || (fruitless && fruitless_keep == keep)) {
+		return;
+	}
+	uint32_t pid = getpid();
+	uint32_t candidates = 0;
+	uint32_t step = 0;
+	for (; step < capacity && books->resident.load(std::memory_order_relaxed) > budget; step++) {
+		uint32_t i = books->hand.fetch_add(1, std::memory_order_relaxed) & (capacity - 1);
+		residency& r = books->docs[i];
+		uint64_t root = table[i].root.load(std::memory_order_relaxed);
+		if (i == keep || root == 0 || root == spilled_root || r.owner.load(std::memory_order_relaxed) != pid ||
+		    r.pinned.load(std::memory_order_relaxed)) {
+			continue;
+		}
+		candidates++;
+		if (r.referenced.exchange(0, std::memory_order_relaxed)) {
+			continue;
+		}
+		spill(i);
+	}
+	if (step == capacity && candidates == 0) {
+		fruitless = true;
+		fruitless_keep = keep;
+	}
+}
+
+void evict ()
+{
+	evict(capacity);
+}
+
+
+/**
+ * Pins nest: a document stays pinned until it has been unpinned as often as it was pinned.
+ */
+void pin (const Doc& doc)
+{
+	assert(doc.rootp->load(std::memory_order_relaxed) != spilled_root);
+	books->docs[doc.index].pinned.fetch_add(1, std::memory_order_relaxed);
+}
+
+void unpin (const Doc& doc)
+{
+	uint32_t was = books->docs[doc.index].pinned.fetch_sub(1, std::memory_order_relaxed);
+	assert(was > 0);
+	if (was == 1) {
+		spillable();
+	}
+}
+
+
+void* resident (const Doc& doc)
+{
+	slot& s = table[doc.index];
+	residency& r = books->docs[doc.index];
+	r.referenced.store(1, std::memory_order_relaxed);
+	uint64_t root = s.root.load(std::memory_order_acquire);
+	if (root != spilled_root) {
+		return reinterpret_cast<void*>(root);
+	}
+	assert(r.owner.load(std::memory_order_relaxed) == (uint32_t)getpid());
+
+	std::string path = spill_path(doc.index);
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		throw errno_runtime_error;
+	}
+	void* reloaded = spiller.reload(fd);
+	close(fd);
+	if (!reloaded) {
+		throw std::runtime_error("Could not read a spilled document back.");
+	}
+	unlink(path.c_str());
+
+	uint64_t v = s.version.load(std::memory_order_relaxed);
+	s.version.store(v + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	s.root.store((uint64_t)reloaded, std::memory_order_release);
+	s.version.store(v + 2, std::memory_order_release);
+
+	books->resident.fetch_add(r.bytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	spillable();
+	evict(doc.index);
+	return reloaded;
+}
+
+
+/**
+ * Attaches a pool and returns the table of count Ts at its root. The first process to attach
+ * allocates the table; any others that race it give theirs back.
+ */
+template<typename T>
+static T* attach_table (mem::shmfixedpool<T, docreg_addr_traits>& pool, int poolid, uint32_t count)
+{
+	pool = mem::shmfixedpool<T, docreg_addr_traits>::attach(poolid);
+	T* table = reinterpret_cast<T*>(pool.root());
+	if (!table) {
+		T* fresh = count == 1 ? pool.allocate_uncached() : pool.allocate(count);
+		uint64_t expected = 0;
+		if (pool.hdr->root.compare_exchange_strong(expected, (uint64_t)fresh, std::memory_order_acq_rel)) {
+			table = fresh;
+		} else {
+			if (count == 1) {
+				pool.deallocate_uncached(fresh);
+			} else {
+				pool.deallocate(fresh, count);
+			}
+			table = reinterpret_cast<T*>(expected);
+		}
+	}
+	// the table may lie in segments that were added after this process attached
+	pool.ensure_mapped(table + count - 1);
+	return table;
+}
+
 
 void initialize()
 {
-	
+	table = attach_table(slots, 0, capacity);
+	followers = attach_table(subscriptions, 1, capacity);
+	books = attach_table(ledgers, 2, 1);
+	reads = attach_table(readerships, 3, capacity);
 }
 
 void finalize()
 {
-	
+	if (table) {
+		// the documents of a process that is leaving go with it, so what they retired goes now
+		for (auto& r : limbo) {
+			r.release(r.p);
+		}
+		limbo.clear();
+		table = nullptr;
+		followers = nullptr;
+		books = nullptr;
+		reads = nullptr;
+		slot_pool::detach(slots);
+		subscription_pool::detach(subscriptions);
+		ledger_pool::detach(ledgers);
+		readership_pool::detach(readerships);
+	}
 }
 
 }
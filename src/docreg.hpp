@@ -1,20 +1,244 @@
 #pragma once
 
+#include <stdint.h>
+#include <atomic>
+#include <stddef.h>
+#include "mem/addr_traits.hpp"
+
 /**
  * Implements a document registry in shared memory.
  * Requires the shared memory subsystem to be initialized.
+ *
+ * The registry maps each open document to the shared root of its contents, so that any process
+ * can find a document without asking another. Documents are known by their path, or by its hash,
+ * which serves as their id. Lookups take no locks, and registering or removing a document is a
+ * compare-and-swap on its slot.
  */
 
 
 namespace DocReg
 {
 
+// the registry lives in a region of its own: 16 pools of up to 256 segments of 1 MB
+typedef mem::pool_addr_traits<0x1020,16,4,8,20> docreg_addr_traits;
+
+// documents that can be registered at once: a path keeps its slot after it is removed, so that it
+// finds it again, until the registry has no empty slot left and another path takes it over
+constexpr uint32_t capacity = 16384;
+
+constexpr uint32_t max_path = 224;
+
+// processes that can follow the edits of one document
+constexpr uint32_t max_subscribers = 16;
+
+// reads of one document that can be in progress at once; further readers wait for one to finish
+constexpr uint32_t max_readers = 16;
+
+// the root of a document that has been spilled, which reads as no root at all
+constexpr uint64_t spilled_root = 1;
+
+/**
+ * A registered document as one process sees it. Each document carries a sequence lock: its owner
+ * brackets every edit with begin_write and end_write, and readers in other processes read the
+ * document optimistically and retry if an edit overlapped them. The owner never waits for readers,
+ * and readers never stop the owner. Only the owner of a document may write it.
+ *
+ *     doc.read([&] () { copy = *leaf; });
+ *
+ * A read may observe a document in the middle of an edit before it is retried, so it should only
+ * copy things out, with loops bounded by what it copies, and act on the copy once read returns.
+ *
+ * A read is only as safe as the memory it touches. Each read announces the version it started
+ * from, and an edit that unlinks memory hands it to retire rather than freeing it, which frees it
+ * once no read that could still reach it is in progress; the owner never waits for that. Only
+ * read announces itself, so read_begin and read_validate on their own suit memory that is never
+ * freed. A skiparraylist frees its nodes itself and dispatches through virtual functions, so it
+ * is not read this way: a document that other processes read keeps what they copy in plain
+ * structures in a shared pool, and leaves its skiparraylist to the owner.
+ *
+ * A read that finds the owner died in the middle of an edit throws std::runtime_error, as the
+ * document will never be whole again.
+ */
+class Doc
+{
+public:
+	Doc () = default;
+
+	explicit operator bool () const { return version != nullptr; }
+
+	// nullptr while the document is spilled, and once its slot has gone to another path; its owner
+	// gets a spilled document back with resident
+	void* root () const {
+		uint64_t r = rootp->load(std::memory_order_acquire);
+		if (r == spilled_root || state->load(std::memory_order_acquire) != stamp) {
+			return nullptr;
+		}
+		return reinterpret_cast<void*>(r);
+	}
+
+	void begin_write () {
+		uint64_t v = version->load(std::memory_order_relaxed);
+		version->store(v + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+
+	void end_write () {
+		version->store(version->load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	// waits out an edit in progress, and returns the version that the read starts from
+	uint64_t read_begin () const {
+		uint64_t v = version->load(std::memory_order_acquire);
+		return v & 1 ? wait_for_writer() : v;
+	}
+
+	// whether nothing was edited since read_begin returned v
+	bool read_validate (uint64_t v) const {
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return version->load(std::memory_order_relaxed) == v;
+	}
+
+	template<typename F>
+	void read (F&& f) const {
+		reading r(*this);
+		for (;;) {
+			uint64_t v = read_begin();
+			if (!r.announce(v)) {
+				continue;
+			}
+			f();
+			if (read_validate(v)) {
+				return;
+			}
+		}
+	}
+
+	uint64_t current_version () const { return version->load(std::memory_order_acquire); }
+
+	uint64_t id () const { return docid; }
+
+	template<typename F>
+	void each_subscriber (F&& f) const {
+		for (uint32_t i = 0; i < max_subscribers; i++) {
+			uint32_t pid = subs[i].load(std::memory_order_acquire);
+			if (pid) {
+				f(pid);
+			}
+		}
+	}
+
+private:
+	/**
+	 * An entry of the document's readers, held for the length of a read.
+	 */
+	class reading
+	{
+	public:
+		explicit reading (const Doc& doc);
+		~reading ();
+
+		// announces that the read starts from v; false if the document has been edited since
+		bool announce (uint64_t v);
+
+	private:
+		std::atomic<uint32_t>* pid;
+		std::atomic<uint64_t>* since;
+		const Doc& doc;
+	};
+
+	uint64_t wait_for_writer () const;
+
+	Doc (uint32_t index, uint64_t docid, std::atomic<uint64_t>* rootp, std::atomic<uint64_t>* version,
+	     std::atomic<uint64_t>* state, uint64_t stamp, std::atomic<uint32_t>* subs)
+		: index(index), docid(docid), rootp(rootp), version(version), state(state), stamp(stamp), subs(subs) {}
+
+	friend Doc open (const char* path);
+	friend void charge (const Doc& doc, uint64_t bytes);
+	friend void* resident (const Doc& doc);
+	friend uint32_t unsubscribe_dead (const Doc& doc);
+	friend void pin (const Doc& doc);
+	friend void unpin (const Doc& doc);
+	friend void retire (const Doc& doc, void* p, void (*release) (void*));
+
+	uint32_t index = 0;
+	uint64_t docid = 0;
+	std::atomic<uint64_t>* rootp = nullptr;
+	std::atomic<uint64_t>* version = nullptr;
+	std::atomic<uint64_t>* state = nullptr; // of the slot, which changes when it goes to another path
+	uint64_t stamp = 0;
+	std::atomic<uint32_t>* subs = nullptr;
+};
+
 void initialize();
 
 void finalize();
 
+uint64_t id_of (const char* path);
+
+bool insert (const char* path, void* root);
+
+void* lookup (const char* path);
+
+void* lookup (uint64_t id);
+
+bool remove (const char* path, void* root);
+
+Doc open (const char* path);
+
+bool subscribe (const char* path, uint32_t pid);
+
+bool unsubscribe (const char* path, uint32_t pid);
+
+// documents that can still be registered
+uint32_t free_slots ();
+
+// drops the subscribers of a document that exited without unsubscribing, and returns how many
+uint32_t unsubscribe_dead (const Doc& doc);
+
+// hands memory that an edit of the document unlinked to release, once no read can reach it
+void retire (const Doc& doc, void* p, void (*release) (void*));
+
+// releases what was retired and can no longer be reached, and returns how much is left waiting
+size_t reclaim ();
+
+
+/**
+ * Documents are charged to a memory budget that all processes share. Once the documents in memory
+ * take more than the budget, their owners write out the ones used least recently to a spill
+ * directory and free them, choosing by the CLOCK algorithm, and read them back when they are next
+ * asked for. A spilled document stays registered, but has no root until it is resident again.
+ *
+ * Only the process that registered a document spills it, through the Spiller it gave, so each
+ * process that owns documents should call spill_with. Owners get a document's root from resident
+ * rather than holding on to it, as a spilled document comes back at another address.
+ */
+struct Spiller
+{
+	bool (*spill) (void* root, int fd); // writes the document to fd, and frees it if that succeeded
+	void* (*reload) (int fd);           // reads a document back, and returns its new root
+};
+
+// 0, the default, leaves documents in memory whatever they take
+void set_budget (uint64_t bytes);
+
+void spill_with (const char* dir, Spiller spiller);
+
+// tells the registry what a document now takes in memory, which may spill others
+void charge (const Doc& doc, uint64_t bytes);
+
+// the root of a document of this process, read back first if it was spilled
+void* resident (const Doc& doc);
+
+// spills documents of this process until the documents in memory fit the budget again
+void evict ();
+
+// keeps a resident document of this process from being spilled, for as long as something holds
+// on to its root, until it is unpinned as often as it was pinned
+void pin (const Doc& doc);
 
+void unpin (const Doc& doc);
 
+uint64_t resident_bytes ();
 
 
 }
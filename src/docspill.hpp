@@ -0,0 +1,114 @@
+#pragma once
+
+#include <stdint.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+#include "docreg.hpp"
+#include "util/skiparraylist.hpp"
+
+/**
+ * Spills documents whose root is a skiparraylist allocated with new. The image is a header and then
+ * the contents of the leaves, one after another, without the room that leaves keep free for edits.
+ *
+ *     DocReg::spill_with("/var/tmp/liveparse", DocReg::list_spiller<char>);
+ */
+
+namespace DocReg
+{
+
+constexpr uint32_t image_magic = 0x4d49504c; // "LPIM"
+
+struct image_header
+{
+	uint32_t magic;
+	uint32_t width; // sizeof(T)
+	uint64_t length;
+};
+
+inline bool write_fully (int fd, const void* data, size_t n)
+{
+	auto p = static_cast<const char*>(data);
+	while (n) {
+		ssize_t w = write(fd, p, n);
+		if (w <= 0) {
+			return false;
+		}
+		p += w;
+		n -= w;
+	}
+	return true;
+}
+
+inline bool read_fully (int fd, void* data, size_t n)
+{
+	auto p = static_cast<char*>(data);
+	while (n) {
+		ssize_t r = read(fd, p, n);
+		if (r <= 0) {
+			return false;
+		}
+		p += r;
+		n -= r;
+	}
+	return true;
+}
+
+
+template<typename T>
+bool spill_list (void* root, int fd)
+{
+	auto list = static_cast<util::skiparraylist<T>*>(root);
+	image_header h { image_magic, sizeof(T), (uint64_t)list->size() };
+	if (!write_fully(fd, &h, sizeof(h))) {
+		return false;
+	}
+
+	// leaves are gathered into larger writes
+	std::vector<T> staged;
+	staged.reserve(65536 / sizeof(T));
+	bool ok = true;
+	list->each_run([&] (const T* data, int length) {
+		if (staged.size() + length > staged.capacity()) {
+			ok = ok && write_fully(fd, staged.data(), staged.size() * sizeof(T));
+			staged.clear();
+		}
+		staged.insert(staged.end(), data, data + length);
+	});
+	ok = ok && write_fully(fd, staged.data(), staged.size() * sizeof(T));
+	if (ok) {
+		delete list;
+	}
+	return ok;
+}
+
+
+template<typename T>
+void* reload_list (int fd)
+{
+	image_header h;
+	if (!read_fully(fd, &h, sizeof(h)) || h.magic != image_magic || h.width != sizeof(T)) {
+		return nullptr;
+	}
+	auto list = new util::skiparraylist<T>();
+	std::vector<T> chunk(65536 / sizeof(T));
+	for (uint64_t left = h.length; left; ) {
+		size_t n = std::min<uint64_t>(left, chunk.size());
+		if (!read_fully(fd, chunk.data(), n * sizeof(T))) {
+			delete list;
+			return nullptr;
+		}
+		// appends are kept within a leaf, as longer ones are not split reliably
+		for (size_t at = 0; at < n; at += util::detail::leaf<T>::capacity) {
+			list->append(chunk.data() + at, std::min<size_t>(n - at, util::detail::leaf<T>::capacity));
+		}
+		left -= n;
+	}
+	return list;
+}
+
+
+template<typename T>
+constexpr Spiller list_spiller = { spill_list<T>, reload_list<T> };
+
+}
@@ -15,9 +15,9 @@ int main (int argc, char *argv[])
 		
 		log::initialize();
 		
-		MQue::initialize();
-
 		MemSys::initialize();
+
+		MQue::initialize();
 		
 		DocReg::initialize();
 		
@@ -101,7 +101,7 @@ struct pool_addr_traits : public region_addr_traits<RID,RB>
 	}
 
 	static void* base_address (poolid_t pid, segmentid_t segid = 0) {
-		return (void*)((RID << (address_width - RB)) + (pid << (OB+SB)) + (segid << OB));
+		return (void*)((RID << (address_width - RB)) + ((uint64_t)pid << (OB+SB)) + ((uint64_t)segid << OB));
 	}
 	
 };
@@ -0,0 +1,407 @@
+/**
+ * Benchmarks shmfixedpool against glibc malloc and a process-local bump arena under contention.
+ * Forks a number of processes with a number of threads each, runs them through several allocation
+ * patterns, and reports throughput, sampled latency percentiles and peak RSS.
+ *
+ * usage: shmbench [-p processes] [-t threads] [-n operations per thread] [-w working set]
+ *
+ * RSS is the sum of each process's peak resident set, so pages of a shared pool are counted
+ * once for every process that touched them.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include "util/arena.hpp"
+#include "mem/addr_traits.hpp"
+#include "mem/shmallocator.hpp"
+
+using namespace mem;
+
+// 1 MB segments and 256 MB pools
+typedef pool_addr_traits<0x1006,16,4,8,20> shbench;
+
+template<>
+FILE* mem::shmlog::logfile = nullptr;
+
+template<>
+FILE* log::logfile = nullptr;
+
+constexpr int max_procs = 64;
+constexpr int max_threads = 64;
+constexpr int latency_buckets = 256;
+constexpr int sample_every = 16;
+
+/**
+ * Latencies are kept in log-linear buckets: exact below 16ns, then four per power of two.
+ */
+int bucket (uint64_t ns)
+{
+	if (ns < 16) return ns;
+	int lg = 63 - __builtin_clzll(ns);
+	int sub = (ns >> (lg - 2)) & 3;
+	return std::min(latency_buckets - 1, 16 + (lg - 4) * 4 + sub);
+}
+
+uint64_t bucket_floor (int b)
+{
+	if (b < 16) return b;
+	int lg = (b - 16) / 4 + 4;
+	int sub = (b - 16) % 4;
+	return (uint64_t)(4 + sub) << (lg - 2);
+}
+
+uint64_t now_ns ()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct thread_result
+{
+	uint64_t ops;
+	uint64_t ns;
+	uint64_t hist[latency_buckets];
+};
+
+// lives in an anonymous shared mapping, so that the forked processes can report back
+struct shared_state
+{
+	std::atomic<int> ready;
+	std::atomic<int> go;
+	long rss_kb[max_procs];
+	thread_result results[max_procs][max_threads];
+};
+
+struct config
+{
+	int procs = 2;
+	int threads = 2;
+	uint64_t ops = 1000000;
+	int working_set = 256;
+};
+
+
+/**
+ * Times one operation in every sample_every into the thread's histogram.
+ */
+struct sampler
+{
+	thread_result& r;
+	uint64_t n = 0;
+
+	template<typename F>
+	void op (F&& f) {
+		if (++n % sample_every) {
+			f();
+			return;
+		}
+		uint64_t t0 = now_ns();
+		f();
+		r.hist[bucket(now_ns() - t0)]++;
+	}
+};
+
+
+template<typename O>
+struct shm_alloc
+{
+	constexpr static const char* name = "shmfixedpool";
+	constexpr static bool cross_thread_free = true;
+	shmfixedpool<O,shbench>* pool;
+
+	O* allocate () { return pool->allocate(1); }
+	void deallocate (O* p) { pool->deallocate(p, 1); }
+};
+
+template<typename O>
+struct malloc_alloc
+{
+	constexpr static const char* name = "malloc";
+	constexpr static bool cross_thread_free = true;
+
+	O* allocate () { return static_cast<O*>(malloc(sizeof(O))); }
+	void deallocate (O* p) { free(p); }
+};
+
+template<typename O>
+struct bump_alloc
+{
+	constexpr static const char* name = "bump arena";
+	constexpr static bool cross_thread_free = false; // an arena belongs to one thread
+	util::arena a;
+
+	O* allocate () { return static_cast<O*>(a.allocate(sizeof(O))); }
+	void deallocate (O* p) { a.deallocate(p, sizeof(O)); }
+};
+
+
+/**
+ * Allocates the working set, then frees it in reverse order, over and over.
+ */
+template<typename A, typename O>
+void run_lifo (A& alloc, const config& cfg, sampler& s)
+{
+	std::vector<O*> live(cfg.working_set);
+	uint64_t ops = 0;
+	while (ops < cfg.ops) {
+		for (auto& p : live) {
+			s.op([&] { p = alloc.allocate(); });
+			p->bytes[0] = 1;
+		}
+		for (auto it = live.rbegin(); it != live.rend(); ++it) {
+			s.op([&] { alloc.deallocate(*it); });
+		}
+		ops += 2 * live.size();
+	}
+	s.r.ops = ops;
+}
+
+/**
+ * Keeps the working set live and replaces its oldest object on every step.
+ */
+template<typename A, typename O>
+void run_fifo (A& alloc, const config& cfg, sampler& s)
+{
+	std::vector<O*> live(cfg.working_set);
+	for (auto& p : live) {
+		p = alloc.allocate();
+	}
+	uint64_t ops = 0;
+	for (std::size_t i = 0; ops < cfg.ops; i = (i + 1) % live.size(), ops += 2) {
+		s.op([&] { alloc.deallocate(live[i]); });
+		s.op([&] { live[i] = alloc.allocate(); });
+		live[i]->bytes[0] = 1;
+	}
+	for (auto p : live) {
+		alloc.deallocate(p);
+	}
+	s.r.ops = ops;
+}
+
+/**
+ * Pairs of threads: one allocates and passes objects over a ring, the other frees them.
+ */
+template<typename O>
+struct handoff
+{
+	constexpr static int capacity = 1024;
+	std::atomic<uint64_t> head{0};
+	std::atomic<uint64_t> tail{0};
+	O* slots[capacity];
+
+	void push (O* p) {
+		uint64_t h = head.load(std::memory_order_relaxed);
+		while (h - tail.load(std::memory_order_acquire) == capacity) { std::this_thread::yield(); }
+		slots[h % capacity] = p;
+		head.store(h + 1, std::memory_order_release);
+	}
+	O* pop () {
+		uint64_t t = tail.load(std::memory_order_relaxed);
+		while (head.load(std::memory_order_acquire) == t) { std::this_thread::yield(); }
+		O* p = slots[t % capacity];
+		tail.store(t + 1, std::memory_order_release);
+		return p;
+	}
+};
+
+template<typename A, typename O>
+void run_prodcons (A& alloc, const config& cfg, sampler& s, handoff<O>* ring, bool producer)
+{
+	uint64_t n = cfg.ops;
+	for (uint64_t i = 0; i < n; i++) {
+		if (producer) {
+			O* p;
+			s.op([&] { p = alloc.allocate(); });
+			p->bytes[0] = 1;
+			ring->push(p);
+		} else {
+			O* p = ring->pop();
+			s.op([&] { alloc.deallocate(p); });
+		}
+	}
+	s.r.ops = n;
+}
+
+
+enum pattern { lifo, fifo, prodcons };
+const char* pattern_names[] = { "lifo", "fifo", "prodcons" };
+
+
+template<template<typename> class A, typename O>
+void run_process (shared_state* st, int proc, const config& cfg, pattern pat, shmfixedpool<O,shbench>* pool)
+{
+	std::vector<handoff<O>> rings(cfg.threads / 2 + 1);
+	A<O> shared_alloc;
+	if constexpr (std::is_same<A<O>, shm_alloc<O>>::value) {
+		shared_alloc.pool = pool;
+	}
+
+	std::vector<std::thread> threads;
+	for (int t = 0; t < cfg.threads; t++) {
+		threads.emplace_back([&, t] {
+			thread_result& r = st->results[proc][t];
+			sampler s{r};
+			// malloc and the shared pool are shared by every thread of the process; arenas are not
+			A<O> own_alloc;
+			A<O>& alloc = A<O>::cross_thread_free ? shared_alloc : own_alloc;
+			if constexpr (std::is_same<A<O>, shm_alloc<O>>::value) {
+				own_alloc.pool = pool;
+			}
+
+			st->ready.fetch_add(1);
+			while (!st->go.load(std::memory_order_acquire)) { std::this_thread::yield(); }
+
+			uint64_t t0 = now_ns();
+			switch (pat) {
+			case lifo: run_lifo<A<O>,O>(alloc, cfg, s); break;
+			case fifo: run_fifo<A<O>,O>(alloc, cfg, s); break;
+			case prodcons:
+				if (t / 2 < cfg.threads / 2) {
+					run_prodcons<A<O>,O>(alloc, cfg, s, &rings[t / 2], t % 2 == 0);
+				}
+				break;
+			}
+			r.ns = now_ns() - t0;
+		});
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	st->rss_kb[proc] = ru.ru_maxrss;
+}
+
+
+template<template<typename> class A, typename O>
+void run (shared_state* st, const config& cfg, pattern pat, const char* size_name)
+{
+	if (pat == prodcons && (!A<O>::cross_thread_free || cfg.threads < 2)) {
+		printf("%-14s %-9s %-6s %5d %7d %10s\n", A<O>::name, pattern_names[pat], size_name, cfg.procs, cfg.threads, "n/a");
+		return;
+	}
+
+	memset(st, 0, sizeof(shared_state));
+
+	shmfixedpool<O,shbench> pool;
+	bool shm = std::is_same<A<O>, shm_alloc<O>>::value;
+	if (shm) {
+		pool = shmfixedpool<O,shbench>::attach(sizeof(O) > 64 ? 2 : 1);
+	}
+
+	std::vector<pid_t> children;
+	for (int p = 0; p < cfg.procs; p++) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			run_process<A,O>(st, p, cfg, pat, &pool);
+			_exit(0);
+		}
+		children.push_back(pid);
+	}
+	while (st->ready.load() < cfg.procs * cfg.threads) {
+		usleep(100);
+	}
+	st->go.store(1, std::memory_order_release);
+	for (auto pid : children) {
+		int status;
+		waitpid(pid, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "a benchmark process failed\n");
+		}
+	}
+
+	if (shm) {
+		shmfixedpool<O,shbench>::detach(pool);
+	}
+
+	uint64_t ops = 0, slowest = 1, samples = 0;
+	long rss = 0;
+	uint64_t hist[latency_buckets] = {};
+	for (int p = 0; p < cfg.procs; p++) {
+		rss += st->rss_kb[p];
+		for (int t = 0; t < cfg.threads; t++) {
+			thread_result& r = st->results[p][t];
+			ops += r.ops;
+			slowest = std::max(slowest, r.ns);
+			for (int b = 0; b < latency_buckets; b++) {
+				hist[b] += r.hist[b];
+				samples += r.hist[b];
+			}
+		}
+	}
+
+	uint64_t p50 = 0, p99 = 0, seen = 0;
+	for (int b = 0; b < latency_buckets; b++) {
+		seen += hist[b];
+		if (!p50 && seen * 2 >= samples) p50 = bucket_floor(b);
+		if (!p99 && seen * 100 >= samples * 99) p99 = bucket_floor(b);
+	}
+
+	printf("%-14s %-9s %-6s %5d %7d %10.2f %8lu %8lu %8.1f\n", A<O>::name, pattern_names[pat], size_name,
+	       cfg.procs, cfg.threads, ops * 1e3 / slowest, (unsigned long)p50, (unsigned long)p99, rss / 1024.0);
+	fflush(stdout);
+}
+
+
+template<typename O>
+void run_all (shared_state* st, const config& cfg, const char* size_name, std::initializer_list<pattern> patterns)
+{
+	for (pattern pat : patterns) {
+		run<shm_alloc,O>(st, cfg, pat, size_name);
+		run<malloc_alloc,O>(st, cfg, pat, size_name);
+		run<bump_alloc,O>(st, cfg, pat, size_name);
+	}
+}
+
+
+int main (int argc, char* argv[])
+{
+	config cfg;
+	int opt;
+	while ((opt = getopt(argc, argv, "p:t:n:w:")) != -1) {
+		switch (opt) {
+		case 'p': cfg.procs = atoi(optarg); break;
+		case 't': cfg.threads = atoi(optarg); break;
+		case 'n': cfg.ops = strtoull(optarg, nullptr, 10); break;
+		case 'w': cfg.working_set = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-p processes] [-t threads] [-n operations per thread] [-w working set]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (cfg.procs < 1 || cfg.procs > max_procs || cfg.threads < 1 || cfg.threads > max_threads || cfg.working_set < 1) {
+		fprintf(stderr, "processes and threads must be between 1 and %d\n", max_procs);
+		return 1;
+	}
+
+	log::initialize();
+	mem::shmlog::initialize();
+
+	void* mem = mmap(nullptr, sizeof(shared_state), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	shared_state* st = new (mem) shared_state();
+
+	printf("%-14s %-9s %-6s %5s %7s %10s %8s %8s %8s\n",
+	       "allocator", "pattern", "size", "procs", "threads", "Mops/s", "p50 ns", "p99 ns", "RSS MB");
+	run_all<shmblock<64>>(st, cfg, "64", { lifo, fifo, prodcons });
+	// objects the size of a skiparraylist leaf
+	run_all<shmblock<4096>>(st, cfg, "leaf", { lifo, fifo });
+
+	munmap(mem, sizeof(shared_state));
+	return 0;
+}
@@ -8,7 +8,9 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <mutex>
-#include <shared_mutex>
+#include <algorithm>
+#include <iterator>
+#include <pthread.h>
 #include "util/log.hpp"
 #include "util/errno_exception.hpp"
 
@@ -42,8 +44,7 @@ typedef Log<shmallocator_logger_traits> shmlog;
 template<typename T, typename addr_traits>
 shmfixedpool<T, addr_traits>::shmfixedpool ()
 	:hdr(nullptr),
-	 pool(0),
-	 fh(-1)
+	 pool(0)
 {
 }
 
@@ -51,12 +52,21 @@ shmfixedpool<T, addr_traits>::shmfixedpool ()
 template<typename T, typename addr_traits>
 shmfixedpool<T, addr_traits>::shmfixedpool (shmfixedpool<T,addr_traits>&& moved)
 	:hdr(moved.hdr),
-	 pool(moved.pool),
-	 fh(moved.fh)
+	 pool(moved.pool)
 {
 	moved.hdr = nullptr;
 	moved.pool = 0;
-	moved.fh = -1;
+}
+
+
+template<typename T, typename addr_traits>
+shmfixedpool<T, addr_traits>& shmfixedpool<T, addr_traits>::operator= (shmfixedpool<T,addr_traits>&& moved)
+{
+	hdr = moved.hdr;
+	pool = moved.pool;
+	moved.hdr = nullptr;
+	moved.pool = 0;
+	return *this;
 }
 
 
@@ -67,8 +77,20 @@ shmfixedpool<T, addr_traits>::~shmfixedpool ()
 
 
 template<typename T, typename addr_traits>
-shmfixedpool<T, addr_traits> shmfixedpool<T, addr_traits>::attach (poolid_t poolid)
+shmfixedpool<T, addr_traits> shmfixedpool<T, addr_traits>::attach (poolid_t poolid, int options)
+{
+	return attach_fd(poolid, -1, options);
+}
+
+
+/**
+ * Attaches a pool through a descriptor of its shared memory object, such as one received from
+ * another process, which the pool takes ownership of. With fd -1 the object is opened by name.
+ */
+template<typename T, typename addr_traits>
+shmfixedpool<T, addr_traits> shmfixedpool<T, addr_traits>::attach_fd (poolid_t poolid, int fd, int options)
 {
+	assert(fd == -1 || !(options & attach_persistent));
 	self_t pool = self_t();
 	pool.pool = poolid;
 	
@@ -76,39 +98,73 @@ shmfixedpool<T, addr_traits> shmfixedpool<T, addr_traits>::attach (poolid_t pool
 	void* base_addr = pool.base_address();
 	std::string name = pool.shared_name();
 	bool created = false;
+	bool sole = false;
+	pool_mapping& m = pool.mapping();
+	m.options = options;
   
-	pool.fh = shm_open(name.c_str(), O_RDWR | O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
+	if (fd != -1) {
+		m.fh = fd;
+		m.options |= attach_adopted;
+	} else if (options & attach_persistent) {
+		m.fh = open(pool.backing_path().c_str(), O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
+	} else {
+		m.fh = shm_open(name.c_str(), O_RDWR | O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
+	}
+	if (m.fh == -1) {
+		throw errno_runtime_error;
+	}
+	
+	// The first process to attach a persistent pool holds its file exclusively until the header is
+	// ready; everyone else waits for a shared hold. Holds are dropped by the kernel when a process dies.
+	if (options & attach_persistent) {
+		sole = pool.lock_backing(F_WRLCK, false);
+		if (!sole) {
+			pool.lock_backing(F_RDLCK, true);
+		}
+	}
   
 	// fstat to find if the file is zero length (new)
 	struct stat statbuf;
-	fstat(pool.fh, &statbuf);
+	fstat(m.fh, &statbuf);
 	
 	if (statbuf.st_size == 0) {
 		created = true;
 		total_size = pool.initial_size();
-		ftruncate(pool.fh, total_size); 
+		ftruncate(m.fh, total_size); 
 	} else {
 		total_size = statbuf.st_size;
 	}
 	
-	int flags =
-		MAP_SHARED | // allow other processes
-		MAP_FIXED; // use this address exactly
-	
-	void *result = mmap (base_addr, total_size, PROT_READ|PROT_WRITE,
-											 flags, pool.fh, 0); // -1 fd and 0 file offset
-	
-	assert(base_addr == result);
+	map_range(poolid, 0, total_size);
 	
 	if (created) {
 		pool.hdr = new (base_addr) header_t();
-		pool.hdr->mut.lock();
+		lock_header(pool.hdr);
 		pool.hdr->capacity = total_size;
+		pool.hdr->stats.initialize(sizeof(T), addr_traits::rid, poolid);
+		update_stats(pool.hdr);
 		pool.hdr->mut.unlock();
-		std::cout << "Created." << std::endl;
+		shmlog::info("Created a shared pool.");
 	} else {
 		pool.hdr = reinterpret_cast<header_t*>(base_addr);
-		std::cout << "Attached." << std::endl;
+		if (sole && !pool.hdr->clean) {
+			// nobody is attached, yet the last process to use the pool did not detach from it
+			recover_header(pool.hdr, total_size);
+		}
+		shmlog::info("Attached a shared pool.");
+	}
+	
+	lock_header(pool.hdr);
+	++(pool.hdr->refcnt);
+	pool.hdr->clean = 0;
+	pool.hdr->mut.unlock();
+	m.generation = pool.hdr->generation.load(std::memory_order_acquire);
+	
+	if (options & attach_persistent) {
+		pool.sync_header();
+		if (sole) {
+			pool.lock_backing(F_RDLCK, true);
+		}
 	}
 	
 	return pool;
@@ -120,22 +176,51 @@ void shmfixedpool<T, addr_traits>::detach (shmfixedpool<T, addr_traits>& pool)
 {
 	assert(pool.hdr != nullptr);
 	bool last = false;
+	
+	cache_t::flush_all(pool.pool);
 
-	pool.hdr->mut.lock();
+	lock_header(pool.hdr);
 	int16_t refcnt = --(pool.hdr->refcnt);
-	auto size = pool.hdr->capacity;
+	pool_mapping& m = pool.mapping();
+	auto size = m.mapped;
 	if (refcnt == 0) {
 		last = true;
 	}
 	pool.hdr->mut.unlock();
 	
+	if (m.options & attach_persistent) {
+		if (last) {
+			pool.checkpoint();
+			lock_header(pool.hdr);
+			pool.hdr->clean = (pool.hdr->refcnt == 0);
+			pool.hdr->mut.unlock();
+			pool.sync_header();
+		}
+		if (munmap(pool.base_address(), size)) {
+			throw errno_runtime_error;
+		}
+		close(m.fh);
+		m = pool_mapping();
+		return;
+	}
+	
 	if (munmap(pool.base_address(), size)) {
 		throw errno_runtime_error;
 	}
+	close(m.fh);
+	int options = m.options;
+	m = pool_mapping();
+	
+	// processes that are still attached keep the name, so that others can join them
+	if (!last) {
+		return;
+	}
 	
 	int unlink_result = shm_unlink(pool.shared_name().c_str());
 	if (unlink_result) {
-		if (errno == EACCES) {
+		if (errno == ENOENT && (options & attach_adopted)) {
+			// the object was handed over without a name, as memfds are
+		} else if (errno == EACCES) {
 			// This can be OK - it would mean that another process could have mapped
 			// the object since the time at which we did pool.hdr->unlock()
 			shmlog::warning("A call to shm_unlink failed with EACCESS.");
@@ -153,31 +238,38 @@ void shmfixedpool<T, addr_traits>::detach (shmfixedpool<T, addr_traits>& pool)
 template<typename T, typename addr_traits>
 T* shmfixedpool<T,addr_traits>::allocate (std::size_t n)
 {
-	assert(n==1);
-
-	this->hdr->mut.lock();
+	if (n != 1) {
+		return allocate_contiguous(n);
+	}
 	
-	// look first in the free list
-	if (this->hdr->fl.size() > 0) {
-		free_object& fo = this->hdr->fl.back();
-		this->hdr->fl.pop_back();
-		this->hdr->mut.unlock();
-		T* objbytes = reinterpret_cast<T*>(&fo);
-		return objbytes;
+	// look first in this thread's magazine, which touches no shared state
+	auto mag = cache_t::local().find(pool);
+	if (mag) {
+		if (mag->count == 0) {
+			mag->count = allocate_shared(mag->slots, cache_t::batch_size);
+		}
+		if (mag->count > 0) {
+			hdr->stats.count_allocs(1);
+			return mag->slots[--mag->count];
+		}
 	}
 	
-	// failing the free list, use uncommitted objects
-	if (this->hdr->size + sizeof(T) <= this->hdr->capacity) {
-		void* ptr = (void*)((uint64_t)(start_address()) + this->hdr->size);
-		this->hdr->size += sizeof(T);
-		this->hdr->mut.unlock();
-		return reinterpret_cast<T*>(ptr);
+	return allocate_uncached();
+}
+
+
+template<typename T, typename addr_traits>
+T* shmfixedpool<T,addr_traits>::allocate_uncached ()
+{
+	T* obj = nullptr;
+	if (allocate_shared(&obj, 1) == 1) {
+		hdr->stats.count_allocs(1);
+		return obj;
 	}
 	
-	// failing uncommitted objects, allocate a new segment
-	uint64_t deficit = this->hdr->size + sizeof(T) - this->hdr->capacity;
+	// the pool has already grown into every segment its address space allows
+	uint64_t deficit = header_space() + this->hdr->size + sizeof(T) - this->hdr->capacity;
 	throw reallocation_request(addr_traits::rid,pool,deficit);
-	
 }
 
 
@@ -185,16 +277,779 @@ template<typename T, typename addr_traits>
 void shmfixedpool<T,addr_traits>::deallocate (T* ptr, size_t s) 
 {
 	assert(addr_traits::regionid(ptr) == addr_traits::rid);
-	assert(s == 1);
-	int poolid = addr_traits::poolid(ptr);
+	assert(addr_traits::poolid(ptr) == pool);
+	
+	if (s != 1) {
+		deallocate_contiguous(ptr, s);
+		return;
+	}
+	
+	auto mag = cache_t::local().find(pool);
+	if (mag) {
+		if (mag->count == cache_t::magazine_size) {
+			// drain the coldest half of the magazine back to the pool
+			deallocate_shared(pool, mag->slots, cache_t::batch_size);
+			std::copy(mag->slots + cache_t::batch_size, mag->slots + mag->count, mag->slots);
+			mag->count -= cache_t::batch_size;
+		}
+		mag->slots[mag->count++] = ptr;
+		hdr->stats.count_frees(1);
+		return;
+	}
+	
+	deallocate_uncached(ptr);
+}
+
+
+template<typename T, typename addr_traits>
+void shmfixedpool<T,addr_traits>::deallocate_uncached (T* ptr)
+{
+	deallocate_shared(pool, &ptr, 1);
+	hdr->stats.count_frees(1);
+}
+
+
+/**
+ * Takes the header lock. A holder that died mid-operation may have left the free list
+ * inconsistent; there is no way to repair it here, so this is only reported.
+ */
+template<typename T, typename addr_traits>
+void shmfixedpool<T,addr_traits>::lock_header (header_t* hdr)
+{
+	if (hdr->mut.try_lock()) {
+		return;
+	}
+	hdr->stats.count_lock_wait();
+	if (hdr->mut.lock()) {
+		shmlog::error("Recovered the lock of a shared pool from a process that died holding it.");
+	}
+}
+
+
+/**
+ * Mirrors the header's sizes into the stats page. Must be called with the header lock held.
+ */
+template<typename T, typename addr_traits>
+void shmfixedpool<T,addr_traits>::update_stats (header_t* hdr)
+{
+	hdr->stats.capacity.store(hdr->capacity, std::memory_order_relaxed);
+	hdr->stats.committed.store(hdr->size, std::memory_order_relaxed);
+	hdr->stats.free_objects.store(hdr->fl.size(), std::memory_order_relaxed);
+}
+
+
+/**
+ * Obtains n objects, not necessarily contiguous, with at most one synchronization with the shared pool.
+ */
+template<typename T, typename addr_traits>
+void shmfixedpool<T,addr_traits>::allocate_batch (T** objs, std::size_t n)
+{
+	std::size_t got = 0;
+	
+	auto mag = cache_t::local().find(pool);
+	if (mag) {
+		while (got < n && mag->count > 0) {
+			objs[got++] = mag->slots[--mag->count];
+		}
+	}
+	
+	if (got < n) {
+		got += allocate_shared(objs + got, n - got);
+	}
+	
+	if (got < n) {
+		deallocate_shared(pool, objs, got);
+		uint64_t deficit = (n - got) * sizeof(T);
+		throw reallocation_request(addr_traits::rid,pool,deficit);
+	}
+	hdr->stats.count_allocs(n);
+}
+
+
+/**
+ * Returns n objects, not necessarily contiguous, to the shared pool under a single lock.
+ */
+template<typename T, typename addr_traits>
+void shmfixedpool<T,addr_traits>::deallocate_batch (T** objs, std::size_t n)
+{
+	deallocate_shared(pool, objs, n);
+	hdr->stats.count_frees(n);
+}
+
+
+/**
+ * Takes n contiguous objects from the first freed run that is long enough, or failing that carves
+ * them out of uncommitted space, growing the pool if necessary. The free list of single objects is
+ * not consulted, since its objects are not generally adjacent.
+ */
+template<typename T, typename addr_traits>
+T* shmfixedpool<T,addr_traits>::allocate_contiguous (std::size_t n)
+{
+	uint64_t bytes = n * sizeof(T);
+	
+	lock_header(hdr);
+	refresh();
+	
+	for (auto it = hdr->runs.begin(); it != hdr->runs.end(); ++it) {
+		if (it->count < n) {
+			continue;
+		}
+		// the run gives up its tail, so that what is left of it stays where it is
+		free_run& run = *it;
+		T* first = reinterpret_cast<T*>(&run);
+		uint64_t left = run.count - n;
+		if (left < 2) {
+			hdr->runs.erase(it);
+			run.~free_run();
+			if (left == 1) {
+				free_object* fo = new (first) free_object();
+				hdr->fl.push_back(*fo);
+			}
+		} else {
+			run.count = left;
+		}
+		hdr->stats.count_process(n, mapping().stats_slot);
+		update_stats(hdr);
+		hdr->mut.unlock();
+		hdr->stats.count_allocs(n);
+		return first + left;
+	}
+	
+	while (header_space() + hdr->size + bytes > hdr->capacity) {
+		uint64_t deficit = header_space() + hdr->size + bytes - hdr->capacity;
+		if (!grow(deficit)) {
+			hdr->mut.unlock();
+			throw reallocation_request(addr_traits::rid,pool,deficit);
+		}
+	}
+	
+	void* ptr = (void*)((uint64_t)(start_address()) + hdr->size);
+	hdr->size += bytes;
+	
+	hdr->stats.count_process(n, mapping().stats_slot);
+	update_stats(hdr);
+	hdr->mut.unlock();
+	hdr->stats.count_allocs(n);
+	return reinterpret_cast<T*>(ptr);
+}
+
+
+/**
+ * Returns a run of n contiguous objects to the list of freed runs, merging it with the runs next to
+ * it. Freed runs are not trimmed, so their segments stay committed until a run is taken again.
+ */
+template<typename T, typename addr_traits>
+void shmfixedpool<T,addr_traits>::deallocate_contiguous (T* p, std::size_t n)
+{
+	if (n == 0) {
+		return;
+	}
+	assert(n >= 2);
+	
+	lock_header(hdr);
+	refresh();
+	auto next = std::find_if(hdr->runs.begin(), hdr->runs.end(), [p] (free_run& r) { return (void*)&r > (void*)p; });
+	free_run* run = nullptr;
+	if (next != hdr->runs.begin()) {
+		free_run& prev = *std::prev(next);
+		if (reinterpret_cast<T*>(&prev) + prev.count == p) {
+			prev.count += n;
+			run = &prev;
+		}
+	}
+	if (!run) {
+		run = new (p) free_run();
+		run->count = n;
+		hdr->runs.insert(next, *run);
+	}
+	if (next != hdr->runs.end() && reinterpret_cast<T*>(run) + run->count == reinterpret_cast<T*>(&*next)) {
+		free_run& merged = *next;
+		run->count += merged.count;
+		hdr->runs.erase(next);
+		merged.~free_run();
+	}
+	hdr->stats.count_process(-(int64_t)n, mapping().stats_slot);
+	update_stats(hdr);
+	hdr->mut.unlock();
+	hdr->stats.count_frees(n);
+}
+
 
-	hdr->mut.lock();
+/**
+ * Takes up to n objects from the shared pool under a single lock, first from the free list and
+ * then from uncommitted space, growing the pool if necessary. Returns the number of objects obtained.
+ */
+template<typename T, typename addr_traits>
+std::size_t shmfixedpool<T,addr_traits>::allocate_shared (T** objs, std::size_t n)
+{
+	std::size_t got = 0;
+	
+	lock_header(hdr);
+	
+	// map any segments that other processes have grown the pool into
+	refresh();
+	
+	// look first in the free list, then in segments that were released to the OS
+	while (got < n && (hdr->fl.size() > 0 || reclaim_released_segment(pool))) {
+		free_object& fo = hdr->fl.back();
+		hdr->fl.pop_back();
+		fo.~free_object();
+		objs[got++] = reinterpret_cast<T*>(&fo);
+	}
+	
+	// failing the free list, use uncommitted objects
+	while (got < n) {
+		if (header_space() + hdr->size + sizeof(T) > hdr->capacity) {
+			uint64_t deficit = header_space() + hdr->size + (n - got) * sizeof(T) - hdr->capacity;
+			if (!grow(deficit)) {
+				break;
+			}
+		}
+		void* ptr = (void*)((uint64_t)(start_address()) + hdr->size);
+		hdr->size += sizeof(T);
+		objs[got++] = reinterpret_cast<T*>(ptr);
+	}
+	
+	hdr->stats.count_process((int64_t)got, mapping().stats_slot);
+	update_stats(hdr);
+	hdr->mut.unlock();
+	return got;
+}
+
+
+/**
+ * Returns n objects to the shared pool's free list under a single lock.
+ */
+template<typename T, typename addr_traits>
+void shmfixedpool<T,addr_traits>::deallocate_shared (poolid_t poolid, T** objs, std::size_t n)
+{
+	header_t* hdr = header(poolid);
 	
+	lock_header(hdr);
+	// the tail of the free list may lie in segments another process grew the pool into
+	refresh(poolid);
+	for (std::size_t i=0; i < n; i++) {
+		free_object* fo = new (objs[i]) free_object();
+		hdr->fl.push_back(*fo);
+	}
+	note_freed(poolid, n);
+	hdr->stats.count_process(-(int64_t)n, local_mapping<addr_traits>(poolid).stats_slot);
+	update_stats(hdr);
+	hdr->mut.unlock();
+}
+
+
+/**
+ * Returns the pages of every fully free segment to the OS.
+ */
+template<typename T, typename addr_traits>
+void shmfixedpool<T,addr_traits>::trim ()
+{
+	lock_header(hdr);
+	refresh();
+	release_free_segments(pool);
+	hdr->mut.unlock();
+}
+
+
+/**
+ * Makes the pool's committed objects durable in its backing file, then records the header in the
+ * older of its two checkpoint slots. After a crash, attach() rolls the header back to the newest
+ * valid checkpoint. Only meaningful for pools attached with attach_persistent.
+ */
+template<typename T, typename addr_traits>
+void shmfixedpool<T,addr_traits>::checkpoint ()
+{
+	assert(mapping().options & attach_persistent);
 	
+	pool_checkpoint rec;
+	lock_header(hdr);
+	rec.capacity = hdr->capacity;
+	rec.size = hdr->size;
+	rec.generation = hdr->generation.load(std::memory_order_relaxed);
+	rec.root = hdr->root.load(std::memory_order_relaxed);
+	rec.sequence = std::max(hdr->log[0].sequence, hdr->log[1].sequence) + 1;
+	hdr->mut.unlock();
 	
+	// objects are synced without the lock, so that allocation carries on meanwhile
+	refresh();
+	if (rec.size > 0 && msync(start_address(), rec.size, MS_SYNC)) {
+		throw errno_runtime_error;
+	}
+	rec.seal();
 	
+	lock_header(hdr);
+	if (rec.sequence > std::max(hdr->log[0].sequence, hdr->log[1].sequence)) {
+		hdr->log[rec.sequence % 2] = rec;
+	}
 	hdr->mut.unlock();
+	sync_header();
+}
+
+
+/**
+ * Rolls the header of a persistent pool back to its newest valid checkpoint after the processes
+ * using it died. The free lists and released segments are not trusted and start out empty, so objects
+ * that were free at the time of the crash are leaked rather than risk handing out a live one twice.
+ * Without a checkpoint the pool starts out empty. Called before any other process can attach.
+ */
+template<typename T, typename addr_traits>
+void shmfixedpool<T,addr_traits>::recover_header (header_t* hdr, uint64_t file_size)
+{
+	const pool_checkpoint* rec = nullptr;
+	for (auto& l : hdr->log) {
+		if (l.valid() && (!rec || l.sequence > rec->sequence)) {
+			rec = &l;
+		}
+	}
+	
+	new (&hdr->mut) shmrwlock();
+	new (&hdr->fl) free_list();
+	new (&hdr->runs) run_list();
+	hdr->refcnt = 0;
+	hdr->freed_since_trim = 0;
+	std::fill(std::begin(hdr->released), std::end(hdr->released), 0);
+	hdr->stats.released_segments.store(0, std::memory_order_relaxed);
+	hdr->capacity = file_size;
+	
+	if (rec) {
+		hdr->size = std::min(rec->size, file_size - header_space());
+		hdr->root.store(rec->root, std::memory_order_relaxed);
+		hdr->generation.store(rec->generation + 1, std::memory_order_relaxed);
+		shmlog::warning("Recovered a persistent pool from its last checkpoint.");
+	} else {
+		hdr->size = 0;
+		hdr->root.store(0, std::memory_order_relaxed);
+		hdr->generation.fetch_add(1, std::memory_order_relaxed);
+		shmlog::error("A persistent pool was left inconsistent and had no checkpoint; it starts out empty.");
+	}
+	update_stats(hdr);
+}
+
+
+/**
+ * Takes an open file description lock on the whole backing file. Unlike flock(), these convert
+ * between exclusive and shared atomically. Returns false if the lock is held and wait is false.
+ */
+template<typename T, typename addr_traits>
+bool shmfixedpool<T,addr_traits>::lock_backing (short type, bool wait)
+{
+	struct flock fl = {};
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = 0;
+	fl.l_len = 0;
+	if (fcntl(mapping().fh, wait ? F_OFD_SETLKW : F_OFD_SETLK, &fl) == 0) {
+		return true;
+	}
+	if (!wait && (errno == EAGAIN || errno == EACCES)) {
+		return false;
+	}
+	throw errno_runtime_error;
+}
+
+
+template<typename T, typename addr_traits>
+void shmfixedpool<T,addr_traits>::sync_header ()
+{
+	if (msync(base_address(), header_space(), MS_SYNC)) {
+		throw errno_runtime_error;
+	}
+}
+
+
+/**
+ * Counts freed objects towards the next automatic trim. Must be called with the header lock held.
+ */
+template<typename T, typename addr_traits>
+void shmfixedpool<T,addr_traits>::note_freed (poolid_t poolid, uint64_t n)
+{
+	header_t* hdr = header(poolid);
+	hdr->freed_since_trim += n;
+	if (hdr->freed_since_trim >= trim_threshold(hdr)) {
+		release_free_segments(poolid);
+	}
+}
+
+
+/**
+ * Finds committed segments that only free objects overlap, takes the objects that start in them
+ * off the free list, and punches their pages out of the shared object. A released segment reads as
+ * zeros and is faulted in again on its next use. Must be called with the header lock held.
+ *
+ * A free object that reaches into a segment from the one before stays on the free list, so a
+ * segment is kept if that object's free list hook would be cut by the boundary.
+ */
+template<typename T, typename addr_traits>
+void shmfixedpool<T,addr_traits>::release_free_segments (poolid_t poolid)
+{
+	header_t* hdr = header(poolid);
+	hdr->freed_since_trim = 0;
+	
+	constexpr uint64_t seg = addr_traits::segment_size;
+	if (seg % sysconf(_SC_PAGESIZE) != 0) {
+		return;
+	}
 	
+	uint64_t start = (uint64_t)start_address(poolid);
+	uint64_t full_segments = hdr->size / seg;
+	if (full_segments == 0 || hdr->fl.empty()) {
+		return;
+	}
+	
+	// count the free objects that overlap each segment
+	std::vector<uint32_t> free_count(full_segments, 0);
+	for (auto& fo : hdr->fl) {
+		uint64_t ofs = (uint64_t)&fo - start;
+		uint64_t last = std::min((ofs + sizeof(T) - 1) / seg, full_segments - 1);
+		for (uint64_t r = ofs / seg; r <= last; r++) {
+			free_count[r]++;
+		}
+	}
+	
+	auto is_released = [hdr] (uint64_t r) { return hdr->released[r / 64] & (1ULL << (r % 64)); };
+	
+	std::vector<bool> release(full_segments, false);
+	bool any = false;
+	for (uint64_t r=0; r < full_segments; r++) {
+		uint64_t first_obj = (r * seg) / sizeof(T);
+		uint64_t last_obj = ((r + 1) * seg - 1) / sizeof(T);
+		// an object reaching in from a released segment is parked, so it is free but not on the list
+		if ((first_obj * sizeof(T)) / seg < r && is_released((first_obj * sizeof(T)) / seg)) {
+			free_count[r]++;
+		}
+		// the hook of a free object reaching in from a segment that is not released would be zeroed
+		uint64_t reaching = first_obj * sizeof(T);
+		bool cuts_hook = reaching < r * seg && !is_released(reaching / seg) && !release[reaching / seg] &&
+		                 reaching + sizeof(free_object) > r * seg;
+		if (!is_released(r) && !cuts_hook && free_count[r] == last_obj - first_obj + 1) {
+			release[r] = true;
+			any = true;
+		}
+	}
+	if (!any) {
+		return;
+	}
+	
+	// park the objects that start in released segments, since their free list hooks are about to vanish
+	for (auto it = hdr->fl.begin(); it != hdr->fl.end(); ) {
+		uint64_t r = ((uint64_t)&*it - start) / seg;
+		if (r < full_segments && release[r]) {
+			it = hdr->fl.erase(it);
+		} else {
+			++it;
+		}
+	}
+	
+	for (uint64_t r=0; r < full_segments; r++) {
+		if (!release[r]) {
+			continue;
+		}
+		if (madvise((void*)(start + r * seg), seg, MADV_REMOVE)) {
+			shmlog::warning("Could not release the pages of a free segment.");
+		}
+		hdr->released[r / 64] |= (1ULL << (r % 64));
+		hdr->stats.released_segments.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+
+/**
+ * Puts the objects that start in one released segment back on the free list, faulting its pages
+ * in again. Returns false if no released segment holds the start of an object. Must be called with the header lock held.
+ */
+template<typename T, typename addr_traits>
+bool shmfixedpool<T,addr_traits>::reclaim_released_segment (poolid_t poolid)
+{
+	header_t* hdr = header(poolid);
+	constexpr uint64_t seg = addr_traits::segment_size;
+	constexpr int words = sizeof(hdr->released) / sizeof(uint64_t);
+	
+	for (int w=0; w < words; w++) {
+		while (hdr->released[w] != 0) {
+			uint64_t r = w * 64 + __builtin_ctzll(hdr->released[w]);
+			hdr->released[w] &= ~(1ULL << (r % 64));
+			hdr->stats.released_segments.fetch_sub(1, std::memory_order_relaxed);
+			
+			uint64_t start = (uint64_t)start_address(poolid);
+			uint64_t first_obj = (r * seg + sizeof(T) - 1) / sizeof(T);
+			uint64_t end_obj = std::min(((r + 1) * seg + sizeof(T) - 1) / sizeof(T), hdr->size / sizeof(T));
+			for (uint64_t k = first_obj; k < end_obj; k++) {
+				free_object* fo = new ((void*)(start + k * sizeof(T))) free_object();
+				hdr->fl.push_back(*fo);
+			}
+			if (first_obj < end_obj) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+
+/**
+ * Extends the shared object and maps the new segments at their fixed addresses, at least doubling
+ * the capacity. Must be called with the header lock held. Other processes pick up the new segments
+ * lazily through the header generation. Returns false if the pool cannot grow any further.
+ */
+template<typename T, typename addr_traits>
+bool shmfixedpool<T,addr_traits>::grow (uint64_t deficit)
+{
+	uint64_t cap = hdr->capacity;
+	if (cap >= max_size()) {
+		return false;
+	}
+	
+	uint64_t wanted = std::max(cap * 2, cap + deficit);
+	wanted = ((wanted + addr_traits::segment_size - 1) / addr_traits::segment_size) * addr_traits::segment_size;
+	wanted = std::min(wanted, max_size());
+	
+	pool_mapping& m = mapping();
+	if (ftruncate(m.fh, wanted)) {
+		throw errno_runtime_error;
+	}
+	map_range(pool, m.mapped, wanted);
+	
+	hdr->capacity = wanted;
+	m.generation = hdr->generation.fetch_add(1, std::memory_order_release) + 1;
+	hdr->stats.growths.fetch_add(1, std::memory_order_relaxed);
+	hdr->stats.last_grower.store(getpid(), std::memory_order_relaxed);
+	shmlog::info("Grew a shared pool.");
+	
+	return true;
+}
+
+
+/**
+ * Maps [from,to) bytes of the shared object at their fixed addresses in this pool,
+ * applying the page options the pool was attached with.
+ */
+template<typename T, typename addr_traits>
+void shmfixedpool<T,addr_traits>::map_range (poolid_t poolid, uint64_t from, uint64_t to)
+{
+	int flags =
+		MAP_SHARED | // allow other processes
+		MAP_FIXED; // use this address exactly
+	
+	pool_mapping& m = local_mapping<addr_traits>(poolid);
+	void* addr = (void*)((uint64_t)addr_traits::base_address(poolid) + from);
+	void* result = mmap(addr, to - from, PROT_READ|PROT_WRITE, flags, m.fh, from);
+	if (result == MAP_FAILED) {
+		throw errno_runtime_error;
+	}
+	assert(result == addr);
+	m.mapped = to;
+	
+	if (m.options & attach_hugepages) {
+		advise_hugepages(addr, to - from);
+	}
+	if (m.options & attach_prefault) {
+		prefault(addr, to - from);
+	}
+}
+
+
+/**
+ * Asks for transparent huge pages on a mapping. Shared memory only gets them when
+ * /sys/kernel/mm/transparent_hugepage/shmem_enabled allows it; otherwise the mapping
+ * quietly stays on base pages.
+ */
+template<typename T, typename addr_traits>
+void shmfixedpool<T,addr_traits>::advise_hugepages (void* addr, uint64_t len)
+{
+	if (madvise(addr, len, MADV_HUGEPAGE)) {
+		shmlog::fuss("Transparent huge pages are unavailable; using base pages.");
+	}
+}
+
+
+/**
+ * Faults in every page of a mapping for writing, so that first touches do not fault later.
+ * Falls back to touching each page on kernels without MADV_POPULATE_WRITE.
+ */
+template<typename T, typename addr_traits>
+void shmfixedpool<T,addr_traits>::prefault (void* addr, uint64_t len)
+{
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+	if (madvise(addr, len, MADV_POPULATE_WRITE) == 0) {
+		return;
+	}
+	// an atomic add of zero write-faults the page without racing other processes' stores
+	long pagesize = sysconf(_SC_PAGESIZE);
+	for (uint64_t ofs = 0; ofs < len; ofs += pagesize) {
+		__atomic_fetch_add(reinterpret_cast<uint64_t*>((uint64_t)addr + ofs), 0, __ATOMIC_RELAXED);
+	}
+}
+
+
+/**
+ * Maps any segments that another process has grown the pool into since we last looked.
+ * Must be called with the header lock held, which also keeps this process's threads from mapping
+ * the same range twice.
+ */
+template<typename T, typename addr_traits>
+void shmfixedpool<T,addr_traits>::refresh (poolid_t poolid)
+{
+	header_t* hdr = header(poolid);
+	pool_mapping& m = local_mapping<addr_traits>(poolid);
+	uint64_t gen = hdr->generation.load(std::memory_order_acquire);
+	if (gen == m.generation) {
+		return;
+	}
+	uint64_t cap = hdr->capacity;
+	if (cap > m.mapped) {
+		map_range(poolid, m.mapped, cap);
+	}
+	m.generation = gen;
+}
+
+
+/**
+ * Makes sure that an address inside this pool (typically one received from another process)
+ * is mapped before it is dereferenced.
+ */
+template<typename T, typename addr_traits>
+void shmfixedpool<T,addr_traits>::ensure_mapped (const void* ptr)
+{
+	assert(addr_traits::poolid((void*)ptr) == pool);
+	if ((uint64_t)ptr - (uint64_t)base_address() >= mapping().mapped) {
+		lock_header(hdr);
+		refresh();
+		hdr->mut.unlock();
+	}
+}
+
+
+template<typename T, typename addr_traits>
+shmthreadcache<T,addr_traits>::shmthreadcache ()
+{
+	for (auto& mag : mags) {
+		mag.pool = 0;
+		mag.used = false;
+		mag.count = 0;
+	}
+	std::lock_guard<std::mutex> lock(registry_mutex());
+	registry().push_back(this);
+}
+
+
+template<typename T, typename addr_traits>
+shmthreadcache<T,addr_traits>::~shmthreadcache ()
+{
+	{
+		std::lock_guard<std::mutex> lock(registry_mutex());
+		auto& reg = registry();
+		reg.erase(std::remove(reg.begin(), reg.end(), this), reg.end());
+	}
+	for (auto& mag : mags) {
+		if (mag.used) {
+			flush(mag.pool);
+		}
+	}
+}
+
+
+template<typename T, typename addr_traits>
+shmthreadcache<T,addr_traits>& shmthreadcache<T,addr_traits>::local ()
+{
+	static thread_local self_t cache;
+	return cache;
+}
+
+
+/**
+ * Finds (or claims) this thread's magazine for a pool. Returns nullptr if all magazines are
+ * taken by other pools, in which case the caller goes straight to the shared pool.
+ */
+template<typename T, typename addr_traits>
+typename shmthreadcache<T,addr_traits>::magazine* shmthreadcache<T,addr_traits>::find (poolid_t pool)
+{
+	magazine* unused = nullptr;
+	for (auto& mag : mags) {
+		if (mag.used && mag.pool == pool) {
+			return &mag;
+		} else if (!mag.used && !unused) {
+			unused = &mag;
+		}
+	}
+	if (unused) {
+		unused->pool = pool;
+		unused->used = true;
+		unused->count = 0;
+	}
+	return unused;
+}
+
+
+/**
+ * Drains this thread's magazine for a pool back to the shared free list and releases it.
+ */
+template<typename T, typename addr_traits>
+void shmthreadcache<T,addr_traits>::flush (poolid_t pool)
+{
+	for (auto& mag : mags) {
+		if (mag.used && mag.pool == pool) {
+			if (mag.count > 0) {
+				pool_t::deallocate_shared(pool, mag.slots, mag.count);
+			}
+			mag.count = 0;
+			mag.used = false;
+		}
+	}
+}
+
+
+/**
+ * Drains every thread's magazine for a pool. Called when the process detaches from the pool;
+ * other threads must not be using the pool concurrently.
+ */
+template<typename T, typename addr_traits>
+void shmthreadcache<T,addr_traits>::flush_all (poolid_t pool)
+{
+	std::lock_guard<std::mutex> lock(registry_mutex());
+	for (auto cache : registry()) {
+		cache->flush(pool);
+	}
+}
+
+
+/**
+ * A forked child inherits copies of every thread's magazines, whose objects still belong
+ * to the parent. The child must drop them without returning them to the pool.
+ */
+template<typename T, typename addr_traits>
+void shmthreadcache<T,addr_traits>::forget_after_fork ()
+{
+	for (auto cache : registry()) {
+		for (auto& mag : cache->mags) {
+			mag.count = 0;
+			mag.used = false;
+		}
+	}
+	registry_mutex().unlock();
+}
+
+
+template<typename T, typename addr_traits>
+std::mutex& shmthreadcache<T,addr_traits>::registry_mutex ()
+{
+	static std::mutex mut;
+	return mut;
+}
+
+
+template<typename T, typename addr_traits>
+std::vector<shmthreadcache<T,addr_traits>*>& shmthreadcache<T,addr_traits>::registry ()
+{
+	static std::vector<self_t*>* reg = [] {
+		pthread_atfork([] { registry_mutex().lock(); },
+		               [] { registry_mutex().unlock(); },
+		               &forget_after_fork);
+		return new std::vector<self_t*>();
+	}();
+	return *reg;
 }
 
 
@@ -207,14 +1062,145 @@ std::string shmfixedpool<T,addr_traits>::shared_name ()
 	ss << "/" << appName << "-pool-" << std::hex
 		 << addr_traits::regionid_bits << "."
 		 << addr_traits::rid << "."
-		 << this->pool;
+		 << (uint64_t)this->pool;
 	return ss.str();
 }
 
+/**
+ * The file that backs a persistent pool, named like its shared memory object.
+ */
+template<typename T, typename addr_traits>
+std::string shmfixedpool<T,addr_traits>::backing_path ()
+{
+	return pool_directory() + shared_name();
+}
+
+template<typename addr_traits>
+shmheap<addr_traits>& shmheap<addr_traits>::instance ()
+{
+	static self_t heap;
+	return heap;
 }
 
 
-template<>
-FILE* mem::shmlog::logfile;
+/**
+ * Attaches the pools of every size class, at consecutive pool ids starting from first_pool.
+ */
+template<typename addr_traits>
+void shmheap<addr_traits>::attach (poolid_t first_pool, int options)
+{
+	static_assert(shmheap_num_classes <= addr_traits::poolid_space, "Not enough pool ids for the heap's size classes.");
+	assert(!attached());
+	assert(first_pool + shmheap_num_classes <= addr_traits::poolid_space);
+	
+	self_t& heap = instance();
+	heap.first_pool = first_pool;
+	heap.attach_pools(options, std::make_index_sequence<shmheap_num_classes>());
+}
+
+
+template<typename addr_traits>
+void shmheap<addr_traits>::detach ()
+{
+	assert(attached());
+	self_t& heap = instance();
+	heap.detach_pools(std::make_index_sequence<shmheap_num_classes>());
+	heap.first_pool = invalid_pool;
+}
+
+
+template<typename addr_traits>
+void* shmheap<addr_traits>::allocate (std::size_t bytes)
+{
+	if (bytes <= shmheap_max_class_size) {
+		return allocate_in(size_class(bytes), 1, std::make_index_sequence<shmheap_num_classes>());
+	}
+	std::size_t n = (bytes + shmheap_max_class_size - 1) / shmheap_max_class_size;
+	return allocate_in(shmheap_num_classes - 1, n, std::make_index_sequence<shmheap_num_classes>());
+}
+
+
+/**
+ * Frees a block whose size class is implied by its address. Only valid for requests that fit
+ * in a size class.
+ */
+template<typename addr_traits>
+void shmheap<addr_traits>::deallocate (void* ptr)
+{
+	std::size_t cls = addr_traits::poolid(ptr) - first_pool;
+	assert(cls < shmheap_num_classes);
+	deallocate_in(cls, ptr, 1, std::make_index_sequence<shmheap_num_classes>());
+}
+
+
+template<typename addr_traits>
+void shmheap<addr_traits>::deallocate (void* ptr, std::size_t bytes)
+{
+	if (bytes <= shmheap_max_class_size) {
+		deallocate(ptr);
+		return;
+	}
+	std::size_t n = (bytes + shmheap_max_class_size - 1) / shmheap_max_class_size;
+	deallocate_in(shmheap_num_classes - 1, ptr, n, std::make_index_sequence<shmheap_num_classes>());
+}
+
+
+/**
+ * Makes sure that a block received from another process is mapped before it is read.
+ */
+template<typename addr_traits>
+void shmheap<addr_traits>::ensure_mapped (const void* ptr)
+{
+	std::size_t cls = addr_traits::poolid((void*)ptr) - first_pool;
+	assert(cls < shmheap_num_classes);
+	ensure_mapped_in(cls, ptr, std::make_index_sequence<shmheap_num_classes>());
+}
+
 
+template<typename addr_traits>
+template<std::size_t... C>
+void shmheap<addr_traits>::attach_pools (int options, std::index_sequence<C...>)
+{
+	((std::get<C>(pools) = pool_t<C>::attach(first_pool + C, options)), ...);
+}
+
+
+template<typename addr_traits>
+template<std::size_t... C>
+void shmheap<addr_traits>::detach_pools (std::index_sequence<C...>)
+{
+	(pool_t<C>::detach(std::get<C>(pools)), ...);
+}
+
+
+template<typename addr_traits>
+template<std::size_t... C>
+void* shmheap<addr_traits>::allocate_in (std::size_t cls, std::size_t n, std::index_sequence<C...>)
+{
+	void* result = nullptr;
+	((cls == C && (result = std::get<C>(pools).allocate(n), true)) || ...);
+	return result;
+}
+
+
+template<typename addr_traits>
+template<std::size_t... C>
+void shmheap<addr_traits>::deallocate_in (std::size_t cls, void* ptr, std::size_t n, std::index_sequence<C...>)
+{
+	((cls == C && (std::get<C>(pools).deallocate(reinterpret_cast<typename pool_t<C>::value_type*>(ptr), n), true)) || ...);
+}
+
+
+template<typename addr_traits>
+template<std::size_t... C>
+void shmheap<addr_traits>::ensure_mapped_in (std::size_t cls, const void* ptr, std::index_sequence<C...>)
+{
+	((cls == C && (std::get<C>(pools).ensure_mapped(ptr), true)) || ...);
+}
 
+
+}
+
+
+template<>
+FILE* mem::shmlog::logfile;
@@ -0,0 +1,76 @@
+/**
+ * Defines a 32-bit compressed pointer to an object inside a fixed-address region.
+ * The region id is implied by the addressing format, so only the pool, segment and offset
+ * fields of the address are stored, optionally scaled down by a power-of-two granule.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <cassert>
+#include <cstddef>
+#include <type_traits>
+#include "addr_traits.hpp"
+
+namespace mem {
+
+template<typename T, typename addr_traits, uint32_t granule_bits = 0>
+class cptr
+{
+public:
+	typedef cptr<T,addr_traits,granule_bits> self_t;
+	typedef T element_type;
+
+	static constexpr uint32_t stored_bits = addr_traits::poolid_bits + addr_traits::segmentid_bits + addr_traits::offset_bits - granule_bits;
+	static_assert(stored_bits <= 32, "The pool, segment and offset fields must fit into 32 bits after scaling by the granule.");
+
+	static constexpr uint64_t region_base = addr_traits::region_address();
+
+	cptr () : v(0) {}
+	cptr (std::nullptr_t) : v(0) {}
+	cptr (T* p) : v(encode(p)) {}
+
+	template<typename U, typename = typename std::enable_if<std::is_convertible<U*,T*>::value>::type>
+	cptr (const cptr<U,addr_traits,granule_bits>& other) : v(encode(static_cast<T*>(other.get()))) {}
+
+	self_t& operator= (T* p) { v = encode(p); return *this; }
+	self_t& operator= (std::nullptr_t) { v = 0; return *this; }
+
+	/**
+	 * Address 0 of a region is the header of its first pool and never holds an object, so 0 encodes null.
+	 */
+	static uint32_t encode (const void* p) {
+		if (!p) return 0;
+		assert(addr_traits::regionid(const_cast<void*>(p)) == addr_traits::rid);
+		assert(((uint64_t)p & bits_to_mask(granule_bits,0)) == 0);
+		return (uint32_t)(((uint64_t)p - region_base) >> granule_bits);
+	}
+
+	static T* decode (uint32_t v) {
+		return v ? reinterpret_cast<T*>(region_base + ((uint64_t)v << granule_bits)) : nullptr;
+	}
+
+	T* get () const { return decode(v); }
+
+	operator T* () const { return get(); }
+	T* operator-> () const { return get(); }
+	T& operator* () const { return *get(); }
+
+	uint32_t raw () const { return v; }
+
+	// raw pointers are compared through the conversion to T*, which an overload of their own would
+	// make ambiguous
+	template<typename U>
+	bool operator== (const cptr<U,addr_traits,granule_bits>& o) const { return v == o.raw(); }
+	template<typename U>
+	bool operator!= (const cptr<U,addr_traits,granule_bits>& o) const { return v != o.raw(); }
+
+	bool operator== (std::nullptr_t) const { return v == 0; }
+	bool operator!= (std::nullptr_t) const { return v != 0; }
+
+protected:
+	uint32_t v;
+
+};
+
+
+} // namespace mem
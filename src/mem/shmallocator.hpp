@@ -5,14 +5,25 @@ namespace mem
 struct free_meta;
 template<typename T, typename addr_traits> class shmfixedsegment;
 template<typename T, typename addr_traits> class shmfixedpool;
+template<typename T, typename addr_traits> class shmthreadcache;
 template<typename T, typename addr_traits> class shmallocator;
+template<typename addr_traits> class shmheap;
 }
 
 #include <memory>
+#include <string>
 #include <cassert>
+#include <cstddef>
 #include <stdio.h>
-#include <shared_mutex>
+#include <mutex>
+#include <vector>
+#include <atomic>
+#include <array>
+#include <tuple>
+#include <utility>
 #include "addr_traits.hpp"
+#include "shmlock.hpp"
+#include "shmstats.hpp"
 #include <boost/intrusive/list.hpp>
 #include <variant>
 
@@ -29,10 +40,92 @@ struct free_object
 
 typedef bi::list<free_object, bi::member_hook<free_object, bi::list_member_hook<>, &free_object::memb> > free_list;
 
+/**
+ * A freed run of contiguous objects, kept whole so that a contiguous allocation can take it again.
+ * Runs are at least two objects long, which leaves room for the hook and the length.
+ */
+struct free_run
+{
+	bi::list_member_hook<> memb;
+	uint64_t count;
+};
+
+typedef bi::list<free_run, bi::member_hook<free_run, bi::list_member_hook<>, &free_run::memb> > run_list;
+
 
 template<typename T>
 using shmobj = std::variant<free_object, T>;
 
+
+enum attach_options
+{
+	attach_default   = 0x0,
+	attach_hugepages = 0x1, // request transparent huge pages for the pool's mappings
+	attach_prefault  = 0x2, // fault in every mapped page at attach (and growth) time
+	attach_persistent = 0x4, // back the pool with a file in pool_directory() that survives restarts
+	attach_adopted   = 0x8, // the pool was attached from a descriptor handed over by another process
+};
+
+
+/**
+ * The directory that the files of persistent pools are kept in.
+ */
+inline std::string& pool_directory ()
+{
+	static std::string dir = "/var/tmp";
+	return dir;
+}
+
+
+/**
+ * A snapshot of a pool header, taken by checkpoint() once the pool's pages have been synced.
+ * Headers keep two of them and overwrite the older, so that a torn write never loses both.
+ */
+struct pool_checkpoint
+{
+	uint64_t sequence;
+	uint64_t capacity;
+	uint64_t size;
+	uint64_t generation;
+	uint64_t root;
+	uint64_t checksum;
+	
+	uint64_t compute_checksum () const {
+		uint64_t h = 0xcbf29ce484222325ULL; // FNV-1a
+		const uint8_t* p = reinterpret_cast<const uint8_t*>(this);
+		for (std::size_t i = 0; i < offsetof(pool_checkpoint, checksum); i++) {
+			h = (h ^ p[i]) * 0x100000001b3ULL;
+		}
+		return h;
+	}
+	
+	void seal () { checksum = compute_checksum(); }
+	
+	bool valid () const { return sequence != 0 && checksum == compute_checksum(); }
+};
+
+/**
+ * What one process has mapped of a pool. It is kept per process and pool id rather than per
+ * shmfixedpool, so that paths which only know a pool's id, like a thread cache being flushed,
+ * can map the segments that another process has grown the pool into.
+ */
+struct pool_mapping
+{
+	int fh = -1;
+	int options = attach_default; // attach_options this process mapped the pool with
+	uint64_t mapped = 0;          // bytes of the pool mapped into this process
+	uint64_t generation = 0;      // the header generation that 'mapped' reflects
+	int stats_slot = -1;          // this process's slot in the pool's stats, see shmpool_stats::count_process
+};
+
+template<typename addr_traits>
+pool_mapping& local_mapping (typename addr_traits::poolid_t poolid)
+{
+	static pool_mapping table[addr_traits::poolid_space];
+	return table[poolid];
+}
+
+
 template<typename T, typename addr_traits>
 struct shmfixedsegment 
 {
@@ -55,20 +148,80 @@ protected:
 };
 
 
+/**
+ * A per-thread set of magazines, each holding a small stack of free objects from one pool.
+ * Allocation and deallocation of single objects are served from the magazine without touching
+ * the pool header; the magazine is refilled from and drained to the shared pool in batches.
+ */
+template<typename T, typename addr_traits>
+struct shmthreadcache
+{
+	typedef shmthreadcache<T,addr_traits> self_t;
+	typedef shmfixedpool<T,addr_traits> pool_t;
+	
+	using poolid_t = typename addr_traits::poolid_t;
+	
+	constexpr static int magazines = 4;
+	constexpr static int magazine_size = 32;
+	constexpr static int batch_size = magazine_size / 2;
+	
+	struct magazine
+	{
+		poolid_t pool;
+		bool used;
+		int count;
+		T* slots[magazine_size];
+	};
+	
+	static self_t& local ();
+	
+	static void flush_all (poolid_t pool);
+	
+	shmthreadcache ();
+	shmthreadcache (const shmthreadcache&) = delete;
+	~shmthreadcache ();
+	
+	magazine* find (poolid_t pool);
+	
+	void flush (poolid_t pool);
+	
+	magazine mags[magazines];
+	
+protected:
+	static void forget_after_fork ();
+	
+	static std::mutex& registry_mutex ();
+	static std::vector<self_t*>& registry ();
+	
+};
+
+
 template<typename T, typename addr_traits>
 struct shmfixedpool
 {
 	typedef shmfixedpool<T,addr_traits> self_t;
 	typedef shmfixedsegment<T,addr_traits> segment_t;
+	typedef shmthreadcache<T,addr_traits> cache_t;
+	typedef T value_type;
 	
 	using poolid_t = typename addr_traits::poolid_t;
 	
+	static_assert(sizeof(T) >= sizeof(free_object), "Pooled objects must be large enough to hold a free list hook.");
+	
 	typedef struct header_s {
+		shmpool_stats stats; // first, so that it can be found without knowing T
 		uint64_t capacity;
 		uint64_t size;
+		std::atomic<uint64_t> generation; // bumped each time the pool grows
 		int16_t refcnt;
 		free_list fl;
-		std::shared_mutex mut;
+		run_list runs; // freed runs of contiguous objects, in address order
+		shmrwlock mut;
+		uint64_t freed_since_trim;
+		std::atomic<uint64_t> root; // an application object to find again after a restart
+		uint32_t clean;             // set once the last process has detached from a persistent pool
+		pool_checkpoint log[2];
+		uint64_t released[(addr_traits::segmentid_space + 63) / 64]; // segments whose pages were returned to the OS
 		
     header_s () = default;
 		~header_s () = default;
@@ -82,12 +235,22 @@ struct shmfixedpool
 	constexpr static uint64_t initial_size() {
 		return addr_traits::segment_size * 2;
 	}
+	
+	// the pool can grow until it fills the address space of all of its segments
+	constexpr static uint64_t max_size() {
+		return addr_traits::segment_size * addr_traits::segmentid_space;
+	}
 
 	T* next_uncommitted () {
 		return reinterpret_cast<T*>(start_address() + this->size);
 	}
 	
-	static self_t attach (poolid_t poolid);
+	static header_t* header (poolid_t poolid) {
+		return reinterpret_cast<header_t*>(addr_traits::base_address(poolid));
+	}
+	
+	static self_t attach (poolid_t poolid, int options = attach_default);
+	static self_t attach_fd (poolid_t poolid, int fd, int options = attach_default);
 	static void detach (self_t& pool);
 	
 	shmfixedpool ();
@@ -96,8 +259,11 @@ struct shmfixedpool
 	~shmfixedpool ();
 	
 	shmfixedpool& operator= (const shmfixedpool<T,addr_traits>& other) = delete;
+	shmfixedpool& operator= (shmfixedpool<T,addr_traits>&& moved);
 	
 	std::string shared_name ();
+	
+	std::string backing_path ();
 
 	void swap (shmfixedpool<T,addr_traits>& other);
 	
@@ -106,16 +272,231 @@ struct shmfixedpool
 	}
 	
 	void* start_address () {
-		return reinterpret_cast<void*>((uint64_t)base_address() + ((header_size() / addr_traits::segment_size) + 1) * addr_traits::segment_size);
+		return start_address(pool);
+	}
+	
+	static void* start_address (poolid_t poolid) {
+		return reinterpret_cast<void*>((uint64_t)addr_traits::base_address(poolid) + header_space());
+	}
+	
+	// bytes reserved at the base of the pool for the header, rounded up to whole segments
+	constexpr static uint64_t header_space () {
+		return ((header_size() / addr_traits::segment_size) + 1) * addr_traits::segment_size;
 	}
 	
 	T* allocate(std::size_t n);
 	
 	void deallocate (T* p, std::size_t);
+	
+	// takes one object straight from the shared pool, for objects that are too large, or too few,
+	// to be worth holding idle in a thread's magazine
+	T* allocate_uncached ();
+	
+	void deallocate_uncached (T* p);
+	
+	void allocate_batch (T** objs, std::size_t n);
+	
+	void deallocate_batch (T** objs, std::size_t n);
+	
+	std::size_t allocate_shared (T** objs, std::size_t n);
+	
+	static void deallocate_shared (poolid_t poolid, T** objs, std::size_t n);
+	
+	void trim ();
+	
+	void checkpoint ();
+	
+	void* root () const { return reinterpret_cast<void*>(hdr->root.load(std::memory_order_acquire)); }
+	
+	void set_root (void* obj) { hdr->root.store((uint64_t)obj, std::memory_order_release); }
+	
+	void ensure_mapped (const void* ptr);
+	
+	void refresh () { refresh(pool); }
+	
+	static void refresh (poolid_t poolid);
+	
+	pool_mapping& mapping () const { return local_mapping<addr_traits>(pool); }
 
   header_t* hdr;
 	poolid_t pool;
-	int fh;
+	
+protected:
+	static void lock_header (header_t* hdr);
+	
+	static void update_stats (header_t* hdr);
+	
+	static void recover_header (header_t* hdr, uint64_t file_size);
+	
+	bool lock_backing (short type, bool wait);
+	
+	void sync_header ();
+	
+	static void note_freed (poolid_t poolid, uint64_t n);
+	
+	static void release_free_segments (poolid_t poolid);
+	
+	static bool reclaim_released_segment (poolid_t poolid);
+	
+	// objects freed between automatic trims: at least a few segments' worth, and proportional to the
+	// free list so that trimming stays amortized O(1) per free
+	static uint64_t trim_threshold (header_t* hdr) {
+		return std::max<uint64_t>(hdr->fl.size() / 2, 4 * addr_traits::segment_size / sizeof(T));
+	}
+	
+	T* allocate_contiguous (std::size_t n);
+	
+	void deallocate_contiguous (T* p, std::size_t n);
+	
+	bool grow (uint64_t deficit);
+	
+	static void map_range (poolid_t poolid, uint64_t from, uint64_t to);
+	
+	static void advise_hugepages (void* addr, uint64_t len);
+	
+	static void prefault (void* addr, uint64_t len);
+	
+};
+
+
+/**
+ * An untyped block of one of the heap's size classes.
+ */
+template<std::size_t N>
+struct shmblock
+{
+	static_assert(N % 16 == 0, "Size classes must preserve 16 byte alignment.");
+	alignas(16) uint8_t bytes[N];
+};
+
+
+constexpr std::size_t shmheap_size_classes[] = {
+	16, 32, 48, 64, 80, 96, 112, 128,
+	160, 192, 224, 256, 320, 384, 448, 512,
+	640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+	2560, 3072, 3584, 4096, 5120, 6144, 7168, 8192
+};
+
+constexpr std::size_t shmheap_num_classes = sizeof(shmheap_size_classes) / sizeof(std::size_t);
+
+constexpr std::size_t shmheap_max_class_size = shmheap_size_classes[shmheap_num_classes - 1];
+
+// maps a request size, in 16 byte granules, to the smallest size class that holds it
+constexpr std::array<uint8_t, shmheap_max_class_size / 16 + 1> shmheap_class_index = [] {
+	std::array<uint8_t, shmheap_max_class_size / 16 + 1> idx {};
+	std::size_t cls = 0;
+	for (std::size_t g=0; g < idx.size(); g++) {
+		while (shmheap_size_classes[cls] < g * 16) {
+			cls++;
+		}
+		idx[g] = cls;
+	}
+	return idx;
+}();
+
+
+/**
+ * A segregated-fit allocator for variable-size objects in shared memory. Each size class is served by
+ * its own shmfixedpool, and the pools occupy consecutive pool ids in one region, so the size of any
+ * block can be recovered from the pool id in its address without consulting a header.
+ *
+ * Requests larger than the largest size class are served as contiguous runs from the largest pool,
+ * and must be released with the sized deallocate().
+ */
+template<typename addr_traits>
+class shmheap
+{
+public:
+	typedef shmheap<addr_traits> self_t;
+	using poolid_t = typename addr_traits::poolid_t;
+	
+	template<std::size_t C>
+	using pool_t = shmfixedpool<shmblock<shmheap_size_classes[C]>, addr_traits>;
+	
+	static self_t& instance ();
+	
+	static void attach (poolid_t first_pool, int options = attach_default);
+	
+	static void detach ();
+	
+	static bool attached () { return instance().first_pool != invalid_pool; }
+	
+	void* allocate (std::size_t bytes);
+	
+	void deallocate (void* ptr);
+	
+	void deallocate (void* ptr, std::size_t bytes);
+	
+	void ensure_mapped (const void* ptr);
+	
+	static std::size_t size_class (std::size_t bytes) {
+		return shmheap_class_index[(bytes + 15) >> 4];
+	}
+	
+	std::size_t block_size (const void* ptr) const {
+		return shmheap_size_classes[addr_traits::poolid((void*)ptr) - first_pool];
+	}
+	
+	constexpr static poolid_t invalid_pool = ~poolid_t(0);
+	
+	poolid_t first_pool = invalid_pool;
+	
+protected:
+	template<std::size_t... C>
+	static auto make_pools (std::index_sequence<C...>) -> std::tuple<pool_t<C>...>;
+	
+	template<std::size_t... C>
+	void attach_pools (int options, std::index_sequence<C...>);
+	
+	template<std::size_t... C>
+	void detach_pools (std::index_sequence<C...>);
+	
+	template<std::size_t... C>
+	void* allocate_in (std::size_t cls, std::size_t n, std::index_sequence<C...>);
+	
+	template<std::size_t... C>
+	void deallocate_in (std::size_t cls, void* ptr, std::size_t n, std::index_sequence<C...>);
+	
+	template<std::size_t... C>
+	void ensure_mapped_in (std::size_t cls, const void* ptr, std::index_sequence<C...>);
+	
+	decltype(make_pools(std::make_index_sequence<shmheap_num_classes>())) pools;
+	
+};
+
+
+/**
+ * An STL allocator over the process's shmheap, so that standard containers can keep their storage
+ * in shared memory. The heap must be attached before the first allocation.
+ */
+template<typename T, typename addr_traits>
+class shmallocator
+{
+public:
+	typedef T value_type;
+	typedef shmheap<addr_traits> heap_t;
+	
+	template<typename U>
+	struct rebind { typedef shmallocator<U,addr_traits> other; };
+	
+	shmallocator () noexcept = default;
+	
+	template<typename U>
+	shmallocator (const shmallocator<U,addr_traits>&) noexcept {}
+	
+	T* allocate (std::size_t n) {
+		return static_cast<T*>(heap_t::instance().allocate(n * sizeof(T)));
+	}
+	
+	void deallocate (T* p, std::size_t n) {
+		heap_t::instance().deallocate(p, n * sizeof(T));
+	}
+	
+	template<typename U>
+	bool operator== (const shmallocator<U,addr_traits>&) const noexcept { return true; }
+	
+	template<typename U>
+	bool operator!= (const shmallocator<U,addr_traits>&) const noexcept { return false; }
 	
 };
 
@@ -0,0 +1,390 @@
+/**
+ * Defines a compact reader/writer lock that works across processes in shared memory.
+ * The lock stays in userspace when uncontended, spins briefly, then sleeps on a futex.
+ * The writer's pid is the lock word, as with a robust futex, and readers are counted per process,
+ * so that the lock can be recovered when a holder dies. A writer waits for the readers that came
+ * in before it, and keeps new ones out meanwhile, so reads must not nest.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <vector>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+namespace mem
+{
+
+class shmrwlock
+{
+public:
+	constexpr static uint32_t writer_bit = 0x80000000;
+	constexpr static uint32_t waiters_bit = 0x40000000;
+	constexpr static uint32_t holder_mask = 0x3fffffff; // the writer's pid, or else the untracked readers
+
+	constexpr static int reader_slots = 8;
+	constexpr static int spin_limit = 100;
+	constexpr static long wait_timeout_ns = 10000000; // how often a sleeper checks on the holders
+
+	shmrwlock () : state(0) {
+		for (auto& slot : readers) {
+			slot.pid.store(0, std::memory_order_relaxed);
+			slot.count.store(0, std::memory_order_relaxed);
+		}
+	}
+
+	shmrwlock (const shmrwlock&) = delete;
+	shmrwlock& operator= (const shmrwlock&) = delete;
+
+	/**
+	 * Acquires the lock exclusively. Returns true if it had to be taken from a holder that died,
+	 * in which case the protected data may be inconsistent and should be checked by the caller.
+	 */
+	bool lock () {
+		uint32_t s = 0;
+		if (state.compare_exchange_strong(s, writer_bit | getpid(), std::memory_order_seq_cst)) {
+			return drain_readers();
+		}
+		return lock_slow();
+	}
+
+	bool try_lock () {
+		uint32_t s = state.load(std::memory_order_relaxed);
+		if ((s & ~waiters_bit) != 0 ||
+				!state.compare_exchange_strong(s, s | writer_bit | getpid(), std::memory_order_seq_cst)) {
+			return false;
+		}
+		for (auto& slot : readers) {
+			if (slot.count.load(std::memory_order_seq_cst) != 0) {
+				unlock();
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void unlock () {
+		uint32_t s = state.exchange(0, std::memory_order_release);
+		if (s & waiters_bit) {
+			futex_wake();
+		}
+	}
+
+	/**
+	 * Acquires the lock shared. Returns true if a dead writer had to be evicted first.
+	 */
+	bool lock_shared () {
+		reader_slot* slot = own_slot(true);
+		if (!slot) {
+			return lock_untracked();
+		}
+		slot->count.fetch_add(1, std::memory_order_seq_cst);
+		if (!(state.load(std::memory_order_seq_cst) & writer_bit)) {
+			return false;
+		}
+		return lock_shared_slow(*slot);
+	}
+
+	bool try_lock_shared () {
+		reader_slot* slot = own_slot(true);
+		if (!slot) {
+			uint32_t s = state.load(std::memory_order_relaxed);
+			if (!(s & writer_bit) &&
+					state.compare_exchange_strong(s, s + 1, std::memory_order_acquire)) {
+				untracked().push_back(this);
+				return true;
+			}
+			return false;
+		}
+		slot->count.fetch_add(1, std::memory_order_seq_cst);
+		if (!(state.load(std::memory_order_seq_cst) & writer_bit)) {
+			return true;
+		}
+		leave(*slot);
+		return false;
+	}
+
+	void unlock_shared () {
+		auto& mine = untracked();
+		auto it = std::find(mine.begin(), mine.end(), this);
+		if (it != mine.end()) {
+			mine.erase(it);
+			uint32_t s = state.fetch_sub(1, std::memory_order_release) - 1;
+			while ((s & holder_mask) == 0 && (s & waiters_bit)) {
+				if (state.compare_exchange_weak(s, s & ~waiters_bit, std::memory_order_relaxed)) {
+					futex_wake();
+					break;
+				}
+			}
+			return;
+		}
+		if (reader_slot* slot = own_slot(false)) {
+			leave(*slot);
+		}
+	}
+
+	pid_t writer () const {
+		uint32_t s = state.load(std::memory_order_relaxed);
+		return (s & writer_bit) ? s & holder_mask : 0;
+	}
+
+	uint32_t reader_count () const {
+		uint32_t s = state.load(std::memory_order_relaxed);
+		uint32_t n = (s & writer_bit) ? 0 : s & holder_mask;
+		for (auto& slot : readers) {
+			n += slot.count.load(std::memory_order_relaxed);
+		}
+		return n;
+	}
+
+protected:
+	/**
+	 * A process's readers are counted in its slot alone, so that one dying at any point leaves
+	 * behind exactly what it holds. The slot's pid is set to reclaiming while a dead process's
+	 * count is being cleared.
+	 */
+	struct reader_slot
+	{
+		std::atomic<int32_t> pid;
+		std::atomic<uint32_t> count;
+	};
+
+	constexpr static int32_t reclaiming = -1;
+
+	bool lock_slow () {
+		bool recovered = false;
+		for (int spins = 0; ; spins++) {
+			uint32_t s = state.load(std::memory_order_relaxed);
+			if ((s & ~waiters_bit) == 0) {
+				if (state.compare_exchange_weak(s, s | writer_bit | getpid(), std::memory_order_seq_cst)) {
+					return drain_readers() | recovered;
+				}
+				continue;
+			}
+			if (spins < spin_limit) {
+				pause();
+				continue;
+			}
+			if (!sleep(s)) {
+				recovered |= recover();
+			}
+		}
+	}
+
+	/**
+	 * Waits, holding the writer bit, for the tracked readers that came in before it was set.
+	 */
+	bool drain_readers () {
+		bool recovered = false;
+		for (auto& slot : readers) {
+			for (int spins = 0; slot.count.load(std::memory_order_seq_cst) != 0; spins++) {
+				if (spins < spin_limit) {
+					pause();
+					continue;
+				}
+				pid_t pid = slot.pid.load(std::memory_order_relaxed);
+				if (!wait_for(slot) && pid > 0 && dead(pid)) {
+					recovered |= release(slot, pid);
+				}
+			}
+		}
+		return recovered;
+	}
+
+	bool lock_shared_slow (reader_slot& slot) {
+		bool recovered = false;
+		for (;;) {
+			leave(slot);
+			for (int spins = 0; ; spins++) {
+				uint32_t s = state.load(std::memory_order_relaxed);
+				if (!(s & writer_bit)) {
+					break;
+				}
+				if (spins < spin_limit) {
+					pause();
+					continue;
+				}
+				if (!sleep(s)) {
+					recovered |= recover();
+				}
+			}
+			slot.count.fetch_add(1, std::memory_order_seq_cst);
+			if (!(state.load(std::memory_order_seq_cst) & writer_bit)) {
+				return recovered;
+			}
+		}
+	}
+
+	/**
+	 * Readers that found every slot taken by a live process are counted in the lock word instead,
+	 * where they cannot be recovered. The thread remembers these holds, so that releasing one leaves
+	 * alone a slot its process claimed since.
+	 */
+	bool lock_untracked () {
+		bool recovered = false;
+		for (int spins = 0; ; spins++) {
+			uint32_t s = state.load(std::memory_order_relaxed);
+			if (!(s & writer_bit)) {
+				if (state.compare_exchange_weak(s, s + 1, std::memory_order_acquire)) {
+					untracked().push_back(this);
+					return recovered;
+				}
+				continue;
+			}
+			if (spins < spin_limit) {
+				pause();
+				continue;
+			}
+			if (!sleep(s)) {
+				recovered |= recover();
+			}
+		}
+	}
+
+	/**
+	 * Drops one of this process's reads, and wakes a writer waiting for the readers to leave.
+	 * Clearing the waiters bit changes the word, so a writer about to sleep on it does not miss this.
+	 */
+	void leave (reader_slot& slot) {
+		slot.count.fetch_sub(1, std::memory_order_seq_cst);
+		uint32_t s = state.load(std::memory_order_seq_cst);
+		while ((s & writer_bit) && (s & waiters_bit)) {
+			if (state.compare_exchange_weak(s, s & ~waiters_bit, std::memory_order_relaxed)) {
+				futex_wake();
+				break;
+			}
+		}
+	}
+
+	/**
+	 * Sleeps until the state changes from s, or until the wait times out. Returns false on timeout.
+	 */
+	bool sleep (uint32_t s) {
+		if (!(s & waiters_bit)) {
+			if (!state.compare_exchange_strong(s, s | waiters_bit, std::memory_order_relaxed)) {
+				return true;
+			}
+			s |= waiters_bit;
+		}
+		struct timespec ts = { 0, wait_timeout_ns };
+		long r = syscall(SYS_futex, reinterpret_cast<uint32_t*>(&state), FUTEX_WAIT, s, &ts, nullptr, 0);
+		return !(r == -1 && errno == ETIMEDOUT);
+	}
+
+	/**
+	 * Sleeps until the readers in a slot may have left. Returns false on timeout.
+	 */
+	bool wait_for (reader_slot& slot) {
+		uint32_t s = state.fetch_or(waiters_bit, std::memory_order_seq_cst) | waiters_bit;
+		if (slot.count.load(std::memory_order_seq_cst) == 0) {
+			return true;
+		}
+		struct timespec ts = { 0, wait_timeout_ns };
+		long r = syscall(SYS_futex, reinterpret_cast<uint32_t*>(&state), FUTEX_WAIT, s, &ts, nullptr, 0);
+		return !(r == -1 && errno == ETIMEDOUT);
+	}
+
+	void futex_wake () {
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(&state), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+	}
+
+	/**
+	 * Releases whatever dead processes hold: the write lock, or their reads. Returns true if anything
+	 * was recovered. Only a pid found dead is ever released, as the writer's pid goes into the lock
+	 * word with the same exchange that takes it, and a reader counts itself in its slot alone.
+	 */
+	bool recover () {
+		bool recovered = false;
+		uint32_t s = state.load(std::memory_order_relaxed);
+		if ((s & writer_bit) && dead(s & holder_mask) &&
+				state.compare_exchange_strong(s, 0, std::memory_order_release)) {
+			recovered = true;
+		}
+		for (auto& slot : readers) {
+			pid_t pid = slot.pid.load(std::memory_order_relaxed);
+			if (pid > 0 && dead(pid)) {
+				recovered |= release(slot, pid);
+			}
+		}
+		if (recovered) {
+			futex_wake();
+		}
+		return recovered;
+	}
+
+	/**
+	 * Frees the slot of a dead process. Returns true if it still held reads.
+	 */
+	bool release (reader_slot& slot, pid_t pid) {
+		if (!slot.pid.compare_exchange_strong(pid, reclaiming, std::memory_order_acquire)) {
+			return false;
+		}
+		uint32_t held = slot.count.exchange(0, std::memory_order_relaxed);
+		slot.pid.store(0, std::memory_order_release);
+		return held > 0;
+	}
+
+	/**
+	 * Finds this process's slot, or claims a free one when asked to. Slots of dead processes are
+	 * freed when none is left.
+	 */
+	reader_slot* own_slot (bool claim) {
+		pid_t me = getpid();
+		for (auto& slot : readers) {
+			if (slot.pid.load(std::memory_order_relaxed) == me) {
+				return &slot;
+			}
+		}
+		if (!claim) {
+			return nullptr;
+		}
+		for (int pass = 0; ; pass++) {
+			for (auto& slot : readers) {
+				pid_t pid = slot.pid.load(std::memory_order_relaxed);
+				if (pid == 0 && slot.pid.compare_exchange_strong(pid, me, std::memory_order_acquire)) {
+					return &slot;
+				}
+			}
+			if (pass > 0) {
+				return nullptr;
+			}
+			for (auto& slot : readers) {
+				pid_t pid = slot.pid.load(std::memory_order_relaxed);
+				if (pid > 0 && dead(pid)) {
+					release(slot, pid);
+				}
+			}
+		}
+	}
+
+	static std::vector<const shmrwlock*>& untracked () {
+		static thread_local std::vector<const shmrwlock*> holds;
+		return holds;
+	}
+
+	static bool dead (pid_t pid) {
+		return kill(pid, 0) == -1 && errno == ESRCH;
+	}
+
+	static void pause () {
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#endif
+	}
+
+	std::atomic<uint32_t> state;
+	reader_slot readers[reader_slots];
+
+};
+
+static_assert(sizeof(shmrwlock) == 68, "shmrwlock has a fixed layout in shared memory.");
+
+} // namespace mem
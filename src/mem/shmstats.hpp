@@ -0,0 +1,144 @@
+/**
+ * Defines the statistics page at the start of every shared pool header. Its layout is stable and
+ * independent of the pooled type, so that tools can attach to a pool read-only and inspect it.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+namespace mem
+{
+
+struct shmpool_stats
+{
+	constexpr static uint64_t magic_value = 0x535441545350504cULL; // "LPPSTATS"
+	constexpr static uint32_t layout_version = 1;
+	constexpr static int cpu_slots = 16; // a power of two, fixed by the layout however many cpus there are
+	constexpr static int process_slots = 16;
+
+	// hot counters, striped by cpu so that concurrent updates rarely share a cache line
+	struct alignas(64) cpu_counters
+	{
+		std::atomic<uint64_t> allocs;
+		std::atomic<uint64_t> frees;
+		std::atomic<uint64_t> lock_waits;
+	};
+
+	// objects each process has taken from (or returned to) the shared free list and bump region
+	struct process_counters
+	{
+		std::atomic<int32_t> pid;
+		std::atomic<int64_t> objects;
+	};
+
+	uint64_t magic;
+	uint32_t version;
+	uint32_t object_size;
+	uint64_t regionid;
+	uint64_t poolid;
+
+	std::atomic<uint64_t> capacity;
+	std::atomic<uint64_t> committed;
+	std::atomic<uint64_t> free_objects;
+	std::atomic<uint64_t> growths;
+	std::atomic<uint64_t> released_segments;
+	std::atomic<int32_t> last_grower;
+
+	process_counters processes[process_slots];
+	cpu_counters cpus[cpu_slots];
+
+	void initialize (uint32_t objsize, uint64_t rid, uint64_t pid) {
+		object_size = objsize;
+		regionid = rid;
+		poolid = pid;
+		version = layout_version;
+		std::atomic_thread_fence(std::memory_order_release);
+		magic = magic_value;
+	}
+
+	bool valid () const {
+		return magic == magic_value && version == layout_version;
+	}
+
+	/**
+	 * Cpus share counters modulo cpu_slots, so cpu n and cpu n + 16 contend on a machine with more
+	 * of them. That costs only contention; the sums stay exact.
+	 */
+	cpu_counters& local () {
+		return cpus[sched_getcpu() & (cpu_slots - 1)];
+	}
+
+	void count_allocs (uint64_t n) { local().allocs.fetch_add(n, std::memory_order_relaxed); }
+	void count_frees (uint64_t n) { local().frees.fetch_add(n, std::memory_order_relaxed); }
+	void count_lock_wait () { local().lock_waits.fetch_add(1, std::memory_order_relaxed); }
+
+	/**
+	 * Attributes objects moving between the shared pool and this process. Called under the header lock.
+	 * The caller keeps the index of this process's slot in slot, starting at -1, so that only claiming
+	 * one scans the slots. A process that finds none left gives up counting, with slot set to -2.
+	 */
+	void count_process (int64_t objects, int& slot) {
+		if (slot == -2) {
+			return;
+		}
+		if (slot < 0 || processes[slot].pid.load(std::memory_order_relaxed) != getpid()) {
+			slot = claim_process(getpid());
+			if (slot < 0) {
+				return;
+			}
+		}
+		processes[slot].objects.fetch_add(objects, std::memory_order_relaxed);
+	}
+
+	uint64_t total_allocs () const { return sum(&cpu_counters::allocs); }
+	uint64_t total_frees () const { return sum(&cpu_counters::frees); }
+	uint64_t total_lock_waits () const { return sum(&cpu_counters::lock_waits); }
+
+protected:
+	/**
+	 * Finds this process's slot, or claims an unused one, or failing that the slot of a process that
+	 * has exited. Returns -2 if every slot belongs to a live process.
+	 */
+	int claim_process (pid_t me) {
+		int unused = -1;
+		int exited = -1;
+		for (int i = 0; i < process_slots; i++) {
+			pid_t pid = processes[i].pid.load(std::memory_order_relaxed);
+			if (pid == me) {
+				return i;
+			} else if (pid == 0 && unused < 0) {
+				unused = i;
+			}
+		}
+		for (int i = 0; unused < 0 && exited < 0 && i < process_slots; i++) {
+			pid_t pid = processes[i].pid.load(std::memory_order_relaxed);
+			if (kill(pid, 0) == -1 && errno == ESRCH) {
+				exited = i;
+			}
+		}
+		int slot = unused >= 0 ? unused : exited;
+		if (slot < 0) {
+			return -2;
+		}
+		processes[slot].objects.store(0, std::memory_order_relaxed);
+		processes[slot].pid.store(me, std::memory_order_relaxed);
+		return slot;
+	}
+
+	uint64_t sum (std::atomic<uint64_t> cpu_counters::* counter) const {
+		uint64_t total = 0;
+		for (auto& c : cpus) {
+			total += (c.*counter).load(std::memory_order_relaxed);
+		}
+		return total;
+	}
+
+};
+
+} // namespace mem
@@ -0,0 +1,89 @@
+/**
+ * @cxxparams "-g -I../.. -std=c++17"
+ * @ldparams "-lpthread -lrt"
+ **/
+
+#include <stdint.h>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <testmatrix.h>
+#include "mem/addr_traits.hpp"
+#include "mem/cptr.hpp"
+
+typedef mem::pool_addr_traits<0x1004,16,12,8,12> shglobal4;
+
+#define SKIPARRAYLIST_ADDR_TRAITS shglobal4
+#define DEBUG_SKIPARRAYLIST
+#include "util/skiparraylist.hpp"
+
+using namespace mem;
+using namespace std;
+
+template<>
+FILE* mem::shmlog::logfile = nullptr;
+
+template<>
+FILE* log::logfile = nullptr;
+
+struct base { uint64_t a; };
+struct derived : base { uint64_t b; };
+
+typedef cptr<derived,shglobal4> derived_ptr;
+typedef cptr<base,shglobal4> base_ptr;
+
+int main (int argc, char *argv[])
+{
+	report_executable_parameters();
+	
+	log::initialize();
+	mem::shmlog::initialize();
+	
+	// encoding is the pool, segment and offset fields of the address, and 0 is null
+	static_assert(sizeof(derived_ptr) == 4, "compressed pointers are 32 bits");
+	derived* d = reinterpret_cast<derived*>((uint64_t)shglobal4::base_address(0x123, 0x45) + 0x670);
+	derived_ptr cd(d);
+	test_assert(cd.raw() == 0x12345670);
+	test_assert(cd.get() == d);
+	test_assert(derived_ptr(nullptr).get() == nullptr);
+	test_assert(derived_ptr().raw() == 0);
+	
+	base_ptr cb(cd);
+	test_assert(cb == cd);
+	test_assert(cb.get() == static_cast<base*>(d));
+	
+	// a granule drops the low bits of aligned addresses
+	cptr<derived,shglobal4,4> cg(d);
+	test_assert(cg.raw() == 0x1234567);
+	test_assert(cg.get() == d);
+	
+	// a skiparraylist whose nodes live in the shared heap and link with compressed pointers
+	static_assert(sizeof(util::detail::inner<char>) <= 32, "compressed inner nodes should fit in half a cache line");
+	shmheap<shglobal4>::attach(64);
+	{
+		string text("The quick brown fox jumps over the lazy dog. ");
+		string truth;
+		util::skiparraylist<char> list;
+		uint32_t x = 7;
+		for (int i=0; i < 3000; i++) {
+			x = x * 1103515245 + 12345;
+			int pos = truth.size() ? (x >> 8) % truth.size() : 0;
+			int len = (x >> 4) % 40 + 1;
+			truth.insert(pos, text.substr(0, len));
+			list.insert(pos, text.data(), len);
+			if (truth.size() > 500) {
+				int from = (x >> 3) % 400;
+				truth.erase(from, 50);
+				list.remove(from, from + 50);
+			}
+		}
+		stringstream ss;
+		ss << list;
+		test_assert(ss.str() == truth);
+		test_assert(shglobal4::regionid(list.root) == shglobal4::rid);
+	}
+	shmheap<shglobal4>::detach();
+	
+	report_success();
+	return 0;
+}
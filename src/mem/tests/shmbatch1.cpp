@@ -0,0 +1,159 @@
+/**
+ * @cxxparams "-g -I../.. -std=c++17"
+ * @ldparams "-lpthread -lrt"
+ **/
+
+#include <stdint.h>
+#include <iostream>
+#include <map>
+#include <vector>
+#include <testmatrix.h>
+#include "mem/addr_traits.hpp"
+#include "mem/shmallocator.hpp"
+
+using namespace mem;
+using namespace std;
+
+typedef pool_addr_traits<0x1004,16,12,8,12> shglobal4;
+
+// 48 does not divide the segment size, so runs and objects straddle segment boundaries
+struct obj
+{
+	uint64_t words[6];
+};
+
+typedef shmfixedpool<obj,shglobal4> pool_t;
+
+template<>
+FILE* mem::shmlog::logfile = nullptr;
+
+template<>
+FILE* log::logfile = nullptr;
+
+#define SINGLES 300
+#define RUN 200
+
+// the objects handed out and not yet freed, by address, with the tag written into them
+map<obj*,uint64_t> live;
+
+static void take (obj* o, uint64_t tag)
+{
+	test_assert(live.count(o) == 0);
+	for (auto& w : o->words) {
+		w = tag;
+	}
+	live[o] = tag;
+}
+
+static void give_back (obj* o)
+{
+	test_assert(live.erase(o) == 1);
+}
+
+// whether every object that is still handed out holds what was written into it
+static bool intact ()
+{
+	for (auto& l : live) {
+		for (auto w : l.first->words) {
+			if (w != l.second) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static bool crosses_segment (obj* first, size_t n)
+{
+	uint64_t seg = shglobal4::segment_size;
+	return (uint64_t)first / seg != ((uint64_t)(first + n) - 1) / seg;
+}
+
+
+int main (int argc, char *argv[])
+{
+	report_executable_parameters();
+
+	log::initialize();
+	mem::shmlog::initialize();
+
+	pool_t pool = pool_t::attach(11);
+
+	// a batch is served from the magazine, then the free list, then uncommitted space, and every
+	// object in it is distinct
+	vector<obj*> singles(SINGLES);
+	pool.allocate_batch(singles.data(), singles.size());
+	for (size_t i = 0; i < singles.size(); i++) {
+		take(singles[i], i + 1);
+	}
+	vector<obj*> freed;
+	for (size_t i = 0; i < singles.size(); i += 2) {
+		freed.push_back(singles[i]);
+		give_back(singles[i]);
+	}
+	pool.deallocate_batch(freed.data(), freed.size());
+	test_assert(pool.hdr->fl.size() >= freed.size());
+
+	// a contiguous run never comes from the free list, even when it holds enough objects
+	obj* run = pool.allocate(RUN);
+	test_assert(crosses_segment(run, RUN));
+	for (size_t i = 0; i < RUN; i++) {
+		take(run + i, 1000 + i);
+	}
+	test_assert(intact());
+
+	// a batch larger than the free list takes all of it and then new objects
+	vector<obj*> more(freed.size() + 100);
+	pool.allocate_batch(more.data(), more.size());
+	for (size_t i = 0; i < more.size(); i++) {
+		take(more[i], 2000 + i);
+	}
+	test_assert(intact());
+
+	// a freed run is taken again, from its tail, by smaller runs and by one that leaves a single object
+	pool.deallocate(run, RUN);
+	for (size_t i = 0; i < RUN; i++) {
+		give_back(run + i);
+	}
+	obj* tail = pool.allocate(RUN / 2);
+	test_assert(tail == run + RUN / 2);
+	obj* rest = pool.allocate(RUN / 2 - 1);
+	test_assert(rest == run + 1);
+	for (size_t i = 0; i < RUN / 2; i++) {
+		take(tail + i, 3000 + i);
+	}
+	for (size_t i = 0; i < RUN / 2 - 1; i++) {
+		take(rest + i, 4000 + i);
+	}
+	obj* left = pool.allocate(1);
+	take(left, 5000);
+	test_assert(intact());
+
+	// neighbouring runs that are freed merge, and serve a run as long as both together
+	pool.deallocate(rest, RUN / 2 - 1);
+	pool.deallocate(tail, RUN / 2);
+	for (size_t i = 0; i < RUN / 2 - 1; i++) {
+		give_back(rest + i);
+	}
+	for (size_t i = 0; i < RUN / 2; i++) {
+		give_back(tail + i);
+	}
+	obj* whole = pool.allocate(RUN - 1);
+	test_assert(whole == run + 1);
+	for (size_t i = 0; i < RUN - 1; i++) {
+		take(whole + i, 6000 + i);
+	}
+	test_assert(intact());
+
+	pool.deallocate(whole, RUN - 1);
+	for (auto& l : live) {
+		if (l.first < whole || l.first >= whole + RUN - 1) {
+			pool.deallocate(l.first, 1);
+		}
+	}
+	live.clear();
+	pool_t::detach(pool);
+
+	report_success();
+	return 0;
+}
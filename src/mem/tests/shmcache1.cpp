@@ -0,0 +1,79 @@
+/**
+ * @cxxparams "-g -I../.. -std=c++17"
+ * @ldparams "-lpthread -lrt"
+ **/
+
+#include <stdint.h>
+#include <iostream>
+#include <set>
+#include <thread>
+#include <vector>
+#include <testmatrix.h>
+#include "mem/addr_traits.hpp"
+#include "mem/shmallocator.hpp"
+
+using namespace mem;
+using namespace std;
+
+typedef pool_addr_traits<0x1004,16,12,8,12> shglobal4;
+
+struct obj
+{
+	uint64_t words[6];
+};
+
+template<>
+FILE* mem::shmlog::logfile = nullptr;
+
+template<>
+FILE* log::logfile = nullptr;
+
+#define THREADS 2
+#define OBJECTS 20
+#define ROUNDS 1000
+
+int main (int argc, char *argv[])
+{
+	report_executable_parameters();
+	
+	log::initialize();
+	mem::shmlog::initialize();
+	
+	auto pool = shmfixedpool<obj,shglobal4>::attach(3);
+	
+	vector<thread> threads;
+	for (int t=0; t < THREADS; t++) {
+		threads.emplace_back([&pool] {
+			for (int r=0; r < ROUNDS; r++) {
+				vector<obj*> objs;
+				for (int i=0; i < OBJECTS; i++) {
+					objs.push_back(pool.allocate(1));
+				}
+				set<obj*> distinct(objs.begin(), objs.end());
+				test_assert(distinct.size() == objs.size());
+				for (auto o : objs) {
+					pool.deallocate(o,1);
+				}
+			}
+		});
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+	
+	// every object handed out must have come back through the magazines, so the pool can
+	// hand all of them out again without committing more space
+	shmthreadcache<obj,shglobal4>::flush_all(3);
+	pool.trim();
+	uint64_t committed = pool.hdr->size;
+	vector<obj*> all(committed / sizeof(obj));
+	pool.allocate_batch(all.data(), all.size());
+	test_assert(pool.hdr->size == committed);
+	test_assert(set<obj*>(all.begin(), all.end()).size() == all.size());
+	pool.deallocate_batch(all.data(), all.size());
+	
+	shmfixedpool<obj,shglobal4>::detach(pool);
+	
+	report_success();
+	return 0;
+}
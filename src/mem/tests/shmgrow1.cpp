@@ -0,0 +1,141 @@
+/**
+ * @cxxparams "-g -I../.. -std=c++17"
+ * @ldparams "-lpthread -lrt"
+ **/
+
+#include <stdint.h>
+#include <iostream>
+#include <map>
+#include <set>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <testmatrix.h>
+#include "mem/addr_traits.hpp"
+#include "mem/shmallocator.hpp"
+
+using namespace mem;
+using namespace std;
+
+typedef pool_addr_traits<0x1004,16,12,8,12> shglobal4;
+
+struct obj
+{
+	uint64_t index;
+	uint64_t check;
+	uint64_t pad[6];
+};
+
+typedef shmfixedpool<obj,shglobal4> pool_t;
+
+template<>
+FILE* mem::shmlog::logfile = nullptr;
+
+template<>
+FILE* log::logfile = nullptr;
+
+#define POOL 9
+#define OBJECTS 10000
+
+static void read_all (int fd, void* buf, size_t size)
+{
+	for (size_t got = 0; got < size; ) {
+		ssize_t r = read(fd, (char*)buf + got, size - got);
+		if (r <= 0) {
+			_exit(3);
+		}
+		got += r;
+	}
+}
+
+
+int main (int argc, char *argv[])
+{
+	report_executable_parameters();
+
+	log::initialize();
+	mem::shmlog::initialize();
+
+	int ready[2], objs[2];
+	pipe(ready);
+	pipe(objs);
+	char c;
+
+	pool_t pool = pool_t::attach(POOL);
+
+	// the other process attaches while the pool still has its initial size
+	pid_t child = fork();
+	if (child == 0) {
+		pool_t mine = pool_t::attach(POOL);
+		uint64_t mapped = mine.mapping().mapped;
+		write(ready[1], "r", 1);
+
+		static obj* got[OBJECTS];
+		read_all(objs[0], got, sizeof(got));
+		int wrong = 0, lazy = 0;
+		for (int i = 0; i < OBJECTS; i++) {
+			lazy += (uint64_t)got[i] + sizeof(obj) - (uint64_t)mine.base_address() > mapped;
+			mine.ensure_mapped(got[i] + 1);
+			wrong += got[i]->index != (uint64_t)i || got[i]->check != ~(uint64_t)i;
+		}
+
+		// objects in segments this process has not touched yet go back through the static free
+		// paths, which have to map them first
+		for (int i = 0; i < OBJECTS; i += 2) {
+			mine.deallocate(got[i], 1);
+		}
+		pool_t::detach(mine);
+		_exit(wrong ? 1 : lazy ? 0 : 2);
+	}
+	read(ready[0], &c, 1);
+
+	// grows the pool many times over, in the parent alone
+	static obj* made[OBJECTS];
+	for (int i = 0; i < OBJECTS; i++) {
+		made[i] = pool.allocate(1);
+		made[i]->index = i;
+		made[i]->check = ~(uint64_t)i;
+	}
+	test_assert(pool.hdr->capacity > pool_t::initial_size());
+	write(objs[1], made, sizeof(made));
+
+	int status;
+	waitpid(child, &status, 0);
+	test_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	// each process is counted in a slot of its own, and this one remembers where its slot is
+	int counted = 0;
+	for (auto& p : pool.hdr->stats.processes) {
+		counted += p.pid.load() == getpid() || p.pid.load() == child;
+	}
+	test_assert(counted == 2);
+	test_assert(pool.hdr->stats.processes[pool.mapping().stats_slot].pid.load() == getpid());
+
+	// what the other process freed comes back here, and every object is handed out once
+	map<obj*,int> index;
+	for (int i = 0; i < OBJECTS; i++) {
+		index[made[i]] = i;
+	}
+	vector<obj*> again(OBJECTS / 2);
+	pool.allocate_batch(again.data(), again.size());
+	set<obj*> distinct(again.begin(), again.end());
+	test_assert(distinct.size() == again.size());
+	size_t returned = 0;
+	for (auto o : again) {
+		auto it = index.find(o);
+		if (it != index.end()) {
+			test_assert(it->second % 2 == 0);
+			returned++;
+		}
+	}
+	// all but what this process's magazine held on to
+	test_assert(returned + pool_t::cache_t::magazine_size >= again.size());
+	pool.deallocate_batch(again.data(), again.size());
+	for (int i = 1; i < OBJECTS; i += 2) {
+		pool.deallocate(made[i], 1);
+	}
+	pool_t::detach(pool);
+
+	report_success();
+	return 0;
+}
@@ -0,0 +1,92 @@
+/**
+ * @cxxparams "-g -I../.. -std=c++17"
+ * @ldparams "-lpthread -lrt"
+ **/
+
+#include <stdint.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <testmatrix.h>
+#include "mem/addr_traits.hpp"
+#include "mem/shmallocator.hpp"
+
+using namespace mem;
+using namespace std;
+
+typedef pool_addr_traits<0x1004,16,12,8,12> shglobal4;
+
+template<typename T>
+using shmvector = vector<T, shmallocator<T,shglobal4>>;
+
+typedef basic_string<char, char_traits<char>, shmallocator<char,shglobal4>> shmstring;
+
+template<>
+FILE* mem::shmlog::logfile = nullptr;
+
+template<>
+FILE* log::logfile = nullptr;
+
+int main (int argc, char *argv[])
+{
+	report_executable_parameters();
+	
+	log::initialize();
+	mem::shmlog::initialize();
+	
+	shmheap<shglobal4>::attach(64);
+	auto& heap = shmheap<shglobal4>::instance();
+	
+	// every request lands in a block of the smallest class that holds it, and the class is
+	// recoverable from the address alone
+	for (size_t bytes = 1; bytes <= shmheap_max_class_size; bytes += 7) {
+		void* p = heap.allocate(bytes);
+		test_assert(shglobal4::regionid(p) == shglobal4::rid);
+		test_assert(heap.block_size(p) >= bytes);
+		test_assert(heap.block_size(p) < bytes + 1024);
+		heap.deallocate(p);
+	}
+	
+	{
+		shmvector<int> v;
+		for (int i=0; i < 10000; i++) {
+			v.push_back(i);
+		}
+		test_assert(shglobal4::regionid(v.data()) == shglobal4::rid);
+		test_assert(v[9999] == 9999);
+		
+		shmstring s("a string that is long enough to live outside of the object");
+		s += s;
+		test_assert(shglobal4::regionid(&s[0]) == shglobal4::rid);
+		cout << s << endl;
+	}
+	
+	// large blocks that are freed are taken again, so that churn never runs the largest pool out,
+	// however many times over its size it goes through
+	constexpr size_t pool_bytes = shglobal4::segment_size * shglobal4::segmentid_space;
+	size_t sizes[] = { 64 << 10, 24 << 10, 100 << 10, 17 << 10 };
+	size_t churned = 0;
+	for (int i=0; churned < 50 * pool_bytes; i++) {
+		size_t bytes = sizes[i % 4];
+		char* a = static_cast<char*>(heap.allocate(bytes));
+		char* b = static_cast<char*>(heap.allocate(bytes / 2 + 8192));
+		memset(a, 'a', bytes);
+		memset(b, 'b', bytes / 2 + 8192);
+		test_assert(a + bytes <= b || b + bytes / 2 + 8192 <= a);
+		heap.deallocate(a, bytes);
+		heap.deallocate(b, bytes / 2 + 8192);
+		churned += bytes;
+	}
+	for (int round=0; round < 100; round++) {
+		shmvector<uint64_t> v;
+		for (uint64_t i=0; i < 32768; i++) {
+			v.push_back(i);
+		}
+		test_assert(v[32767] == 32767);
+	}
+	
+	shmheap<shglobal4>::detach();
+	
+	report_success();
+	return 0;
+}
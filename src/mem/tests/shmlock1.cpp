@@ -0,0 +1,161 @@
+/**
+ * @cxxparams "-g -I../.. -std=c++17"
+ * @ldparams "-lpthread -lrt"
+ **/
+
+#include <stdint.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <testmatrix.h>
+#include "mem/shmlock.hpp"
+
+using namespace mem;
+using namespace std;
+
+#define PROCESSES 4
+#define ITERATIONS 100000
+
+struct shared_state
+{
+	shmrwlock lock;
+	long counter;
+	bool done;
+};
+
+// reaches into the lock to stage what a process leaves behind when it dies at the wrong moment
+struct lock_internals : shmrwlock
+{
+	void count_reader () { own_slot(true)->count.fetch_add(1); }
+
+	uint32_t held_by (pid_t pid) {
+		for (auto& slot : readers) {
+			if (slot.pid.load() == pid) return slot.count.load();
+		}
+		return 0;
+	}
+};
+
+void wait_all (int n)
+{
+	for (int i=0; i < n; i++) {
+		wait(nullptr);
+	}
+}
+
+int main (int argc, char *argv[])
+{
+	report_executable_parameters();
+	
+	void* mem = mmap(nullptr, sizeof(shared_state), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	test_assert(mem != MAP_FAILED);
+	auto st = new (mem) shared_state();
+	st->counter = 0;
+	
+	// mutual exclusion across processes
+	for (int p=0; p < PROCESSES; p++) {
+		if (fork() == 0) {
+			for (int i=0; i < ITERATIONS; i++) {
+				st->lock.lock();
+				st->counter++;
+				st->lock.unlock();
+				st->lock.lock_shared();
+				st->lock.unlock_shared();
+			}
+			_exit(0);
+		}
+	}
+	wait_all(PROCESSES);
+	test_assert(st->counter == PROCESSES * ITERATIONS);
+	
+	// a writer that dies holding the lock is evicted
+	if (fork() == 0) {
+		st->lock.lock();
+		_exit(0);
+	}
+	wait_all(1);
+	test_assert(st->lock.lock() == true);
+	test_assert(st->lock.writer() == getpid());
+	st->lock.unlock();
+	
+	// readers that die holding the lock are evicted
+	if (fork() == 0) {
+		st->lock.lock_shared();
+		st->lock.lock_shared();
+		_exit(0);
+	}
+	wait_all(1);
+	test_assert(st->lock.reader_count() == 2);
+	test_assert(st->lock.lock() == true);
+	test_assert(st->lock.reader_count() == 0);
+	st->lock.unlock();
+	
+	// a live writer is never evicted, however long it holds the lock
+	int go[2], ready[2];
+	pipe(go);
+	pipe(ready);
+	char c;
+	st->done = false;
+	pid_t holder = fork();
+	if (holder == 0) {
+		st->lock.lock();
+		write(ready[1], "r", 1);
+		usleep(5 * shmrwlock::wait_timeout_ns / 1000);
+		st->done = true;
+		st->lock.unlock();
+		_exit(0);
+	}
+	read(ready[0], &c, 1);
+	test_assert(st->lock.writer() == holder);
+	test_assert(st->lock.lock() == false);
+	test_assert(st->done);
+	st->lock.unlock();
+	wait_all(1);
+	
+	// a reader that dies once it counted itself, before it looked for a writer, is evicted
+	auto& internals = static_cast<lock_internals&>(st->lock);
+	if (fork() == 0) {
+		internals.count_reader();
+		_exit(0);
+	}
+	wait_all(1);
+	test_assert(st->lock.reader_count() == 1);
+	test_assert(st->lock.lock() == true);
+	test_assert(st->lock.reader_count() == 0);
+	st->lock.unlock();
+	
+	// a reader that went untracked while every slot was taken does not release a tracked one
+	for (int p=0; p < shmrwlock::reader_slots; p++) {
+		if (fork() == 0) {
+			close(go[1]);
+			st->lock.lock_shared();
+			st->lock.unlock_shared();
+			write(ready[1], "r", 1);
+			char c;
+			read(go[0], &c, 1);
+			_exit(0);
+		}
+	}
+	for (int p=0; p < shmrwlock::reader_slots; p++) {
+		read(ready[0], &c, 1);
+	}
+	st->lock.lock_shared();
+	test_assert(internals.held_by(getpid()) == 0);
+	close(go[1]);
+	wait_all(shmrwlock::reader_slots);
+	st->lock.lock_shared();
+	test_assert(internals.held_by(getpid()) == 1);
+	st->lock.unlock_shared();
+	test_assert(internals.held_by(getpid()) == 1);
+	st->lock.unlock_shared();
+	test_assert(internals.held_by(getpid()) == 0);
+	test_assert(st->lock.reader_count() == 0);
+	
+	// the uncontended path reports nothing
+	test_assert(st->lock.lock() == false);
+	st->lock.unlock();
+	
+	report_success();
+	return 0;
+}
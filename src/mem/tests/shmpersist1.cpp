@@ -0,0 +1,135 @@
+/**
+ * @cxxparams "-g -I../.. -std=c++17"
+ * @ldparams "-lpthread -lrt"
+ **/
+
+#include <stdint.h>
+#include <iostream>
+#include <vector>
+#include <sys/wait.h>
+#include <testmatrix.h>
+#include "mem/addr_traits.hpp"
+#include "mem/shmallocator.hpp"
+
+using namespace mem;
+using namespace std;
+
+typedef pool_addr_traits<0x1004,16,12,8,12> shglobal4;
+
+struct obj
+{
+	uint64_t words[6];
+};
+
+typedef shmfixedpool<obj,shglobal4> pool_t;
+
+template<>
+FILE* mem::shmlog::logfile = nullptr;
+
+template<>
+FILE* log::logfile = nullptr;
+
+#define POOL 7
+#define OBJECTS 2001
+
+// fills a chain of objects whose first word links to the next, and returns the head
+obj* build (pool_t& pool, uint64_t tag)
+{
+	obj* head = nullptr;
+	for (uint64_t i = 0; i < OBJECTS; i++) {
+		obj* o = pool.allocate(1);
+		o->words[0] = (uint64_t)head;
+		o->words[1] = tag;
+		o->words[2] = i;
+		head = o;
+	}
+	return head;
+}
+
+bool verify (obj* head, uint64_t tag)
+{
+	uint64_t n = OBJECTS;
+	for (obj* o = head; o; o = (obj*)o->words[0]) {
+		if (o->words[1] != tag || o->words[2] != --n) {
+			return false;
+		}
+	}
+	return n == 0;
+}
+
+int main (int argc, char *argv[])
+{
+	report_executable_parameters();
+
+	log::initialize();
+	mem::shmlog::initialize();
+
+	pool_directory() = "/tmp";
+
+	{
+		pool_t pool = pool_t::attach(POOL, attach_persistent);
+		unlink(pool.backing_path().c_str()); // start from scratch
+		pool_t::detach(pool);
+	}
+
+	// a clean detach keeps everything, including the free list
+	{
+		pool_t pool = pool_t::attach(POOL, attach_persistent);
+		obj* head = build(pool, 1);
+		pool.set_root(head);
+		shmthreadcache<obj,shglobal4>::flush_all(POOL);
+		uint64_t free_objects = pool.hdr->fl.size();
+		uint64_t size = pool.hdr->size;
+		test_assert(free_objects > 0);
+		pool_t::detach(pool);
+
+		pool = pool_t::attach(POOL, attach_persistent);
+		test_assert(pool.root() == head);
+		test_assert(verify(head, 1));
+		test_assert(pool.hdr->fl.size() == free_objects);
+		test_assert(pool.hdr->size == size);
+		pool_t::detach(pool);
+	}
+
+	// a process that dies after a checkpoint leaves the pool as of that checkpoint
+	uint64_t checkpointed_size = 0;
+	{
+		pool_t pool = pool_t::attach(POOL, attach_persistent);
+		checkpointed_size = pool.hdr->size + OBJECTS * sizeof(obj);
+		pool_t::detach(pool);
+	}
+	pid_t child = fork();
+	if (child == 0) {
+		pool_t pool = pool_t::attach(POOL, attach_persistent);
+		obj* head = build(pool, 2);
+		pool.set_root(head);
+		shmthreadcache<obj,shglobal4>::flush_all(POOL);
+		pool.checkpoint();
+		build(pool, 3); // lost with the crash
+		_exit(0);
+	}
+	int status;
+	waitpid(child, &status, 0);
+	test_assert(WIFEXITED(status));
+
+	{
+		pool_t pool = pool_t::attach(POOL, attach_persistent);
+		obj* head = reinterpret_cast<obj*>(pool.root());
+		test_assert(head != nullptr);
+		test_assert(verify(head, 2));
+		test_assert(pool.hdr->refcnt == 1);
+		test_assert(pool.hdr->fl.size() == 0);
+		test_assert(pool.hdr->size >= checkpointed_size);
+		checkpointed_size = pool.hdr->size;
+
+		// the pool is usable again, and bump allocation resumes after the checkpointed objects
+		obj* o = pool.allocate(1);
+		test_assert((uint64_t)o >= (uint64_t)pool.start_address() + checkpointed_size);
+
+		unlink(pool.backing_path().c_str());
+		pool_t::detach(pool);
+	}
+
+	report_success();
+	return 0;
+}
@@ -0,0 +1,82 @@
+/**
+ * @cxxparams "-g -I../.. -std=c++17"
+ * @ldparams "-lpthread -lrt"
+ **/
+
+#include <stdint.h>
+#include <iostream>
+#include <set>
+#include <vector>
+#include <testmatrix.h>
+#include "mem/addr_traits.hpp"
+#include "mem/shmallocator.hpp"
+
+using namespace mem;
+using namespace std;
+
+typedef pool_addr_traits<0x1004,16,12,8,12> shglobal4;
+
+// 24 does not divide the segment size, so objects straddle segment boundaries at every offset
+struct obj
+{
+	uint64_t words[3];
+};
+
+template<>
+FILE* mem::shmlog::logfile = nullptr;
+
+template<>
+FILE* log::logfile = nullptr;
+
+#define SEGMENTS 32
+
+int main (int argc, char *argv[])
+{
+	report_executable_parameters();
+
+	log::initialize();
+	mem::shmlog::initialize();
+
+	constexpr uint64_t seg = shglobal4::segment_size;
+	auto pool = shmfixedpool<obj,shglobal4>::attach(7);
+
+	// every odd segment is freed along with the objects reaching into it, while the objects that
+	// lie wholly in even segments stay allocated
+	uint64_t n = SEGMENTS * seg / sizeof(obj);
+	obj* objs = pool.allocate(n);
+	uint64_t start = (uint64_t)pool.start_address();
+	vector<obj*> freed;
+	set<obj*> kept;
+	for (uint64_t i=0; i < n; i++) {
+		uint64_t first = ((uint64_t)&objs[i] - start) / seg;
+		uint64_t last = ((uint64_t)&objs[i] + sizeof(obj) - 1 - start) / seg;
+		if (first % 2 == 1 || last % 2 == 1) {
+			freed.push_back(&objs[i]);
+		} else {
+			kept.insert(&objs[i]);
+		}
+	}
+	pool.deallocate_batch(freed.data(), freed.size());
+	pool.trim();
+	test_assert(pool.hdr->stats.released_segments.load() > 0);
+
+	// the free list survived the release of the segments, and hands out each freed object once
+	vector<obj*> again(freed.size());
+	pool.allocate_batch(again.data(), again.size());
+	set<obj*> distinct(again.begin(), again.end());
+	test_assert(distinct.size() == again.size());
+	for (auto o : again) {
+		test_assert(kept.count(o) == 0);
+		test_assert((uint64_t)o >= start && (uint64_t)(o + 1) <= start + pool.hdr->size);
+		o->words[0] = o->words[1] = o->words[2] = 1;
+	}
+
+	pool.deallocate_batch(again.data(), again.size());
+	for (auto o : kept) {
+		pool.deallocate_batch(&o, 1);
+	}
+	shmfixedpool<obj,shglobal4>::detach(pool);
+
+	report_success();
+	return 0;
+}
@@ -0,0 +1,106 @@
+/**
+ * @cxxparams "-O2 -g -I../.. -std=c++17"
+ * @ldparams "-lpthread -lrt"
+ **/
+
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <testmatrix.h>
+#include "mem/addr_traits.hpp"
+#include "mem/shmallocator.hpp"
+
+using namespace mem;
+using namespace std;
+
+// 1 MB segments, so that a pool can hold a large tree
+typedef pool_addr_traits<0x1005,16,4,8,20> shlarge;
+
+#define NODES (1 << 20)
+#define PASSES 4
+
+struct tnode
+{
+	tnode* child[2];
+	uint64_t key;
+	uint64_t pad[5];
+};
+
+template<>
+FILE* mem::shmlog::logfile = nullptr;
+
+template<>
+FILE* log::logfile = nullptr;
+
+/**
+ * Builds a binary tree whose nodes are scattered randomly through the pool, then times
+ * depth-first traversals of it. Returns the time per pass in milliseconds.
+ */
+double run (int poolid, int options, const char* label)
+{
+	auto attach_start = chrono::steady_clock::now();
+	auto pool = shmfixedpool<tnode,shlarge>::attach(poolid, options);
+	vector<tnode*> nodes(NODES);
+	pool.allocate_batch(nodes.data(), NODES);
+	double attach_ms = chrono::duration<double,milli>(chrono::steady_clock::now() - attach_start).count();
+	
+	uint64_t x = 42;
+	for (int i=NODES-1; i > 0; i--) {
+		x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+		swap(nodes[i], nodes[(x >> 33) % (i + 1)]);
+	}
+	for (int i=0; i < NODES; i++) {
+		nodes[i]->key = i;
+		nodes[i]->child[0] = (2*i+1 < NODES) ? nodes[2*i+1] : nullptr;
+		nodes[i]->child[1] = (2*i+2 < NODES) ? nodes[2*i+2] : nullptr;
+	}
+	
+	uint64_t sum = 0;
+	auto start = chrono::steady_clock::now();
+	for (int p=0; p < PASSES; p++) {
+		vector<tnode*> stack { nodes[0] };
+		while (!stack.empty()) {
+			tnode* n = stack.back();
+			stack.pop_back();
+			sum += n->key;
+			if (n->child[0]) stack.push_back(n->child[0]);
+			if (n->child[1]) stack.push_back(n->child[1]);
+		}
+	}
+	double ms = chrono::duration<double,milli>(chrono::steady_clock::now() - start).count() / PASSES;
+	
+	test_assert(sum == (uint64_t)PASSES * NODES * (NODES - 1) / 2);
+	cout << label << ": attach+allocate " << attach_ms << " ms, traverse " << ms << " ms/pass" << endl;
+	
+	pool.deallocate_batch(nodes.data(), NODES);
+	shmfixedpool<tnode,shlarge>::detach(pool);
+	return ms;
+}
+
+int main (int argc, char *argv[])
+{
+	report_executable_parameters();
+	
+	log::initialize();
+	mem::shmlog::initialize();
+	
+	// each configuration runs in its own process, so that page state does not carry over
+	const int configs[] = { attach_default, attach_prefault, attach_hugepages, attach_hugepages | attach_prefault };
+	const char* labels[] = { "base pages", "prefaulted", "huge pages", "huge pages, prefaulted" };
+	for (int c=0; c < 4; c++) {
+		if (fork() == 0) {
+			run(1 + c, configs[c], labels[c]);
+			_exit(0);
+		}
+		int status;
+		wait(&status);
+		test_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	}
+	
+	report_success();
+	return 0;
+}
@@ -1,5 +1,9 @@
 #include "util/log.hpp"
 #include "memsys.hpp"
+#include "mem/shmallocator.hpp"
+
+template<>
+FILE* mem::shmlog::logfile = nullptr;
 
 namespace MemSys
 {
@@ -9,6 +13,7 @@ void initialize () {
 
 	// Init global configuration
 	log::print("MemSys::initialize()");
+	mem::shmlog::initialize();
 
 	// Init space for DocReg 
 	
@@ -1,47 +1,1044 @@
 #include <string>
 #include <cassert>
+#include <algorithm>
+#include <atomic>
+#include <unordered_map>
+#include <vector>
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include "mque.hpp"
+#include "mque_ring.hpp"
+#include "util/log.hpp"
+#include "mem/shmallocator.hpp"
 
 namespace MQue
 {
 
 int mqsockfd = 0;
 
+typedef mem::shmheap<payload_addr_traits> payload_heap;
 
-void initialize ()
+// inboxes are kept in a pool of the payload region, above the heap's size classes
+typedef mem::shmfixedpool<inbox, payload_addr_traits> inbox_pool;
+constexpr uint8_t inbox_pool_id = 40;
+constexpr uint32_t inbox_ready = 0x494e4258; // set once an inbox has been constructed
+
+inbox_pool inboxes;
+inbox* my_inbox = nullptr;
+
+// descriptors are sent and received in batches of up to this many
+constexpr int batch_size = 64;
+
+// the pool of descriptors whose message carries no payload
+constexpr uint8_t no_payload = 0xff;
+
+struct outbound
+{
+	proc_t to;
+	Descriptor d;
+};
+
+// messages queued by this thread and not yet flushed
+thread_local std::vector<outbound> outbox;
+
+struct handler_entry
+{
+	Handler fn;
+	void* ctx;
+};
+
+// indexed by Message::code
+handler_entry handlers[256];
+Priority priorities[256]; // bulk unless the application says otherwise
+
+// how deeply this thread is dispatching, so that stalled senders only poll from the top level
+thread_local int dispatching = 0;
+
+// descriptors taken off this process's inbox by a sender that stalled inside a handler, which
+// could not dispatch them there; poll delivers them before anything else
+std::vector<Descriptor> deferred;
+
+// how long a bulk sender waits on a peer that pops nothing before it drops the message
+constexpr long stall_timeout_ns = 5000000000;
+
+struct pending_request
+{
+	std::coroutine_handle<> waiter;
+	Message* reply;
+};
+
+// requests awaiting their replies, by correlation id
+std::unordered_map<uint32_t, pending_request> pending;
+std::atomic<uint32_t> next_corr(1);
+
+struct watcher
+{
+	int fd;
+	Watcher fn;
+	void* ctx;
+};
+
+int epollfd = 0;
+std::unordered_map<int, watcher*> watchers;
+bool running = false;
+
+/**
+ * Precedes every payload in the shared heap. Each process that holds a descriptor of the payload
+ * owns one reference; the last one to release it frees the block.
+ */
+struct alignas(16) payload_header
+{
+	std::atomic<uint32_t> refs;
+	uint32_t size;
+};
+
+
+/**
+ * Each process binds an abstract socket name derived from its pid, so peers need no rendezvous
+ * and nothing is left behind in the filesystem.
+ */
+static socklen_t address_of (proc_t pid, struct sockaddr_un* addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	int len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "%s-mque.%u", appName, pid);
+	return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+
+static payload_header* header_of (const Message& msg)
+{
+	return reinterpret_cast<payload_header*>(msg.data) - 1;
+}
+
+
+static Descriptor describe (const Message& msg)
+{
+	Descriptor d;
+	d.from_pid = msg.from_pid;
+	d.code = msg.code;
+	d.pool = no_payload;
+	d.offset = 0;
+	d.size = msg.size;
+	d.corr = msg.corr;
+	if (msg.data) {
+		payload_header* hdr = header_of(msg);
+		d.pool = payload_addr_traits::poolid(hdr);
+		d.offset = (uint32_t)((uint64_t)hdr - (uint64_t)payload_addr_traits::base_address(d.pool));
+	}
+	return d;
+}
+
+
+static Message message_of (const Descriptor& d)
+{
+	Message msg { d.from_pid, d.code, d.size, nullptr };
+	msg.corr = d.corr;
+	if (d.pool != no_payload) {
+		auto hdr = reinterpret_cast<payload_header*>((uint64_t)payload_addr_traits::base_address(d.pool) + d.offset);
+		msg.data = reinterpret_cast<uint8_t*>(hdr + 1);
+	}
+	return msg;
+}
+
+
+/**
+ * Dispatches a received payload in place, then drops the reference that came with its descriptor
+ * and closes the file descriptor that came with it, if any.
+ */
+static void deliver (const Descriptor& d, int fd = -1)
+{
+	Message msg = message_of(d);
+	msg.fd = fd;
+	if (msg.data) {
+		// the payload may lie in segments that the sender has grown the heap into
+		payload_heap::instance().ensure_mapped(msg.data + d.size - 1);
+	}
+	dispatching++;
+	dispatch(msg);
+	dispatching--;
+	release(msg);
+	if (fd != -1) {
+		close(fd);
+	}
+}
+
+
+/**
+ * Drops the references held by descriptors that were left in an inbox, by a process that died
+ * before it could receive them or by this one as it finalizes.
+ */
+static void discard (inbox* ib)
 {
-	
+	Descriptor d;
+	while (ib->pop(d)) {
+		release(message_of(d));
+	}
+	for (auto& l : ib->lane) {
+		l.producer.store(0, std::memory_order_relaxed);
+	}
+	// credits taken by senders that died before they could push are lost otherwise
+	ib->credits.store(inbox::window, std::memory_order_relaxed);
+}
+
+
+/**
+ * Visits every inbox that has been constructed, until the visitor returns true.
+ */
+template<typename F>
+static inbox* find_inbox (F&& visit)
+{
+	uint64_t n = inboxes.hdr->size / sizeof(inbox);
+	if (n == 0) {
+		return nullptr;
+	}
+	inbox* first = reinterpret_cast<inbox*>(inboxes.start_address());
+	inboxes.ensure_mapped(first + n - 1);
+	for (uint64_t i = 0; i < n; i++) {
+		inbox* ib = first + i;
+		if (ib->ready.load(std::memory_order_acquire) == inbox_ready && visit(ib)) {
+			return ib;
+		}
+	}
+	return nullptr;
+}
+
+
+/**
+ * Takes over the inbox of a process that finalized or died, or else constructs a new one.
+ */
+static inbox* claim_inbox ()
+{
+	int32_t me = getpid();
+	inbox* ib = find_inbox([me] (inbox* ib) {
+		int32_t owner = ib->owner.load(std::memory_order_relaxed);
+		return (owner == 0 || (kill(owner, 0) == -1 && errno == ESRCH)) &&
+		       ib->owner.compare_exchange_strong(owner, me, std::memory_order_acquire);
+	});
+	if (ib) {
+		discard(ib);
+		return ib;
+	}
+	ib = new (inboxes.allocate_uncached()) inbox();
+	ib->owner.store(me, std::memory_order_relaxed);
+	ib->ready.store(inbox_ready, std::memory_order_release);
+	return ib;
+}
+
+
+/**
+ * Wakes a peer after pushing into its inbox. A peer that blocks in its event loop is woken by an
+ * empty datagram, which its loop sees as the socket becoming readable.
+ */
+static void notify (proc_t to, inbox* ib)
+{
+	if (ib->wake() == inbox::polling) {
+		struct sockaddr_un addr;
+		socklen_t len = address_of(to, &addr);
+		sendto(mqsockfd, nullptr, 0, MSG_DONTWAIT, reinterpret_cast<struct sockaddr*>(&addr), len);
+	}
+}
+
+
+enum push_result
+{
+	pushed,
+	refused, // the caller falls back to the socket
+	dropped, // the caller releases the message
+};
+
+/**
+ * Pushes a descriptor into a peer's inbox. Interactive messages are refused if their ring is full,
+ * so that the caller can fall back to the socket. Bulk messages wait for a credit, and are only
+ * refused if the peer goes away. While they wait, a sender at the top level receives, and a sender
+ * inside a handler takes its own inbox's descriptors aside for later, so that two peers flooding each
+ * other cannot deadlock. A peer that pops nothing for stall_timeout_ns has its message dropped.
+ */
+static push_result push_to (proc_t to, inbox* ib, const Descriptor& d)
+{
+	if (priorities[d.code] == interactive) {
+		return ib->push_interactive(d) ? pushed : refused;
+	}
+	if (ib->push(d)) {
+		return pushed;
+	}
+	ib->stalls.fetch_add(1, std::memory_order_relaxed);
+	uint64_t seen = ib->consumed();
+	struct timespec since;
+	clock_gettime(CLOCK_MONOTONIC, &since);
+	while (!ib->push(d)) {
+		if (ib->owner.load(std::memory_order_relaxed) != (int32_t)to ||
+				(kill(to, 0) == -1 && errno == ESRCH)) {
+			return refused;
+		}
+		notify(to, ib);
+		if (dispatching == 0) {
+			poll();
+		} else {
+			Descriptor mine;
+			while (my_inbox && my_inbox->pop(mine)) {
+				deferred.push_back(mine);
+			}
+		}
+		sched_yield();
+
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (ib->consumed() != seen) {
+			seen = ib->consumed();
+			since = now;
+		} else if ((now.tv_sec - since.tv_sec) * 1000000000L + (now.tv_nsec - since.tv_nsec) > stall_timeout_ns) {
+			ib->dropped.fetch_add(1, std::memory_order_relaxed);
+			log::warning("Dropped a message to a process that has stopped receiving.");
+			return dropped;
+		}
+	}
+	return pushed;
+}
+
+
+// for each peer that this thread last sent a message over the socket, how many reads of its socket
+// the peer had begun by then
+thread_local std::unordered_map<proc_t, uint64_t> spilled;
+
+/**
+ * Whether messages to a peer have to follow the ones this thread sent it over the socket, rather than
+ * overtake them through its inbox. That lasts until the peer has read its socket empty, in a read
+ * that began after the last of them was sent.
+ */
+static bool spilled_to (proc_t to, inbox* ib)
+{
+	auto it = spilled.find(to);
+	if (it == spilled.end()) {
+		return false;
+	}
+	if (ib->socket_drained.load(std::memory_order_seq_cst) > it->second) {
+		spilled.erase(it);
+		return false;
+	}
+	return true;
+}
+
+
+static void note_spilled (proc_t to, inbox* ib)
+{
+	spilled[to] = ib->socket_reads.load(std::memory_order_seq_cst);
+}
+
+
+/**
+ * Finds the inbox of a peer, remembering it per thread. Returns nullptr if the peer has none.
+ */
+static inbox* inbox_of (proc_t pid)
+{
+	static thread_local std::unordered_map<proc_t, inbox*> known;
+	auto it = known.find(pid);
+	if (it != known.end() && it->second->owner.load(std::memory_order_relaxed) == (int32_t)pid) {
+		return it->second;
+	}
+	inbox* ib = find_inbox([pid] (inbox* ib) {
+		return ib->owner.load(std::memory_order_relaxed) == (int32_t)pid;
+	});
+	if (ib) {
+		known[pid] = ib;
+	} else {
+		known.erase(pid);
+	}
+	return ib;
+}
+
+
+static void on_socket (int, uint32_t, void*)
+{
+	poll();
+}
+
+
+void initialize (int options)
+{
+
 	assert(mqsockfd == 0);
-	mqsockfd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	mqsockfd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
 	assert(mqsockfd != -1);
 
-	
-	
+	struct sockaddr_un addr;
+	socklen_t len = address_of(getpid(), &addr);
+	if (bind(mqsockfd, reinterpret_cast<struct sockaddr*>(&addr), len)) {
+		throw errno_runtime_error;
+	}
+
+	payload_heap::attach(0);
+	inboxes = inbox_pool::attach(inbox_pool_id);
+	if (!(options & socket_only)) {
+		try {
+			my_inbox = claim_inbox();
+		} catch (mem::reallocation_request&) {
+			// the inbox pool is full, which leaves this process reachable over its socket alone
+			log::warning("No inbox could be allocated, so messages to this process go over its socket.");
+		}
+	}
+
+	epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epollfd == -1) {
+		throw errno_runtime_error;
+	}
+	watch(mqsockfd, EPOLLIN, on_socket, nullptr);
+
 }
 
 
+static void on_timer (int fd, uint32_t events, void* ctx);
+
 void finalize ()
 {
+	for (auto& d : deferred) {
+		release(message_of(d));
+	}
+	deferred.clear();
+	if (my_inbox) {
+		discard(my_inbox);
+		my_inbox->owner.store(0, std::memory_order_release);
+		my_inbox = nullptr;
+	}
+	if (inboxes.hdr) {
+		inbox_pool::detach(inboxes);
+		inboxes.hdr = nullptr;
+	}
+	if (epollfd > 0) {
+		// timers belong to MQue, whereas other descriptors are the application's to close
+		while (!watchers.empty()) {
+			watcher* w = watchers.begin()->second;
+			if (w->fn == on_timer) {
+				cancel_timer(w->fd);
+			} else {
+				unwatch(w->fd);
+			}
+		}
+		close(epollfd);
+		epollfd = 0;
+	}
+	if (mqsockfd > 0) {
+		close(mqsockfd);
+		mqsockfd = 0;
+	}
+	if (payload_heap::attached()) {
+		payload_heap::detach();
+	}
+}
+
 
+/**
+ * Allocates a payload in the shared heap with one reference, owned by the caller.
+ */
+Message create (uint8_t code, uint32_t size)
+{
+	void* block = payload_heap::instance().allocate(sizeof(payload_header) + size);
+	payload_header* hdr = new (block) payload_header();
+	hdr->refs.store(1, std::memory_order_relaxed);
+	hdr->size = size;
+	return Message { (proc_t)getpid(), code, size, reinterpret_cast<uint8_t*>(hdr + 1) };
 }
 
 
+/**
+ * Hands a reference to the payload to a peer. The caller keeps its own, so one payload can be
+ * sent to any number of peers before the caller releases it. Descriptors go into the peer's inbox,
+ * or over the socket when the peer has no inbox or its ring is full. Once one has gone over the
+ * socket, the thread's later messages to that peer follow it there until the peer has read them,
+ * so that they arrive in the order they were sent.
+ *
+ * A message with an fd passes a duplicate of it to the peer, which always goes over the socket.
+ * The caller keeps its own descriptor.
+ */
 void send (proc_t to, const Message& msg)
 {
-	
+	Descriptor d = describe(msg);
+	retain(msg);
+
+	inbox* ib = inbox_of(to);
+	if (msg.fd == -1 && ib && !spilled_to(to, ib)) {
+		push_result r = push_to(to, ib, d);
+		if (r == pushed) {
+			notify(to, ib);
+			return;
+		}
+		if (r == dropped) {
+			release(msg);
+			return;
+		}
+	}
+
+	struct sockaddr_un addr;
+	struct iovec iov = { &d, sizeof(d) };
+	struct msghdr mh = {};
+	mh.msg_name = &addr;
+	mh.msg_namelen = address_of(to, &addr);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+
+	char control[CMSG_SPACE(sizeof(int))];
+	if (msg.fd != -1) {
+		mh.msg_control = control;
+		mh.msg_controllen = sizeof(control);
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &msg.fd, sizeof(int));
+	}
+
+	if (sendmsg(mqsockfd, &mh, 0) == -1) {
+		release(msg);
+		if (errno == ECONNREFUSED || errno == ENOENT) {
+			log::warning("Dropped a message to a process that is not listening.");
+			return;
+		}
+		throw errno_runtime_error;
+	}
+	if (ib) {
+		note_spilled(to, ib);
+		notify(to, ib);
+	}
+}
+
+
+/**
+ * Like send, but never waits: a bulk message that finds no credit left, or a descriptor that finds
+ * the socket full, is dropped and counted in the peer's stats. Returns whether the message went.
+ * For messages that a peer can do without, such as updates that it can catch up on, from a sender
+ * that must not be held up by slow peers.
+ */
+bool offer (proc_t to, const Message& msg)
+{
+	assert(msg.fd == -1);
+	Descriptor d = describe(msg);
+	retain(msg);
+
+	inbox* ib = inbox_of(to);
+	if (ib && !spilled_to(to, ib)) {
+		bool pushed = priorities[d.code] == interactive ? ib->push_interactive(d) : ib->push(d);
+		if (pushed) {
+			notify(to, ib);
+			return true;
+		}
+		if (priorities[d.code] != interactive) {
+			ib->dropped.fetch_add(1, std::memory_order_relaxed);
+			release(msg);
+			return false;
+		}
+	}
+
+	struct sockaddr_un addr;
+	if (sendto(mqsockfd, &d, sizeof(d), MSG_DONTWAIT, reinterpret_cast<struct sockaddr*>(&addr), address_of(to, &addr)) == -1) {
+		release(msg);
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			if (ib) {
+				ib->dropped.fetch_add(1, std::memory_order_relaxed);
+			}
+			return false;
+		}
+		if (errno == ECONNREFUSED || errno == ENOENT) {
+			log::warning("Dropped a message to a process that is not listening.");
+			return false;
+		}
+		throw errno_runtime_error;
+	}
+	if (ib) {
+		note_spilled(to, ib);
+		notify(to, ib);
+	}
+	return true;
+}
+
+
+/**
+ * Like send, but holds the message back until the thread flushes, so that a burst of small
+ * messages costs each peer at most one wakeup and the socket one system call per batch.
+ */
+void queue (proc_t to, const Message& msg)
+{
+	if (msg.fd != -1) {
+		flush();
+		send(to, msg);
+		return;
+	}
+	retain(msg);
+	outbox.push_back(outbound { to, describe(msg) });
+	if (outbox.size() == batch_size) {
+		flush();
+	}
+}
+
+
+/**
+ * Sends up to batch_size queued messages, pushing them into inboxes where it can and passing the
+ * rest to the socket in one call.
+ */
+static void send_batch (outbound* first, int n)
+{
+	outbound* woken[batch_size];
+	int nwoken = 0;
+
+	struct mmsghdr hdrs[batch_size];
+	struct iovec iovs[batch_size];
+	struct sockaddr_un addrs[batch_size];
+	outbound* pending[batch_size];
+	int npending = 0;
+
+	for (outbound* it = first; it != first + n; it++) {
+		outbound& o = *it;
+		inbox* ib = inbox_of(o.to);
+		// a peer's messages all go through the socket once one of them has, to keep them in order
+		bool follow = ib && spilled_to(o.to, ib);
+		for (int i = 0; i < npending; i++) {
+			follow = follow || pending[i]->to == o.to;
+		}
+		push_result r = ib && !follow ? push_to(o.to, ib, o.d) : refused;
+		if (r == pushed) {
+			int i = 0;
+			while (i < nwoken && woken[i]->to != o.to) {
+				i++;
+			}
+			if (i == nwoken) {
+				woken[nwoken++] = &o;
+			}
+			continue;
+		}
+		if (r == dropped) {
+			release(message_of(o.d));
+			continue;
+		}
+		memset(&hdrs[npending], 0, sizeof(hdrs[npending]));
+		iovs[npending] = { &o.d, sizeof(o.d) };
+		hdrs[npending].msg_hdr.msg_iov = &iovs[npending];
+		hdrs[npending].msg_hdr.msg_iovlen = 1;
+		hdrs[npending].msg_hdr.msg_name = &addrs[npending];
+		hdrs[npending].msg_hdr.msg_namelen = address_of(o.to, &addrs[npending]);
+		pending[npending++] = &o;
+	}
+
+	for (int i = 0; i < nwoken; i++) {
+		notify(woken[i]->to, inbox_of(woken[i]->to));
+	}
+
+	int sent = 0;
+	while (sent < npending) {
+		int r = sendmmsg(mqsockfd, hdrs + sent, npending - sent, 0);
+		if (r > 0) {
+			sent += r;
+			continue;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		// the first remaining message failed; drop it and carry on with the rest
+		release(message_of(pending[sent]->d));
+		if (errno == ECONNREFUSED || errno == ENOENT) {
+			log::warning("Dropped a message to a process that is not listening.");
+		} else {
+			log::error("Failed to send a message descriptor.");
+		}
+		sent++;
+	}
+
+	for (int i = 0; i < npending; i++) {
+		if (inbox* ib = inbox_of(pending[i]->to)) {
+			note_spilled(pending[i]->to, ib);
+		}
+	}
+}
+
+
+/**
+ * Sends the messages this thread has queued, in the order they were queued to each peer.
+ *
+ * A push that waits for credits runs handlers, which may queue more messages. The queue is swapped
+ * out before it is sent, so those land in an empty one, and are sent once the current batch is
+ * through rather than from a nested flush.
+ */
+void flush ()
+{
+	static thread_local bool flushing = false;
+	if (flushing) {
+		return;
+	}
+	// cleared however the flush ends, since a failed send throws out of it
+	struct guard
+	{
+		guard () { flushing = true; }
+		~guard () { flushing = false; }
+	} g;
+	std::vector<outbound> batch;
+	while (!outbox.empty()) {
+		batch.swap(outbox);
+		for (size_t i = 0; i < batch.size(); i += batch_size) {
+			send_batch(batch.data() + i, std::min<size_t>(batch_size, batch.size() - i));
+		}
+		batch.clear();
+	}
+	// keep the larger buffer for the next burst
+	outbox.swap(batch);
+}
+
+
+void retain (const Message& msg)
+{
+	if (!msg.data) {
+		return;
+	}
+	header_of(msg)->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+void release (const Message& msg)
+{
+	if (!msg.data) {
+		return;
+	}
+	payload_header* hdr = header_of(msg);
+	if (hdr->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		payload_heap::instance().deallocate(hdr, sizeof(payload_header) + hdr->size);
+	}
 }
 
 
-void poll ()
+/**
+ * Receives every descriptor that is waiting in the inbox or on the socket, and dispatches the
+ * payloads in place. The socket is drained a batch of datagrams per system call. Returns the
+ * number of messages dispatched.
+ */
+int poll ()
 {
+	int delivered = 0;
+	if (!deferred.empty()) {
+		std::vector<Descriptor> now;
+		now.swap(deferred);
+		for (auto& d : now) {
+			deliver(d);
+			delivered++;
+		}
+	}
 
+	Descriptor d;
+	while (my_inbox && my_inbox->pop(d)) {
+		deliver(d);
+		delivered++;
+	}
+
+	// senders that spilled to the socket wait for a read that began after they sent, to drain it
+	uint64_t pass = my_inbox ? my_inbox->socket_reads.fetch_add(1, std::memory_order_seq_cst) + 1 : 0;
+	auto drained = [pass] () {
+		if (my_inbox) {
+			uint64_t was = my_inbox->socket_drained.load(std::memory_order_relaxed);
+			while (was < pass && !my_inbox->socket_drained.compare_exchange_weak(was, pass, std::memory_order_seq_cst)) {}
+		}
+	};
+
+	Descriptor ds[batch_size];
+	struct mmsghdr hdrs[batch_size];
+	struct iovec iovs[batch_size];
+	char controls[batch_size][CMSG_SPACE(sizeof(int))];
+	for (;;) {
+		memset(hdrs, 0, sizeof(hdrs));
+		for (int i = 0; i < batch_size; i++) {
+			iovs[i] = { &ds[i], sizeof(Descriptor) };
+			hdrs[i].msg_hdr.msg_iov = &iovs[i];
+			hdrs[i].msg_hdr.msg_iovlen = 1;
+			hdrs[i].msg_hdr.msg_control = controls[i];
+			hdrs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+		}
+		int r = recvmmsg(mqsockfd, hdrs, batch_size, MSG_DONTWAIT | MSG_CMSG_CLOEXEC, nullptr);
+		if (r == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				drained();
+				return delivered;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			throw errno_runtime_error;
+		}
+		// what a sender pushed into the inbox before it spilled to the socket goes first
+		while (my_inbox && my_inbox->pop(d)) {
+			deliver(d);
+			delivered++;
+		}
+		for (int i = 0; i < r; i++) {
+			int fd = -1;
+			struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdrs[i].msg_hdr);
+			if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+				memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+			}
+			if (hdrs[i].msg_len == 0) {
+				continue; // a doorbell
+			}
+			if (hdrs[i].msg_len != sizeof(Descriptor) || (hdrs[i].msg_hdr.msg_flags & MSG_CTRUNC)) {
+				log::error("Received a malformed message descriptor.");
+				if (fd != -1) {
+					close(fd);
+				}
+				continue;
+			}
+			deliver(ds[i], fd);
+			delivered++;
+		}
+		if (r < batch_size) {
+			drained();
+			return delivered;
+		}
+	}
+}
+
+
+/**
+ * Sleeps until a peer sends something or the timeout passes. Peers only make a system call to
+ * wake this process while it is in here.
+ */
+void wait (long timeout_ns)
+{
+	// descriptors taken aside by a stalled sender are already here
+	if (my_inbox && deferred.empty()) {
+		my_inbox->sleep(timeout_ns);
+	}
 }
 
 
+/**
+ * Calls the handler registered for the message's code, or resumes the coroutine that awaits it
+ * if the message is a reply.
+ */
 void dispatch (const Message& msg)
 {
-	
-	
+	if (msg.corr & reply_bit) {
+		auto it = pending.find(msg.corr & ~reply_bit);
+		if (it == pending.end()) {
+			log::warning("Received a reply that no request awaits.");
+			return;
+		}
+		pending_request p = it->second;
+		pending.erase(it);
+		// the reply outlives this dispatch, so it keeps a reference of its own
+		retain(msg);
+		*p.reply = msg;
+		p.waiter.resume();
+		return;
+	}
+	handler_entry& h = handlers[msg.code];
+	if (h.fn) {
+		h.fn(msg, h.ctx);
+	}
+}
+
+
+/**
+ * Sends a reply to a request that a handler received. The reply is routed to the coroutine that
+ * made the request, rather than to a handler.
+ */
+void reply (const Message& request, Message& response)
+{
+	response.corr = request.corr | reply_bit;
+	send(request.from_pid, response);
+}
+
+
+/**
+ * Sends the request under a fresh correlation id, and resumes the coroutine when the reply to it
+ * is dispatched.
+ */
+void Request::await_suspend (std::coroutine_handle<> waiter)
+{
+	uint32_t corr;
+	do {
+		corr = next_corr.fetch_add(1, std::memory_order_relaxed) & ~reply_bit;
+	} while (corr == 0);
+	pending[corr] = pending_request { waiter, &response };
+	msg.corr = corr;
+	send(to, msg);
+}
+
+
+Request request (proc_t to, const Message& msg)
+{
+	return Request { to, msg, Message {} };
+}
+
+
+/**
+ * Registers the handler for one message code, replacing any before it. A null handler drops
+ * messages of that code.
+ */
+void handle (uint8_t code, Handler fn, void* ctx)
+{
+	handlers[code] = handler_entry { fn, ctx };
+}
+
+
+/**
+ * Sets whether messages of a code go ahead of bulk traffic. Senders and receivers must agree, so
+ * every process sets the same priorities before it sends anything.
+ */
+void prioritize (uint8_t code, Priority priority)
+{
+	priorities[code] = priority;
+}
+
+
+/**
+ * Reports the queue depths and flow control counters of a peer's inbox, or of this process's own.
+ */
+Stats stats (proc_t pid)
+{
+	Stats st = {};
+	inbox* ib = pid == (proc_t)getpid() ? my_inbox : inbox_of(pid);
+	if (ib) {
+		st.interactive_depth = ib->urgent.depth();
+		st.bulk_depth = ib->bulk_depth();
+		st.credits = ib->credits.load(std::memory_order_relaxed);
+		st.stalls = ib->stalls.load(std::memory_order_relaxed);
+		st.dropped = ib->dropped.load(std::memory_order_relaxed);
+	}
+	return st;
+}
+
+
+/**
+ * Watches a file descriptor in the event loop. The loop is edge-triggered, so the watcher must
+ * drain the descriptor each time it is called.
+ */
+void watch (int fd, uint32_t events, Watcher fn, void* ctx)
+{
+	assert(epollfd > 0);
+	watcher* w = new watcher { fd, fn, ctx };
+	struct epoll_event ev;
+	ev.events = events | EPOLLET;
+	ev.data.ptr = w;
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev)) {
+		delete w;
+		throw errno_runtime_error;
+	}
+	watchers[fd] = w;
+}
+
+
+void unwatch (int fd)
+{
+	auto it = watchers.find(fd);
+	if (it == watchers.end()) {
+		return;
+	}
+	epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, nullptr);
+	delete it->second;
+	watchers.erase(it);
+}
+
+
+struct timer_entry
+{
+	Watcher fn;
+	void* ctx;
+};
+
+static void on_timer (int fd, uint32_t events, void* ctx)
+{
+	uint64_t expirations;
+	while (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+		timer_entry* t = reinterpret_cast<timer_entry*>(ctx);
+		t->fn(fd, events, t->ctx);
+	}
+}
+
+
+/**
+ * Calls fn every interval_ns from the event loop, or once if repeat is false. Returns the timer's
+ * descriptor, which cancel_timer takes.
+ */
+int timer (long interval_ns, bool repeat, Watcher fn, void* ctx)
+{
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd == -1) {
+		throw errno_runtime_error;
+	}
+	struct itimerspec spec = {};
+	spec.it_value = { interval_ns / 1000000000, interval_ns % 1000000000 };
+	if (repeat) {
+		spec.it_interval = spec.it_value;
+	}
+	timerfd_settime(fd, 0, &spec, nullptr);
+	watch(fd, EPOLLIN, on_timer, new timer_entry { fn, ctx });
+	return fd;
+}
+
+
+void cancel_timer (int fd)
+{
+	auto it = watchers.find(fd);
+	if (it == watchers.end()) {
+		return;
+	}
+	delete reinterpret_cast<timer_entry*>(it->second->ctx);
+	unwatch(fd);
+	close(fd);
+}
+
+
+/**
+ * Waits for one round of events, up to timeout_ns or indefinitely if it is negative, and handles
+ * them. Messages that arrive in the inbox while the loop blocks ring the socket as a doorbell,
+ * so one epoll set covers the socket, the rings and every watched descriptor.
+ */
+void run_once (long timeout_ns)
+{
+	constexpr int max_events = 64;
+	struct epoll_event events[max_events];
+
+	// what was already waiting counts as this round, since its handlers may be what the caller
+	// is waiting for
+	if (poll() > 0) {
+		return;
+	}
+	int timeout_ms = timeout_ns < 0 ? -1 : (int)((timeout_ns + 999999) / 1000000);
+	if (my_inbox && !my_inbox->block(inbox::polling)) {
+		timeout_ms = 0;
+	}
+	int n = epoll_wait(epollfd, events, max_events, timeout_ms);
+	if (my_inbox) {
+		my_inbox->idle.store(inbox::awake, std::memory_order_relaxed);
+	}
+	if (n == -1) {
+		if (errno == EINTR) {
+			return;
+		}
+		throw errno_runtime_error;
+	}
+	for (int i = 0; i < n; i++) {
+		watcher* w = reinterpret_cast<watcher*>(events[i].data.ptr);
+		w->fn(w->fd, events[i].events, w->ctx);
+	}
+	poll();
+}
+
+
+/**
+ * Runs the event loop until a handler or watcher calls stop.
+ */
+void run ()
+{
+	running = true;
+	while (running) {
+		run_once(-1);
+	}
+}
+
+
+void stop ()
+{
+	running = false;
 }
 
 
@@ -1,30 +1,168 @@
 #pragma once
 
+#include <stdint.h>
+#include <coroutine>
+#include <exception>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include "mem/addr_traits.hpp"
 
+/**
+ * Implements messaging between liveparse processes on one host.
+ * Payloads are written once into a shared heap; only descriptors of them are passed between
+ * processes, through rings in shared memory or, failing that, a socket.
+ */
 
 namespace MQue
 {
 
 typedef uint32_t proc_t;
 
+// payloads live in a region of their own: 64 pools of up to 64 segments of 1 MB
+typedef mem::pool_addr_traits<0x1010,16,6,6,20> payload_addr_traits;
+
+/**
+ * A message as senders fill it and handlers see it. The payload is read in place in shared memory
+ * and stays valid until the handler returns, unless the handler retains it. Messages without a
+ * payload have null data.
+ *
+ * A message may also carry a file descriptor, such as a memfd or shm object that backs a document
+ * or pool. The receiver's copy is closed once the handler returns, which leaves its mappings in
+ * place; a handler that needs the descriptor itself dups it.
+ */
 struct Message
 {
-	proc_t  from_pid;
+	proc_t    from_pid;
+	uint8_t   code;
+	uint32_t  size;
+	uint8_t*  data;
+	int       fd = -1;
+	uint32_t  corr = 0; // correlation id of a request, and of the reply to it
+};
+
+// set in the correlation id of replies
+constexpr uint32_t reply_bit = 0x80000000;
+
+/**
+ * What is passed to a peer: where a payload lives, rather than the payload itself.
+ */
+struct Descriptor
+{
+	proc_t    from_pid;
 	uint8_t   code;
+	uint8_t   pool;   // of the payload in the shared heap
+	uint32_t  offset; // of the payload within its pool
 	uint32_t  size;
-	uint8_t   data[];
+	uint32_t  corr;
+};
+
+enum Priority : uint8_t
+{
+	bulk = 0,        // flow controlled, and queued behind interactive messages
+	interactive = 1, // goes ahead of bulk messages, such as the edits of a keystroke
 };
 
-void initialize ();
+/**
+ * The state of one process's inbox.
+ */
+struct Stats
+{
+	uint64_t interactive_depth; // messages waiting to be received
+	uint64_t bulk_depth;
+	int32_t  credits;           // bulk messages that senders may still push
+	uint64_t stalls;            // times a sender had to wait for credits
+	uint64_t dropped;           // messages given up on because the process stopped receiving, or
+	                            // had no room for what was offered to it
+};
+
+typedef void (*Handler) (const Message& msg, void* ctx);
+
+typedef void (*Watcher) (int fd, uint32_t events, void* ctx);
+
+enum initialize_options
+{
+	initialize_default = 0x0,
+	socket_only        = 0x1, // claim no inbox, so that peers reach this process over its socket
+};
+
+void initialize (int options = initialize_default);
 
 void finalize ();
 
+Message create (uint8_t code, uint32_t size);
+
 void send (proc_t to, const Message& msg);
 
-void poll ();
+bool offer (proc_t to, const Message& msg);
+
+void queue (proc_t to, const Message& msg);
+
+void flush ();
+
+void retain (const Message& msg);
+
+void release (const Message& msg);
+
+int poll ();
+
+void wait (long timeout_ns);
 
 void dispatch (const Message& msg);
-	
+
+void handle (uint8_t code, Handler fn, void* ctx = nullptr);
+
+void prioritize (uint8_t code, Priority priority);
+
+Stats stats (proc_t pid);
+
+void watch (int fd, uint32_t events, Watcher fn, void* ctx = nullptr);
+
+void unwatch (int fd);
+
+int timer (long interval_ns, bool repeat, Watcher fn, void* ctx = nullptr);
+
+void cancel_timer (int fd);
+
+void run_once (long timeout_ns);
+
+void run ();
+
+void stop ();
+
+void reply (const Message& request, Message& response);
+
+/**
+ * Awaits the reply to a request. The coroutine is resumed by the event loop when the reply is
+ * dispatched, and owns a reference to the reply, which it releases.
+ *
+ *     MQue::Message r = co_await MQue::request(peer, msg);
+ */
+struct Request
+{
+	proc_t  to;
+	Message msg;
+	Message response;
+
+	bool await_ready () const noexcept { return false; }
+	void await_suspend (std::coroutine_handle<> waiter);
+	Message await_resume () const noexcept { return response; }
+};
+
+Request request (proc_t to, const Message& msg);
+
+/**
+ * A coroutine that starts right away and runs detached, for code that awaits requests.
+ */
+struct Task
+{
+	struct promise_type
+	{
+		Task get_return_object () noexcept { return Task(); }
+		std::suspend_never initial_suspend () noexcept { return {}; }
+		std::suspend_never final_suspend () noexcept { return {}; }
+		void return_void () noexcept {}
+		void unhandled_exception () { std::terminate(); }
+	};
+};
+
 };
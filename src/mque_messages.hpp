@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include "mque_schema.hpp"
+
+/**
+ * The schemas of the messages that liveparse processes exchange. Codes below 32 are left to
+ * tests and tools.
+ */
+
+namespace MQue
+{
+
+// text inserted into a document
+struct EditInsert
+{
+	constexpr static uint8_t code = 32;
+	uint64_t doc;
+	uint64_t position;
+	array<char> text;
+};
+
+// a range erased from a document
+struct EditErase
+{
+	constexpr static uint8_t code = 33;
+	uint64_t doc;
+	uint64_t position;
+	uint64_t length;
+};
+
+// an edit to a document, as broadcast to its subscribers: removed chars at position were replaced
+// by inserted. Edits made within one write of the document share its version.
+struct EditDelta
+{
+	constexpr static uint8_t code = 34;
+	uint64_t doc;
+	uint64_t version; // of the document once the write is complete
+	uint64_t position;
+	uint64_t removed;
+	array<char> inserted;
+};
+
+}
@@ -0,0 +1,308 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <climits>
+#include <cassert>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "mque.hpp"
+
+/**
+ * Implements the shared memory transport of MQue: every process owns an inbox of descriptor rings
+ * that its peers push into directly. A few single-producer lanes are handed out to the threads that
+ * send most, and every other sender shares a multi-producer ring. Producers only make a system call
+ * to wake the owner when it has announced that it is about to sleep.
+ */
+
+namespace MQue
+{
+
+constexpr uint32_t ring_capacity = 1024;
+static_assert((ring_capacity & (ring_capacity - 1)) == 0, "Ring capacities must be powers of two.");
+
+
+/**
+ * A ring with one producer and one consumer. Each side owns its index, so pushing and popping
+ * are a load and a store each.
+ */
+struct spsc_ring
+{
+	alignas(64) std::atomic<uint64_t> head; // written by the producer
+	alignas(64) std::atomic<uint64_t> tail; // written by the consumer
+	alignas(64) std::atomic<int32_t> producer; // thread id that owns the lane, or 0
+	Descriptor slots[ring_capacity];
+
+	spsc_ring () : head(0), tail(0), producer(0) {}
+
+	bool push (const Descriptor& d) {
+		uint64_t h = head.load(std::memory_order_relaxed);
+		if (h - tail.load(std::memory_order_acquire) == ring_capacity) {
+			return false;
+		}
+		slots[h % ring_capacity] = d;
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool pop (Descriptor& d) {
+		uint64_t t = tail.load(std::memory_order_relaxed);
+		if (head.load(std::memory_order_acquire) == t) {
+			return false;
+		}
+		d = slots[t % ring_capacity];
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool empty () const {
+		return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+	}
+
+	uint64_t depth () const {
+		return head.load(std::memory_order_relaxed) - tail.load(std::memory_order_relaxed);
+	}
+};
+
+
+/**
+ * A bounded ring with many producers and one consumer, after Vyukov. Each cell carries a sequence
+ * number that tells producers whether it is free and the consumer whether it has been published.
+ */
+struct mpsc_ring
+{
+	struct cell
+	{
+		std::atomic<uint64_t> seq;
+		Descriptor d;
+	};
+
+	alignas(64) std::atomic<uint64_t> head; // claimed by producers
+	alignas(64) std::atomic<uint64_t> tail; // written by the consumer
+	alignas(64) cell cells[ring_capacity];
+
+	mpsc_ring () : head(0), tail(0) {
+		for (uint64_t i = 0; i < ring_capacity; i++) {
+			cells[i].seq.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	bool push (const Descriptor& d) {
+		uint64_t pos = head.load(std::memory_order_relaxed);
+		cell* c;
+		for (;;) {
+			c = &cells[pos % ring_capacity];
+			int64_t dif = (int64_t)c->seq.load(std::memory_order_acquire) - (int64_t)pos;
+			if (dif == 0) {
+				if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			} else if (dif < 0) {
+				return false; // full
+			} else {
+				pos = head.load(std::memory_order_relaxed);
+			}
+		}
+		c->d = d;
+		c->seq.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool pop (Descriptor& d) {
+		uint64_t pos = tail.load(std::memory_order_relaxed);
+		cell* c = &cells[pos % ring_capacity];
+		if (c->seq.load(std::memory_order_acquire) != pos + 1) {
+			return false;
+		}
+		d = c->d;
+		c->seq.store(pos + ring_capacity, std::memory_order_release);
+		tail.store(pos + 1, std::memory_order_relaxed);
+		return true;
+	}
+
+	bool empty () const {
+		uint64_t pos = tail.load(std::memory_order_relaxed);
+		return cells[pos % ring_capacity].seq.load(std::memory_order_acquire) != pos + 1;
+	}
+
+	// producers may have claimed cells that they have yet to publish, which this counts
+	uint64_t depth () const {
+		uint64_t h = head.load(std::memory_order_relaxed);
+		uint64_t t = tail.load(std::memory_order_relaxed);
+		return h > t ? h - t : 0;
+	}
+};
+
+
+/**
+ * The rings a process receives on. Inboxes are never returned to their pool: when a process
+ * finalizes or dies, its inbox is claimed again by the next process that needs one.
+ *
+ * Interactive messages have a ring of their own that the owner always drains first. Bulk messages
+ * are flow controlled: a sender takes a credit from the inbox for each one it pushes, and the owner
+ * returns it when it pops the message. A sender that finds no credits left has to wait, rather than
+ * let a flood of bulk traffic pile up in front of the owner.
+ */
+struct inbox
+{
+	constexpr static int lanes = 4;
+
+	// bulk messages that may be in flight to one inbox; no more than a ring holds, so pushing a
+	// bulk message that has a credit never fails
+	constexpr static int32_t window = ring_capacity;
+
+	// what the owner is blocked in, so that producers know how to wake it
+	constexpr static uint32_t awake = 0;
+	constexpr static uint32_t sleeping = 1; // on the futex word
+	constexpr static uint32_t polling = 2;  // in its event loop, which watches its socket
+
+	std::atomic<uint32_t> ready; // set once constructed, since the pool hands out zeroed memory in batches
+	std::atomic<int32_t> owner; // pid of the receiving process, or 0
+	std::atomic<uint32_t> idle; // futex word, set while the owner blocks
+	std::atomic<int32_t> credits; // bulk messages that senders may still push
+	std::atomic<uint64_t> stalls; // times a sender found no credits left
+	std::atomic<uint64_t> dropped; // bulk messages that senders gave up on
+	std::atomic<uint64_t> socket_reads; // reads of its socket that the owner has begun
+	std::atomic<uint64_t> socket_drained; // the latest of them that read the socket empty
+	mpsc_ring urgent;
+	spsc_ring lane[lanes];
+	mpsc_ring shared;
+
+	inbox () : ready(0), owner(0), idle(0), credits(window), stalls(0), dropped(0), socket_reads(0), socket_drained(0) {}
+
+	/**
+	 * Pushes an interactive descriptor. Returns false if its ring is full. The caller wakes the owner
+	 * once it has pushed everything it has for it.
+	 */
+	bool push_interactive (const Descriptor& d) {
+		return urgent.push(d);
+	}
+
+	/**
+	 * Pushes a bulk descriptor from the calling thread, if a credit is left for it: into the thread's
+	 * own lane if it has or can claim one, otherwise into the shared ring.
+	 */
+	bool push (const Descriptor& d) {
+		if (credits.fetch_sub(1, std::memory_order_acquire) <= 0) {
+			credits.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		int32_t me = syscall(SYS_gettid);
+		spsc_ring* mine = nullptr;
+		for (auto& l : lane) {
+			if (l.producer.load(std::memory_order_relaxed) == me) {
+				mine = &l;
+				break;
+			}
+		}
+		if (!mine) {
+			for (auto& l : lane) {
+				int32_t p = l.producer.load(std::memory_order_relaxed);
+				if ((p == 0 || (l.empty() && kill(p, 0) == -1 && errno == ESRCH)) &&
+				    l.producer.compare_exchange_strong(p, me, std::memory_order_acquire)) {
+					mine = &l;
+					break;
+				}
+			}
+		}
+		bool pushed = mine ? mine->push(d) : shared.push(d);
+		assert(pushed);
+		return pushed;
+	}
+
+	/**
+	 * Pops the next descriptor: interactive ones first, then the lanes and the shared ring. Popping
+	 * a bulk descriptor returns its credit.
+	 */
+	bool pop (Descriptor& d) {
+		if (urgent.pop(d)) {
+			return true;
+		}
+		for (auto& l : lane) {
+			if (l.pop(d)) {
+				credits.fetch_add(1, std::memory_order_release);
+				return true;
+			}
+		}
+		if (shared.pop(d)) {
+			credits.fetch_add(1, std::memory_order_release);
+			return true;
+		}
+		return false;
+	}
+
+	bool empty () const {
+		for (auto& l : lane) {
+			if (!l.empty()) {
+				return false;
+			}
+		}
+		return urgent.empty() && shared.empty();
+	}
+
+	// how many descriptors the owner has popped, so that a sender can tell whether it is receiving
+	uint64_t consumed () const {
+		uint64_t n = urgent.tail.load(std::memory_order_relaxed) + shared.tail.load(std::memory_order_relaxed);
+		for (auto& l : lane) {
+			n += l.tail.load(std::memory_order_relaxed);
+		}
+		return n;
+	}
+
+	uint64_t bulk_depth () const {
+		uint64_t n = shared.depth();
+		for (auto& l : lane) {
+			n += l.depth();
+		}
+		return n;
+	}
+
+	/**
+	 * Wakes the owner if it sleeps on the futex. Costs one load when it is awake. Returns what the
+	 * owner was blocked in; if it was polling, the caller rings its doorbell.
+	 */
+	uint32_t wake () {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (idle.load(std::memory_order_relaxed) == awake) {
+			return awake;
+		}
+		uint32_t was = idle.exchange(awake, std::memory_order_relaxed);
+		if (was == sleeping) {
+			syscall(SYS_futex, reinterpret_cast<uint32_t*>(&idle), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+		}
+		return was;
+	}
+
+	/**
+	 * Announces that the owner is about to block in the given way. Returns false, and stays awake,
+	 * if something has arrived in the meantime.
+	 */
+	bool block (uint32_t how) {
+		idle.store(how, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (!empty()) {
+			idle.store(awake, std::memory_order_relaxed);
+			return false;
+		}
+		return true;
+	}
+
+	/**
+	 * Sleeps until a producer wakes the owner, or until the timeout passes.
+	 */
+	void sleep (long timeout_ns) {
+		if (!block(sleeping)) {
+			return;
+		}
+		struct timespec ts = { timeout_ns / 1000000000, timeout_ns % 1000000000 };
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(&idle), FUTEX_WAIT, sleeping, &ts, nullptr, 0);
+		idle.store(awake, std::memory_order_relaxed);
+	}
+};
+
+
+}
@@ -0,0 +1,231 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <span>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include "mque.hpp"
+#include "util/log.hpp"
+
+/**
+ * Typed MQue messages. A schema is a plain struct with a fixed layout and a static code:
+ *
+ *     struct EditInsert
+ *     {
+ *         constexpr static uint8_t code = 32;
+ *         uint64_t doc;
+ *         uint64_t position;
+ *         MQue::array<char> text;
+ *     };
+ *
+ * The struct is written straight into the payload by the sender and read in place by handlers, so
+ * encoding is a store per field and decoding costs nothing. Variable length data follows the struct
+ * in the payload and is found through array fields, which hold an offset from the start of the
+ * payload rather than a pointer, since each process may map the payload at its own address.
+ */
+
+namespace MQue
+{
+
+/**
+ * A run of Ts stored after a schema's fixed fields.
+ */
+template<typename T>
+struct array
+{
+	static_assert(std::is_trivially_copyable_v<T>, "Array elements are read in place, so they must be trivially copyable.");
+
+	uint32_t offset; // from the start of the payload
+	uint32_t count;
+};
+
+template<typename S>
+concept Schema = std::is_trivially_copyable_v<S> && std::is_standard_layout_v<S> && alignof(S) <= 16 &&
+                 requires { { S::code } -> std::convertible_to<uint8_t>; };
+
+namespace detail
+{
+
+// converts to any field, to step over the fields of a schema when it is brace initialized
+struct any_field
+{
+	template<typename T>
+	operator T () const;
+};
+
+// converts to arrays only, so it initializes the next field of a schema only if that is an array,
+// or begins with one
+struct array_field
+{
+	template<typename T>
+	operator array<T> () const;
+};
+
+template<typename S, typename Next, size_t... I>
+constexpr bool initializes (std::index_sequence<I...>)
+{
+	return requires { S { ((void)I, any_field())..., Next() }; };
+}
+
+// whether a field from the Nth on is an array
+template<typename S, size_t N = 0>
+constexpr bool has_array ()
+{
+	if constexpr (initializes<S, array_field>(std::make_index_sequence<N>())) {
+		return true;
+	} else if constexpr (initializes<S, any_field>(std::make_index_sequence<N>())) {
+		return has_array<S, N + 1>();
+	} else {
+		return false;
+	}
+}
+
+}
+
+/**
+ * A schema without arrays, whose messages are its struct and nothing more.
+ */
+template<typename S>
+concept FixedSchema = Schema<S> && !detail::has_array<S>();
+
+
+/**
+ * Read access to a received message of schema S. Arrays are checked against the size of the
+ * payload before they are handed out, as the sender is another process.
+ */
+template<Schema S>
+class View
+{
+public:
+	explicit View (const Message& msg) : msg(msg) {}
+
+	const S* operator-> () const { return reinterpret_cast<const S*>(msg.data); }
+	const S& operator* () const { return *reinterpret_cast<const S*>(msg.data); }
+
+	template<typename T>
+	std::span<const T> operator[] (const array<T>& a) const {
+		if (a.offset % alignof(T) || a.offset > msg.size || a.count > (msg.size - a.offset) / sizeof(T)) {
+			log::warning("Received a message with an array out of bounds.");
+			return {};
+		}
+		return { reinterpret_cast<const T*>(msg.data + a.offset), a.count };
+	}
+
+	const Message& message () const { return msg; }
+
+private:
+	const Message& msg;
+};
+
+
+/**
+ * An outbound message of schema S, being written in place. Arrays are appended after the fixed
+ * fields, into room that was reserved when the message was created.
+ */
+template<Schema S>
+class Builder
+{
+public:
+	explicit Builder (uint64_t extra = 0)
+		: msg(create(S::code, payload_size(extra))), used(sizeof(S))
+	{
+		new (msg.data) S();
+	}
+
+	Builder (const Builder&) = delete;
+	Builder& operator= (const Builder&) = delete;
+
+	~Builder () { release(msg); }
+
+	S* operator-> () { return reinterpret_cast<S*>(msg.data); }
+	S& operator* () { return *reinterpret_cast<S*>(msg.data); }
+
+	template<typename T>
+	std::span<T> allocate (array<T>& a, uint64_t count) {
+		uint64_t offset = ((uint64_t)used + alignof(T) - 1) & ~(uint64_t)(alignof(T) - 1);
+		// the payload's neighbours in the heap belong to other messages, and other processes
+		if (offset > msg.size || count > (msg.size - offset) / sizeof(T)) {
+			throw std::length_error("An array does not fit in the room reserved for the message.");
+		}
+		used = offset + count * sizeof(T);
+		a.offset = offset;
+		a.count = count;
+		return { reinterpret_cast<T*>(msg.data + offset), count };
+	}
+
+	template<typename T>
+	void append (array<T>& a, const T* src, uint64_t count) {
+		std::span<T> dst = allocate(a, count);
+		memcpy(dst.data(), src, count * sizeof(T));
+	}
+
+	const Message& message () const { return msg; }
+
+	// room to reserve for an array of count Ts, including its alignment; counts too large for any
+	// payload are clamped to one that the constructor refuses, so that rooms can still be added up
+	template<typename T>
+	constexpr static uint64_t room (uint64_t count) {
+		return std::min<uint64_t>(count, UINT32_MAX) * sizeof(T) + alignof(T) - 1;
+	}
+
+private:
+	Message msg;
+	uint32_t used;
+
+	static uint32_t payload_size (uint64_t extra) {
+		if (extra > UINT32_MAX - sizeof(S)) {
+			throw std::length_error("A message does not fit in a payload.");
+		}
+		return sizeof(S) + extra;
+	}
+};
+
+
+template<Schema S>
+void send (proc_t to, const Builder<S>& b)
+{
+	send(to, b.message());
+}
+
+template<Schema S>
+void queue (proc_t to, const Builder<S>& b)
+{
+	queue(to, b.message());
+}
+
+/**
+ * Sends a message that has no arrays, written from a value.
+ */
+template<FixedSchema S>
+void send (proc_t to, const S& value)
+{
+	Builder<S> b;
+	*b = value;
+	send(to, b);
+}
+
+template<Schema S, void (*F)(View<S> msg, void* ctx)>
+void typed_handler (const Message& msg, void* ctx)
+{
+	if (msg.size < sizeof(S) || !msg.data) {
+		log::warning("Received a message shorter than its schema.");
+		return;
+	}
+	F(View<S>(msg), ctx);
+}
+
+/**
+ * Registers F for the code of schema S. The size check and the call to F are compiled into one
+ * function, so dispatch stays a single indirect call.
+ */
+template<Schema S, void (*F)(View<S> msg, void* ctx)>
+void handle (void* ctx = nullptr)
+{
+	handle(S::code, typed_handler<S,F>, ctx);
+}
+
+}
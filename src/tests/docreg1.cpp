@@ -0,0 +1,147 @@
+/**
+ * @cxxparams "-g -I.. -std=c++20"
+ * @ldparams "-lpthread -lrt"
+ **/
+
+#include <stdint.h>
+#include <iostream>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <testmatrix.h>
+#include "docreg.cpp"
+
+using namespace std;
+
+template<>
+FILE* mem::shmlog::logfile = nullptr;
+
+template<>
+FILE* log::logfile = nullptr;
+
+#define PROCS 4
+#define OWN 1000
+#define CONTESTED 100
+
+static string own_path (int p, int i)
+{
+	return "/src/p" + to_string(p) + "/file" + to_string(i) + ".cpp";
+}
+
+static string contested_path (int i)
+{
+	return "/src/shared/file" + to_string(i) + ".hpp";
+}
+
+static void* root_of (int p, int i)
+{
+	return reinterpret_cast<void*>(((uint64_t)(i + 1) << 8) | p);
+}
+
+
+int main (int argc, char *argv[])
+{
+	report_executable_parameters();
+
+	log::initialize();
+	mem::shmlog::initialize();
+
+	DocReg::initialize();
+
+	// every process registers documents of its own, and races the others for a set of shared ones
+	int wins[2];
+	pipe(wins);
+	for (int p = 0; p < PROCS; p++) {
+		if (fork() == 0) {
+			DocReg::initialize();
+			int won = 0;
+			for (int i = 0; i < OWN; i++) {
+				if (!DocReg::insert(own_path(p, i).c_str(), root_of(p, i))) {
+					_exit(1);
+				}
+				won += DocReg::insert(contested_path(i % CONTESTED).c_str(), root_of(p, i % CONTESTED));
+			}
+			write(wins[1], &won, sizeof(won));
+			DocReg::finalize();
+			_exit(0);
+		}
+	}
+	int won = 0;
+	for (int p = 0; p < PROCS; p++) {
+		int status, w;
+		wait(&status);
+		test_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+		read(wins[0], &w, sizeof(w));
+		won += w;
+	}
+	test_assert(won == CONTESTED);
+	test_assert(DocReg::free_slots() == DocReg::capacity - PROCS * OWN - CONTESTED);
+
+	for (int p = 0; p < PROCS; p++) {
+		for (int i = 0; i < OWN; i++) {
+			string path = own_path(p, i);
+			test_assert(DocReg::lookup(path.c_str()) == root_of(p, i));
+			test_assert(DocReg::lookup(DocReg::id_of(path.c_str())) == root_of(p, i));
+		}
+	}
+	for (int i = 0; i < CONTESTED; i++) {
+		void* root = DocReg::lookup(contested_path(i).c_str());
+		test_assert(((uint64_t)root >> 8) == (uint64_t)i + 1);
+	}
+	test_assert(DocReg::lookup("/src/missing.cpp") == nullptr);
+
+	// removal only succeeds for the root that is registered, and the slot is reused afterwards
+	string path = own_path(0, 0);
+	test_assert(!DocReg::remove(path.c_str(), root_of(1, 0)));
+	test_assert(DocReg::remove(path.c_str(), root_of(0, 0)));
+	test_assert(DocReg::lookup(path.c_str()) == nullptr);
+	test_assert(DocReg::insert(path.c_str(), root_of(2, 0)));
+	test_assert(DocReg::lookup(path.c_str()) == root_of(2, 0));
+	test_assert(!DocReg::insert(path.c_str(), root_of(3, 0)));
+	test_assert(DocReg::free_slots() == DocReg::capacity - PROCS * OWN - CONTESTED);
+
+	// a process that died while naming a slot leaves nothing for the others to wait for
+	pid_t gone = fork();
+	if (gone == 0) {
+		_exit(0);
+	}
+	waitpid(gone, nullptr, 0);
+	string orphaned = "/src/orphaned.cpp";
+	uint64_t id = DocReg::id_of(orphaned.c_str());
+	uint32_t i = 0;
+	while (DocReg::table[(id + i) & (DocReg::capacity - 1)].state.load() != DocReg::slot::empty) {
+		i++;
+	}
+	DocReg::slot& abandoned = DocReg::table[(id + i) & (DocReg::capacity - 1)];
+	abandoned.state.store(DocReg::slot::make(DocReg::slot::pending, 0, 0, gone));
+	test_assert(DocReg::insert(orphaned.c_str(), root_of(0, 1)));
+	test_assert(DocReg::lookup(orphaned.c_str()) == root_of(0, 1));
+	test_assert(DocReg::slot::kind_of(abandoned.state.load()) == DocReg::slot::named);
+
+	// removing a document gives its slot back, which another path takes over once the table is full
+	test_assert(DocReg::remove(orphaned.c_str(), root_of(0, 1)));
+	uint32_t free = DocReg::free_slots();
+	test_assert(free == DocReg::capacity - PROCS * OWN - CONTESTED);
+	for (uint32_t f = 0; f < free; f++) {
+		test_assert(DocReg::insert(("/src/filler/file" + to_string(f) + ".cpp").c_str(), root_of(1, f)));
+	}
+	test_assert(DocReg::free_slots() == 0);
+	test_assert(!DocReg::insert("/src/overflow.cpp", root_of(1, 0)));
+
+	string filler = "/src/filler/file0.cpp";
+	DocReg::Doc before = DocReg::open(filler.c_str());
+	test_assert(before.root() == root_of(1, 0));
+	test_assert(DocReg::remove(filler.c_str(), root_of(1, 0)));
+	test_assert(DocReg::insert("/src/overflow.cpp", root_of(2, 1)));
+	test_assert(DocReg::lookup("/src/overflow.cpp") == root_of(2, 1));
+	test_assert(DocReg::lookup(filler.c_str()) == nullptr);
+	test_assert(DocReg::free_slots() == 0);
+	test_assert(!DocReg::insert(filler.c_str(), root_of(1, 0)));
+	// a handle to the removed document does not see the document that took its slot over
+	test_assert(before.root() == nullptr);
+
+	DocReg::finalize();
+
+	report_success();
+	return 0;
+}
@@ -0,0 +1,243 @@
+/**
+ * @cxxparams "-g -I.. -std=c++20"
+ * @ldparams "-lpthread -lrt"
+ **/
+
+#include <stdint.h>
+#include <iostream>
+#include <deque>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <testmatrix.h>
+#include "docreg.cpp"
+
+using namespace std;
+
+template<>
+FILE* mem::shmlog::logfile = nullptr;
+
+template<>
+FILE* log::logfile = nullptr;
+
+#define READERS 3
+#define READS 2000
+#define LEAVES 8
+#define LEAF 4096
+#define SPARE 64
+
+typedef mem::pool_addr_traits<0x1021,16,4,8,20> document_addr_traits;
+
+struct leaf
+{
+	leaf* next;
+	char data[LEAF];
+};
+
+/**
+ * Copies the whole document out, a leaf at a time. The leaves are never freed, which is what makes
+ * following their links safe while they are being rewritten.
+ */
+static void copy (const DocReg::Doc& doc, char* out)
+{
+	doc.read([&] () {
+		const leaf* l = reinterpret_cast<const leaf*>(doc.root());
+		for (int i = 0; i < LEAVES && l; i++, l = l->next) {
+			memcpy(out + i * LEAF, l->data, LEAF);
+		}
+	});
+}
+
+
+// what a leaf's link reads once it has been released, which a reader must never find
+leaf* const released = reinterpret_cast<leaf*>(1);
+
+// used oldest first, so that released leaves stay scribbled over for a while
+std::deque<leaf*> spare;
+
+// scribbles over the leaf and hands it to the next edit, as a heap would
+static void release (void* p)
+{
+	leaf* l = reinterpret_cast<leaf*>(p);
+	l->next = released;
+	memset(l->data, 0, LEAF);
+	spare.push_back(l);
+}
+
+
+/**
+ * Copies the document as copy does, but stops where it finds a leaf that has been released.
+ */
+static bool copy_reachable (const DocReg::Doc& doc, char* out)
+{
+	bool reached = false;
+	doc.read([&] () {
+		const leaf* l = reinterpret_cast<const leaf*>(doc.root());
+		for (int i = 0; i < LEAVES && l; i++, l = l->next) {
+			if (l == released) {
+				reached = true;
+				break;
+			}
+			memcpy(out + i * LEAF, l->data, LEAF);
+			// gives the writer time to replace the leaves ahead
+			sched_yield();
+		}
+	});
+	return reached;
+}
+
+
+int main (int argc, char *argv[])
+{
+	report_executable_parameters();
+
+	log::initialize();
+	mem::shmlog::initialize();
+
+	DocReg::initialize();
+
+	auto pool = mem::shmfixedpool<leaf,document_addr_traits>::attach(0);
+	leaf* leaves = pool.allocate(LEAVES);
+	for (int i = 0; i < LEAVES; i++) {
+		leaves[i].next = i + 1 < LEAVES ? &leaves[i + 1] : nullptr;
+		memset(leaves[i].data, 'a', LEAF);
+	}
+	test_assert(DocReg::insert("/src/edited.cpp", leaves));
+	test_assert(!DocReg::open("/src/missing.cpp"));
+
+	// readers copy the document while it is rewritten under them, and must never see an edit in part
+	pid_t readers[READERS];
+	for (int r = 0; r < READERS; r++) {
+		readers[r] = fork();
+		if (readers[r] == 0) {
+			DocReg::initialize();
+			DocReg::Doc doc = DocReg::open("/src/edited.cpp");
+			if (!doc) {
+				_exit(1);
+			}
+			static char out[LEAVES * LEAF];
+			int torn = 0;
+			for (int i = 0; i < READS; i++) {
+				copy(doc, out);
+				for (int j = 1; j < LEAVES * LEAF; j++) {
+					if (out[j] != out[0]) {
+						torn++;
+						break;
+					}
+				}
+			}
+			DocReg::finalize();
+			_exit(torn ? 2 : 0);
+		}
+	}
+
+	// the writer never waits for them
+	DocReg::Doc doc = DocReg::open("/src/edited.cpp");
+	test_assert(doc && doc.root() == leaves);
+	uint64_t edits = 0;
+	int running = READERS;
+	while (running) {
+		doc.begin_write();
+		char c = 'a' + edits % 26;
+		for (leaf* l = leaves; l; l = l->next) {
+			memset(l->data, c, LEAF);
+		}
+		doc.end_write();
+		edits++;
+
+		int status;
+		pid_t done;
+		while (running && (done = waitpid(-1, &status, WNOHANG)) > 0) {
+			test_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+			running--;
+		}
+	}
+	test_assert(doc.current_version() == edits * 2);
+
+	test_assert(DocReg::remove("/src/edited.cpp", leaves));
+
+	// edits that replace leaves retire the old ones, which readers that started before them may
+	// still be following
+	for (int i = 0; i < LEAVES; i++) {
+		leaves[i].next = i + 1 < LEAVES ? &leaves[i + 1] : nullptr;
+	}
+	test_assert(DocReg::insert("/src/replaced.cpp", leaves));
+	// allocated before the readers start, which only map the segments that exist when they attach
+	for (int i = 0; i < SPARE; i++) {
+		spare.push_back(pool.allocate(1));
+	}
+	for (int r = 0; r < READERS; r++) {
+		if (fork() == 0) {
+			DocReg::initialize();
+			DocReg::Doc doc = DocReg::open("/src/replaced.cpp");
+			static char out[LEAVES * LEAF];
+			int reached = 0;
+			for (int i = 0; i < READS; i++) {
+				reached += copy_reachable(doc, out);
+			}
+			DocReg::finalize();
+			_exit(reached ? 2 : 0);
+		}
+	}
+	doc = DocReg::open("/src/replaced.cpp");
+	running = READERS;
+	for (edits = 0; running; edits++) {
+		// leaves that readers may still reach are not spare yet
+		if (spare.empty()) {
+			DocReg::reclaim();
+			if (spare.empty()) {
+				continue;
+			}
+		}
+		doc.begin_write();
+		leaf* prev = leaves;
+		for (uint64_t i = 0; i < edits % (LEAVES - 1); i++) {
+			prev = prev->next;
+		}
+		leaf* old = prev->next;
+		leaf* fresh = spare.front();
+		spare.pop_front();
+		*fresh = *old;
+		prev->next = fresh;
+		DocReg::retire(doc, old, release);
+		doc.end_write();
+		// paced, so that reads as slow as these get through
+		usleep(100);
+
+		int status;
+		pid_t done;
+		while (running && (done = waitpid(-1, &status, WNOHANG)) > 0) {
+			test_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+			running--;
+		}
+	}
+	// with the readers gone, nothing is left waiting
+	test_assert(DocReg::reclaim() == 0);
+	test_assert(spare.size() == SPARE);
+	test_assert(DocReg::remove("/src/replaced.cpp", leaves));
+
+	// a reader gives up on a document whose owner died in the middle of an edit
+	pid_t owner = fork();
+	if (owner == 0) {
+		DocReg::initialize();
+		DocReg::insert("/src/abandoned.cpp", leaves);
+		DocReg::open("/src/abandoned.cpp").begin_write();
+		_exit(0);
+	}
+	waitpid(owner, nullptr, 0);
+	DocReg::Doc abandoned = DocReg::open("/src/abandoned.cpp");
+	test_assert(abandoned);
+	bool gave_up = false;
+	try {
+		abandoned.read([] () {});
+	} catch (std::runtime_error&) {
+		gave_up = true;
+	}
+	test_assert(gave_up);
+
+	pool.deallocate(leaves, LEAVES);
+	mem::shmfixedpool<leaf,document_addr_traits>::detach(pool);
+	DocReg::finalize();
+
+	report_success();
+	return 0;
+}
@@ -0,0 +1,174 @@
+/**
+ * @cxxparams "-g -I.. -std=c++20"
+ * @ldparams "-lpthread -lrt"
+ **/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <testmatrix.h>
+#include "mque.cpp"
+#include "docreg.cpp"
+#include "docfeed.hpp"
+
+using namespace std;
+
+template<>
+FILE* mem::shmlog::logfile = nullptr;
+
+template<>
+FILE* log::logfile = nullptr;
+
+#define DONE 1
+#define WRITES 2000
+
+const char* path = "/src/followed.cpp";
+
+/**
+ * The subscriber keeps a mirror of the document from its deltas alone.
+ */
+string mirror;
+uint64_t last_version = 0;
+int out_of_order = 0;
+
+static void on_delta (MQue::View<MQue::EditDelta> delta, void* ctx)
+{
+	out_of_order += delta->version < last_version || delta->version & 1;
+	last_version = delta->version;
+	span<const char> text = delta[delta->inserted];
+	mirror.replace(delta->position, delta->removed, text.data(), text.size());
+}
+
+
+static void on_done (const MQue::Message& msg, void* ctx)
+{
+	MQue::stop();
+}
+
+
+int main (int argc, char *argv[])
+{
+	report_executable_parameters();
+
+	log::initialize();
+	mem::shmlog::initialize();
+
+	DocReg::initialize();
+	util::skiparraylist<char> text;
+	test_assert(DocReg::insert(path, &text));
+	test_assert(!DocReg::subscribe("/src/missing.cpp", getpid()));
+
+	int ready[2];
+	pipe(ready);
+	char c;
+
+	pid_t child = fork();
+	if (child == 0) {
+		DocReg::initialize();
+		MQue::initialize();
+		MQue::handle<MQue::EditDelta, on_delta>();
+		MQue::handle(DONE, on_done);
+		if (!DocReg::subscribe(path, getpid())) {
+			_exit(1);
+		}
+		write(ready[1], "r", 1);
+		MQue::run();
+		uint64_t size = mirror.size();
+		write(ready[1], &out_of_order, sizeof(out_of_order));
+		write(ready[1], &last_version, sizeof(last_version));
+		write(ready[1], &size, sizeof(size));
+		write(ready[1], mirror.data(), size);
+		MQue::finalize();
+		DocReg::finalize();
+		_exit(0);
+	}
+
+	MQue::initialize();
+	read(ready[0], &c, 1);
+
+	// edits of every size go out after the writes that made them, some of them several to a write
+	DocReg::Doc doc = DocReg::open(path);
+	size_t missed = 0;
+	{
+		DocReg::Publisher feed(doc, text);
+		srand(7);
+		string chunk;
+		for (int w = 0; w < WRITES; w++) {
+			// deltas that find the subscriber's window full are missed, so this one is kept up with
+			while (MQue::stats(child).credits < 2) {
+				sched_yield();
+			}
+			doc.begin_write();
+			for (int e = 1 + (w % 3 == 0); e > 0; e--) {
+				int size = text.size();
+				if (size > 0 && rand() % 3 == 0) {
+					int from = rand() % size;
+					int to = from + rand() % std::min(size - from, 6000) + 1;
+					text.remove(from, to);
+				} else {
+					chunk.assign(rand() % 100 == 0 ? 9000 : rand() % 64 + 1, 'a' + w % 26);
+					text.insert(size ? rand() % (size + 1) : 0, chunk.data(), chunk.size());
+				}
+			}
+			doc.end_write();
+			missed += feed.publish();
+		}
+	}
+	test_assert(missed == 0);
+
+	MQue::send(child, MQue::Message { (MQue::proc_t)getpid(), DONE, 0, nullptr });
+
+	int failures;
+	uint64_t version, size;
+	read(ready[0], &failures, sizeof(failures));
+	read(ready[0], &version, sizeof(version));
+	read(ready[0], &size, sizeof(size));
+	string copy(size, '\0');
+	for (uint64_t got = 0; got < size; ) {
+		got += read(ready[0], copy.data() + got, size - got);
+	}
+
+	ostringstream expected;
+	expected << text;
+	test_assert(failures == 0);
+	test_assert(version == doc.current_version());
+	test_assert(copy == expected.str());
+
+	// the subscriber exits without unsubscribing, and is dropped while live ones stay
+	test_assert(DocReg::subscribe(path, getpid()));
+	int status;
+	waitpid(child, &status, 0);
+	test_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	test_assert(DocReg::unsubscribe_dead(doc) == 1);
+	test_assert(!DocReg::unsubscribe(path, child));
+
+	// a subscriber that stops receiving misses deltas rather than hold the writer up
+	MQue::handle<MQue::EditDelta, on_delta>();
+	{
+		DocReg::Publisher feed(doc, text);
+		for (int w = 0; w < MQue::inbox::window + 10; w++) {
+			doc.begin_write();
+			text.insert(0, "x", 1);
+			doc.end_write();
+			missed += feed.publish();
+		}
+	}
+	test_assert(missed == 10);
+	MQue::Stats st = MQue::stats(getpid());
+	test_assert(st.stalls == 0);
+	test_assert(st.dropped == 10);
+	while (MQue::poll() > 0) {
+	}
+
+	test_assert(DocReg::unsubscribe(path, getpid()));
+
+	MQue::finalize();
+	DocReg::finalize();
+
+	report_success();
+	return 0;
+}
@@ -0,0 +1,170 @@
+/**
+ * @cxxparams "-g -I.. -std=c++20"
+ * @ldparams "-lpthread -lrt"
+ **/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <testmatrix.h>
+#include "docreg.cpp"
+#include "docspill.hpp"
+
+using namespace std;
+
+template<>
+FILE* mem::shmlog::logfile = nullptr;
+
+template<>
+FILE* log::logfile = nullptr;
+
+#define DOCS 20
+#define HOT 3
+#define DOC_SIZE (100 << 10)
+#define BUDGET (1 << 20)
+
+typedef util::skiparraylist<char> text;
+
+static string path_of (int i)
+{
+	return "/src/budget/file" + to_string(i) + ".cpp";
+}
+
+static string contents_of (void* root)
+{
+	ostringstream os;
+	os << *static_cast<text*>(root);
+	return os.str();
+}
+
+
+int main (int argc, char *argv[])
+{
+	report_executable_parameters();
+
+	log::initialize();
+	mem::shmlog::initialize();
+
+	DocReg::initialize();
+
+	char dir[] = "/tmp/liveparse-spill-XXXXXX";
+	test_assert(mkdtemp(dir));
+	DocReg::spill_with(dir, DocReg::list_spiller<char>);
+	DocReg::set_budget(BUDGET);
+
+	// opening more than the budget holds spills the documents that were opened first
+	DocReg::Doc docs[DOCS];
+	void* roots[DOCS];
+	for (int i = 0; i < DOCS; i++) {
+		text* t = new text();
+		string body(4096, 'a' + i);
+		for (int n = 0; n < DOC_SIZE; n += body.size()) {
+			t->append(body.data(), body.size());
+		}
+		roots[i] = t;
+		test_assert(DocReg::insert(path_of(i).c_str(), t));
+		docs[i] = DocReg::open(path_of(i).c_str());
+		DocReg::charge(docs[i], DOC_SIZE);
+		// a sweep may only clear reference bits, and leave the budget to the next one
+		test_assert(DocReg::resident_bytes() <= BUDGET + DOC_SIZE);
+	}
+	test_assert(docs[0].root() == nullptr);
+	test_assert(DocReg::lookup(path_of(0).c_str()) == nullptr);
+	test_assert(docs[DOCS - 1].root() == roots[DOCS - 1]);
+
+	// documents in use keep their place while the cold ones are brought back in turn
+	for (int round = 0; round < 5; round++) {
+		for (int i = HOT; i < DOCS; i++) {
+			for (int h = 0; h < HOT; h++) {
+				roots[h] = DocReg::resident(docs[h]);
+				test_assert(contents_of(roots[h]) == string(DOC_SIZE, 'a' + h));
+			}
+			roots[i] = DocReg::resident(docs[i]);
+			test_assert(contents_of(roots[i]) == string(DOC_SIZE, 'a' + i));
+			test_assert(DocReg::resident_bytes() <= BUDGET + DOC_SIZE);
+		}
+	}
+	int spills = 0;
+	for (int h = 0; h < HOT; h++) {
+		test_assert(docs[h].root() != nullptr);
+	}
+	for (int i = HOT; i < DOCS; i++) {
+		spills += docs[i].root() == nullptr;
+	}
+	test_assert(spills >= DOCS - BUDGET / DOC_SIZE);
+
+	// a document larger than the whole budget is still kept while it is being used
+	DocReg::set_budget(DOC_SIZE / 2);
+	for (int i = HOT; i < DOCS; i++) {
+		if (!docs[i].root()) {
+			roots[i] = DocReg::resident(docs[i]);
+			test_assert(docs[i].root() == roots[i]);
+			test_assert(contents_of(roots[i]) == string(DOC_SIZE, 'a' + i));
+			DocReg::charge(docs[i], DOC_SIZE + 1);
+			test_assert(docs[i].root() == roots[i]);
+			break;
+		}
+	}
+
+	// a pinned document stays in memory however long it goes unused, and is spilled once unpinned as
+	// often as it was pinned
+	roots[0] = DocReg::resident(docs[0]);
+	DocReg::pin(docs[0]);
+	DocReg::pin(docs[0]);
+	DocReg::evict();
+	DocReg::evict();
+	test_assert(docs[0].root() == roots[0]);
+	DocReg::unpin(docs[0]);
+	DocReg::evict();
+	DocReg::evict();
+	test_assert(docs[0].root() == roots[0]);
+
+	// with nothing else of its own to spill, a sweep is not taken again until something changes
+	for (int i = 1; i < DOCS; i++) {
+		if (docs[i].root()) {
+			DocReg::pin(docs[i]);
+		}
+	}
+	DocReg::evict();
+	uint32_t hand = DocReg::books->hand.load();
+	DocReg::evict();
+	test_assert(DocReg::books->hand.load() == hand);
+	for (int i = 1; i < DOCS; i++) {
+		if (docs[i].root()) {
+			DocReg::unpin(docs[i]);
+		}
+	}
+
+	DocReg::unpin(docs[0]);
+	DocReg::evict();
+	DocReg::evict();
+	test_assert(docs[0].root() == nullptr);
+
+	// a second registration of a document neither fails its owner nor changes what it is charged
+	uint64_t charged = DocReg::resident_bytes();
+	test_assert(!DocReg::insert(path_of(0).c_str(), roots[HOT]));
+	test_assert(DocReg::resident_bytes() == charged);
+
+	// a spilled document is removed with the root it last had, and leaves nothing behind
+	for (int i = 0; i < DOCS; i++) {
+		void* root = docs[i].root();
+		if (root) {
+			test_assert(DocReg::remove(path_of(i).c_str(), root));
+			delete static_cast<text*>(root);
+		} else {
+			test_assert(DocReg::remove(path_of(i).c_str(), DocReg::lookup(path_of(i).c_str())) == false);
+			test_assert(DocReg::remove(path_of(i).c_str(), roots[i]));
+		}
+	}
+	test_assert(DocReg::resident_bytes() == 0);
+	test_assert(rmdir(dir) == 0);
+
+	DocReg::set_budget(0);
+	DocReg::finalize();
+
+	report_success();
+	return 0;
+}
@@ -0,0 +1,130 @@
+/**
+ * @cxxparams "-g -I.. -std=c++20"
+ * @ldparams "-lpthread -lrt"
+ **/
+
+#include <stdint.h>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <testmatrix.h>
+#include "mque.cpp"
+
+using namespace std;
+
+template<>
+FILE* mem::shmlog::logfile = nullptr;
+
+template<>
+FILE* log::logfile = nullptr;
+
+#define PAYLOAD (1 << 20)
+#define BULK 4000
+#define WINDOW 32
+
+int ack;
+int received = 0;
+int corrupt = 0;
+
+static void on_bulk (const MQue::Message& msg, void* ctx)
+{
+	uint8_t n = (uint8_t)received;
+	corrupt += msg.size != PAYLOAD || msg.data[0] != n || msg.data[PAYLOAD - 1] != n;
+	if (++received % WINDOW == 0) {
+		write(ack, "a", 1);
+	}
+}
+
+int main (int argc, char *argv[])
+{
+	report_executable_parameters();
+
+	log::initialize();
+	mem::shmlog::initialize();
+
+	int ready[2], done[2];
+	pipe(ready);
+	pipe(done);
+	char c;
+
+	pid_t child = fork();
+	if (child == 0) {
+		MQue::initialize();
+		write(ready[1], "r", 1);
+		// wait for the parent to have sent, then take the message
+		read(done[0], &c, 1);
+		MQue::poll();
+		write(ready[1], "p", 1);
+		ack = ready[1];
+		MQue::handle(8, on_bulk);
+		while (received < BULK) {
+			MQue::run_once(-1);
+		}
+		read(done[0], &c, 1);
+		MQue::finalize();
+		_exit(received == BULK && corrupt == 0 ? 0 : 2);
+	}
+
+	MQue::initialize();
+	read(ready[0], &c, 1);
+
+	// a large payload is written once, in place, and only its descriptor is sent
+	MQue::Message msg = MQue::create(7, PAYLOAD);
+	for (int i = 0; i < PAYLOAD; i++) {
+		msg.data[i] = (uint8_t)i;
+	}
+	auto hdr = MQue::header_of(msg);
+	test_assert(hdr->refs.load() == 1);
+	MQue::send(child, msg);
+	test_assert(hdr->refs.load() == 2);
+
+	// the receiver's reference is released once it has dispatched the message
+	write(done[1], "s", 1);
+	read(ready[0], &c, 1);
+	test_assert(hdr->refs.load() == 1);
+
+	// sending to a process that is not listening drops the message and its reference
+	MQue::send(1, msg);
+	test_assert(hdr->refs.load() == 1);
+	MQue::queue(1, msg);
+	test_assert(hdr->refs.load() == 2);
+	MQue::flush();
+	test_assert(hdr->refs.load() == 1);
+
+	MQue::release(msg);
+
+	// payloads larger than any size class are reused once released, so a sender can go on sending
+	// them for far longer than the heap could hold them all
+	for (int i = 0; i < BULK; i++) {
+		MQue::Message bulk = MQue::create(8, PAYLOAD);
+		bulk.data[0] = bulk.data[PAYLOAD - 1] = (uint8_t)i;
+		MQue::send(child, bulk);
+		MQue::release(bulk);
+		if ((i + 1) % WINDOW == 0) {
+			read(ready[0], &c, 1);
+		}
+	}
+
+	// timers fire from the event loop
+	int ticks = 0;
+	int t = MQue::timer(1000000, true, [] (int fd, uint32_t events, void* ctx) { (*reinterpret_cast<int*>(ctx))++; }, &ticks);
+	while (ticks < 3) {
+		MQue::run_once(-1);
+	}
+	MQue::cancel_timer(t);
+
+	// finalizing closes the timers that are still set
+	int left = MQue::timer(1000000000, false, [] (int fd, uint32_t events, void* ctx) {});
+
+	write(done[1], "f", 1);
+	int status;
+	waitpid(child, &status, 0);
+	test_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	MQue::finalize();
+	test_assert(fcntl(left, F_GETFD) == -1 && errno == EBADF);
+
+	report_success();
+	return 0;
+}
@@ -0,0 +1,159 @@
+/**
+ * @cxxparams "-g -I.. -std=c++20"
+ * @ldparams "-lpthread -lrt"
+ **/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <testmatrix.h>
+#include "mque.cpp"
+
+using namespace std;
+
+template<>
+FILE* mem::shmlog::logfile = nullptr;
+
+template<>
+FILE* log::logfile = nullptr;
+
+#define MESSAGES 200000
+
+int received = 0;
+
+static void on_message (const MQue::Message& msg, void* ctx)
+{
+	received++;
+}
+
+
+static void on_done (int fd, uint32_t events, void* ctx)
+{
+	char c;
+	if (read(fd, &c, 1) == 0) {
+		MQue::stop();
+	}
+}
+
+
+/**
+ * Receives in the event loop until the parent closes its end of the pipe, then reports how many
+ * messages were dispatched.
+ */
+static void receiver (int ready, int done)
+{
+	MQue::initialize();
+	MQue::handle(7, on_message);
+	MQue::watch(done, EPOLLIN, on_done);
+	write(ready, "r", 1);
+	MQue::run();
+	MQue::poll();
+	write(ready, &received, sizeof(received));
+	MQue::finalize();
+	_exit(0);
+}
+
+
+/**
+ * Starts a receiver in a fresh image, since a forked child would inherit this process's inbox.
+ */
+static pid_t spawn (int ready[2], int done[2])
+{
+	pipe(ready);
+	pipe2(done, O_NONBLOCK);
+	pid_t child = fork();
+	if (child == 0) {
+		close(done[1]);
+		execl("/proc/self/exe", "mque2", "receiver", to_string(ready[1]).c_str(), to_string(done[0]).c_str(), nullptr);
+		_exit(1);
+	}
+	close(done[0]);
+	char c;
+	read(ready[0], &c, 1);
+	return child;
+}
+
+
+static int reap (pid_t child, int ready[2], int done[2])
+{
+	close(done[1]);
+	int count = 0;
+	read(ready[0], &count, sizeof(count));
+	close(ready[0]);
+	close(ready[1]);
+	int status;
+	waitpid(child, &status, 0);
+	test_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	return count;
+}
+
+
+int main (int argc, char *argv[])
+{
+	log::initialize();
+	mem::shmlog::initialize();
+
+	if (argc == 4 && string(argv[1]) == "receiver") {
+		receiver(atoi(argv[2]), atoi(argv[3]));
+	}
+
+	report_executable_parameters();
+
+	MQue::initialize();
+
+	int ready[2], done[2];
+	pid_t child = spawn(ready, done);
+	MQue::inbox* peer = MQue::inbox_of(child);
+	test_assert(peer != nullptr);
+	test_assert(peer != MQue::my_inbox);
+
+	MQue::Message msg = MQue::create(7, 64);
+	auto hdr = MQue::header_of(msg);
+
+	// every descriptor carries a reference, which the receiver drops once it has dispatched it
+	auto start = chrono::steady_clock::now();
+	for (int i = 0; i < MESSAGES; i++) {
+		MQue::send(child, msg);
+	}
+	while (hdr->refs.load() != 1) {
+		sched_yield();
+	}
+	auto elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	cout << MESSAGES << " messages in " << elapsed * 1000 << " ms, " << MESSAGES / elapsed / 1e6 << " Mmsg/s" << endl;
+
+	// queued messages are pushed a batch at a time, with one wakeup per batch
+	start = chrono::steady_clock::now();
+	for (int i = 0; i < MESSAGES; i++) {
+		MQue::queue(child, msg);
+	}
+	MQue::flush();
+	while (hdr->refs.load() != 1) {
+		sched_yield();
+	}
+	elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	cout << MESSAGES << " queued messages in " << elapsed * 1000 << " ms, " << MESSAGES / elapsed / 1e6 << " Mmsg/s" << endl;
+
+	test_assert(reap(child, ready, done) == 2 * MESSAGES);
+	test_assert(peer->owner.load() == 0);
+
+	// the next process takes over the inbox that was given up
+	child = spawn(ready, done);
+	test_assert(MQue::inbox_of(child) == peer);
+	MQue::send(child, msg);
+	while (hdr->refs.load() != 1) {
+		sched_yield();
+	}
+	test_assert(reap(child, ready, done) == 1);
+
+	MQue::release(msg);
+	MQue::finalize();
+
+	report_success();
+	return 0;
+}
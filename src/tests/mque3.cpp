@@ -0,0 +1,136 @@
+/**
+ * @cxxparams "-g -I.. -std=c++20"
+ * @ldparams "-lpthread -lrt"
+ **/
+
+#include <stdint.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <testmatrix.h>
+#include "mque.cpp"
+
+using namespace std;
+
+template<>
+FILE* mem::shmlog::logfile = nullptr;
+
+template<>
+FILE* log::logfile = nullptr;
+
+#define DOCUMENT (64 << 20)
+
+typedef mem::pool_addr_traits<0x1011,16,4,8,20> handoff_addr_traits;
+
+struct A
+{
+	uint64_t a;
+	uint64_t b;
+};
+
+int failures = 0;
+
+/**
+ * A document arrives as a memfd, which is mapped rather than copied.
+ */
+static void on_document (const MQue::Message& msg, void* ctx)
+{
+	if (msg.fd == -1 || msg.data != nullptr) {
+		failures++;
+		return;
+	}
+	auto doc = reinterpret_cast<uint8_t*>(mmap(nullptr, msg.size, PROT_READ, MAP_SHARED, msg.fd, 0));
+	if (doc == MAP_FAILED) {
+		failures++;
+		return;
+	}
+	for (uint32_t i = 0; i < msg.size; i += 4096) {
+		failures += doc[i] != (uint8_t)(i >> 12);
+	}
+	munmap(doc, msg.size);
+}
+
+
+/**
+ * A pool arrives as the descriptor of its shared memory object, along with the address of an
+ * object in it.
+ */
+static void on_pool (const MQue::Message& msg, void* ctx)
+{
+	auto pool = mem::shmfixedpool<A,handoff_addr_traits>::attach_fd(0, dup(msg.fd));
+	A* obj = *reinterpret_cast<A**>(msg.data);
+	failures += obj->a != 1 || obj->b != 2;
+	mem::shmfixedpool<A,handoff_addr_traits>::detach(pool);
+}
+
+
+static void on_done (const MQue::Message& msg, void* ctx)
+{
+	MQue::stop();
+}
+
+
+int main (int argc, char *argv[])
+{
+	report_executable_parameters();
+
+	log::initialize();
+	mem::shmlog::initialize();
+
+	int ready[2];
+	pipe(ready);
+	char c;
+
+	pid_t child = fork();
+	if (child == 0) {
+		MQue::initialize();
+		MQue::handle(1, on_document);
+		MQue::handle(2, on_pool);
+		MQue::handle(3, on_done);
+		write(ready[1], "r", 1);
+		MQue::run();
+		MQue::finalize();
+		_exit(failures);
+	}
+
+	MQue::initialize();
+	read(ready[0], &c, 1);
+
+	// the whole document is handed over in one message
+	int fd = memfd_create("liveparse-document", MFD_CLOEXEC);
+	ftruncate(fd, DOCUMENT);
+	auto doc = reinterpret_cast<uint8_t*>(mmap(nullptr, DOCUMENT, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+	for (uint32_t i = 0; i < DOCUMENT; i += 4096) {
+		doc[i] = (uint8_t)(i >> 12);
+	}
+	MQue::Message msg { (MQue::proc_t)getpid(), 1, DOCUMENT, nullptr, fd };
+	MQue::send(child, msg);
+	munmap(doc, DOCUMENT);
+	close(fd);
+
+	// so is a pool, which the peer maps at the same addresses
+	auto pool = mem::shmfixedpool<A,handoff_addr_traits>::attach(0);
+	A* obj = pool.allocate(1);
+	obj->a = 1;
+	obj->b = 2;
+	msg = MQue::create(2, sizeof(A*));
+	*reinterpret_cast<A**>(msg.data) = obj;
+	msg.fd = pool.mapping().fh;
+	MQue::send(child, msg);
+	MQue::release(msg);
+
+	msg = MQue::Message { (MQue::proc_t)getpid(), 3, 0, nullptr };
+	MQue::send(child, msg);
+
+	int status;
+	waitpid(child, &status, 0);
+	test_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	pool.deallocate(obj, 1);
+	mem::shmfixedpool<A,handoff_addr_traits>::detach(pool);
+	MQue::finalize();
+
+	report_success();
+	return 0;
+}
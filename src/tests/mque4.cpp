@@ -0,0 +1,166 @@
+/**
+ * @cxxparams "-g -I.. -std=c++20"
+ * @ldparams "-lpthread -lrt"
+ **/
+
+#include <stdint.h>
+#include <iostream>
+#include <thread>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <testmatrix.h>
+#include "mque.cpp"
+
+using namespace std;
+
+template<>
+FILE* mem::shmlog::logfile = nullptr;
+
+template<>
+FILE* log::logfile = nullptr;
+
+#define BULK 7
+#define KEYSTROKE 8
+#define DONE 9
+
+// keystrokes beyond what the interactive ring holds, which spill to the socket; fewer than a socket
+// queues for a peer that is not receiving
+#define SPILLED 8
+
+int received = 0;
+int first_code = -1;
+int64_t last_key = -1;
+int misordered = 0;
+
+static void on_message (const MQue::Message& msg, void* ctx)
+{
+	if (first_code == -1) {
+		first_code = msg.code;
+	}
+	if (msg.code == KEYSTROKE) {
+		uint32_t seq = *reinterpret_cast<const uint32_t*>(msg.data);
+		misordered += seq <= last_key;
+		last_key = seq;
+		// slow enough that the sender sees the ring drain while the spilled keystrokes wait their turn
+		usleep(50);
+	}
+	received++;
+}
+
+
+static void send_key (MQue::proc_t to, uint32_t seq)
+{
+	MQue::Message key = MQue::create(KEYSTROKE, 8);
+	*reinterpret_cast<uint32_t*>(key.data) = seq;
+	MQue::send(to, key);
+	MQue::release(key);
+}
+
+
+static void on_done (const MQue::Message& msg, void* ctx)
+{
+	MQue::stop();
+}
+
+
+static void set_priorities ()
+{
+	MQue::prioritize(KEYSTROKE, MQue::interactive);
+	MQue::prioritize(DONE, MQue::interactive);
+}
+
+
+int main (int argc, char *argv[])
+{
+	report_executable_parameters();
+
+	log::initialize();
+	mem::shmlog::initialize();
+
+	int ready[2], go[2];
+	pipe(ready);
+	pipe(go);
+	char c;
+
+	pid_t child = fork();
+	if (child == 0) {
+		set_priorities();
+		MQue::initialize();
+		MQue::handle(BULK, on_message);
+		MQue::handle(KEYSTROKE, on_message);
+		MQue::handle(DONE, on_done);
+		write(ready[1], "r", 1);
+		// let the parent fill the inbox before receiving anything
+		read(go[0], &c, 1);
+		MQue::run();
+		write(ready[1], &first_code, sizeof(first_code));
+		write(ready[1], &received, sizeof(received));
+		write(ready[1], &misordered, sizeof(misordered));
+		MQue::finalize();
+		_exit(0);
+	}
+
+	set_priorities();
+	MQue::initialize();
+	read(ready[0], &c, 1);
+
+	// bulk messages use up the peer's credits while it is not receiving
+	MQue::Message msg = MQue::create(BULK, 64);
+	for (int i = 0; i < MQue::inbox::window; i++) {
+		MQue::send(child, msg);
+	}
+	MQue::Stats st = MQue::stats(child);
+	test_assert(st.bulk_depth == MQue::inbox::window);
+	test_assert(st.credits == 0);
+	test_assert(st.stalls == 0);
+
+	// an interactive message does not need credits
+	send_key(child, 0);
+	test_assert(MQue::stats(child).interactive_depth == 1);
+
+	// keystrokes that find the interactive ring full go over the socket
+	uint32_t seq = 1;
+	while (seq < MQue::ring_capacity + SPILLED) {
+		send_key(child, seq++);
+	}
+	test_assert(MQue::stats(child).interactive_depth == MQue::ring_capacity);
+
+	// the next bulk message waits until the peer starts receiving
+	thread sender([&] () { MQue::send(child, msg); });
+	while (MQue::stats(child).stalls == 0) {
+		usleep(1000);
+	}
+	test_assert(MQue::stats(child).bulk_depth == MQue::inbox::window);
+	write(go[1], "g", 1);
+
+	// later keystrokes follow the spilled ones over the socket until the peer has read it, even once
+	// the ring has room again
+	while (MQue::stats(child).interactive_depth == MQue::ring_capacity) {
+		sched_yield();
+	}
+	for (int i = 0; i < SPILLED; i++) {
+		send_key(child, seq++);
+	}
+	sender.join();
+
+	MQue::send(child, MQue::Message { (MQue::proc_t)getpid(), DONE, 0, nullptr });
+
+	// the keystrokes went ahead of everything that was queued before them, and arrived in order
+	int first, count, wrong;
+	read(ready[0], &first, sizeof(first));
+	read(ready[0], &count, sizeof(count));
+	read(ready[0], &wrong, sizeof(wrong));
+	test_assert(first == KEYSTROKE);
+	test_assert(count == MQue::inbox::window + 1 + (int)seq);
+	test_assert(wrong == 0);
+
+	int status;
+	waitpid(child, &status, 0);
+	test_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	MQue::release(msg);
+	MQue::finalize();
+
+	report_success();
+	return 0;
+}
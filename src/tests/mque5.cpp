@@ -0,0 +1,104 @@
+/**
+ * @cxxparams "-g -I.. -std=c++20"
+ * @ldparams "-lpthread -lrt"
+ **/
+
+#include <stdint.h>
+#include <iostream>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <testmatrix.h>
+#include "mque.cpp"
+
+using namespace std;
+
+template<>
+FILE* mem::shmlog::logfile = nullptr;
+
+template<>
+FILE* log::logfile = nullptr;
+
+#define DOUBLE 10
+#define DONE 11
+#define REQUESTS 1000
+
+/**
+ * The worker side answers each request with its argument doubled.
+ */
+static void on_double (const MQue::Message& msg, void* ctx)
+{
+	MQue::Message r = MQue::create(DOUBLE, sizeof(uint64_t));
+	*reinterpret_cast<uint64_t*>(r.data) = *reinterpret_cast<uint64_t*>(msg.data) * 2;
+	MQue::reply(msg, r);
+	MQue::release(r);
+}
+
+
+static void on_done (const MQue::Message& msg, void* ctx)
+{
+	MQue::stop();
+}
+
+
+int completed = 0;
+int wrong = 0;
+
+static MQue::Task ask (MQue::proc_t worker, uint64_t n)
+{
+	MQue::Message msg = MQue::create(DOUBLE, sizeof(uint64_t));
+	*reinterpret_cast<uint64_t*>(msg.data) = n;
+	MQue::Message r = co_await MQue::request(worker, msg);
+	MQue::release(msg);
+
+	wrong += *reinterpret_cast<uint64_t*>(r.data) != n * 2;
+	MQue::release(r);
+	completed++;
+}
+
+
+int main (int argc, char *argv[])
+{
+	report_executable_parameters();
+
+	log::initialize();
+	mem::shmlog::initialize();
+
+	int ready[2];
+	pipe(ready);
+	char c;
+
+	pid_t child = fork();
+	if (child == 0) {
+		MQue::initialize();
+		MQue::handle(DOUBLE, on_double);
+		MQue::handle(DONE, on_done);
+		write(ready[1], "r", 1);
+		MQue::run();
+		MQue::finalize();
+		_exit(0);
+	}
+
+	MQue::initialize();
+	read(ready[0], &c, 1);
+
+	// every request is in flight at once, on this one thread
+	for (int i = 0; i < REQUESTS; i++) {
+		ask(child, i);
+	}
+	test_assert(MQue::pending.size() == REQUESTS);
+	while (completed < REQUESTS) {
+		MQue::run_once(-1);
+	}
+	test_assert(wrong == 0);
+	test_assert(MQue::pending.empty());
+
+	MQue::send(child, MQue::Message { (MQue::proc_t)getpid(), DONE, 0, nullptr });
+	int status;
+	waitpid(child, &status, 0);
+	test_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	MQue::finalize();
+
+	report_success();
+	return 0;
+}
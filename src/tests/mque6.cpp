@@ -0,0 +1,117 @@
+/**
+ * @cxxparams "-g -I.. -std=c++20"
+ * @ldparams "-lpthread -lrt"
+ **/
+
+#include <stdint.h>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include <testmatrix.h>
+#include "mque.cpp"
+#include "mque_messages.hpp"
+
+using namespace std;
+
+template<>
+FILE* mem::shmlog::logfile = nullptr;
+
+template<>
+FILE* log::logfile = nullptr;
+
+string inserted;
+uint64_t position = 0;
+uint64_t erased = 0;
+
+static void on_insert (MQue::View<MQue::EditInsert> msg, void* ctx)
+{
+	position = msg->position;
+	auto text = msg[msg->text];
+	inserted.assign(text.begin(), text.end());
+	// the text is read where the sender wrote it
+	test_assert(text.empty() || text.data() == reinterpret_cast<const char*>(msg.message().data) + msg->text.offset);
+}
+
+
+static void on_erase (MQue::View<MQue::EditErase> msg, void* ctx)
+{
+	erased += msg->length;
+}
+
+
+int main (int argc, char *argv[])
+{
+	report_executable_parameters();
+
+	log::initialize();
+	mem::shmlog::initialize();
+
+	MQue::initialize();
+	MQue::handle<MQue::EditInsert, on_insert>();
+	MQue::handle<MQue::EditErase, on_erase>();
+	MQue::proc_t me = getpid();
+
+	const string text = "hello, world";
+	{
+		MQue::Builder<MQue::EditInsert> b(MQue::Builder<MQue::EditInsert>::room<char>(text.size()));
+		b->doc = 3;
+		b->position = 10;
+		b.append(b->text, text.data(), text.size());
+		MQue::send(me, b);
+	}
+	MQue::send(me, MQue::EditErase { 3, 10, 5 });
+	test_assert(MQue::poll() == 2);
+	test_assert(inserted == text);
+	test_assert(position == 10);
+	test_assert(erased == 5);
+
+	// arrays that point outside the payload read as empty
+	{
+		MQue::Builder<MQue::EditInsert> b;
+		b->text = { 4096, 1 };
+		MQue::send(me, b);
+	}
+	inserted = "unchanged";
+	MQue::poll();
+	test_assert(inserted.empty());
+
+	// an array that does not fit the room reserved for it is refused rather than written
+	{
+		MQue::Builder<MQue::EditInsert> b(MQue::Builder<MQue::EditInsert>::room<char>(4));
+		bool refused = false;
+		try {
+			b.append(b->text, text.data(), text.size());
+		} catch (std::length_error&) {
+			refused = true;
+		}
+		test_assert(refused);
+	}
+
+	// and so is room for more than a payload holds, rather than wrapping around to a small one
+	{
+		bool refused = false;
+		try {
+			MQue::Builder<MQue::EditInsert> b(MQue::Builder<MQue::EditInsert>::room<uint64_t>(UINT32_MAX / 4));
+		} catch (std::length_error&) {
+			refused = true;
+		}
+		test_assert(refused);
+	}
+
+	// only schemas without arrays can be sent from a value, which would leave their arrays empty
+	static_assert(MQue::FixedSchema<MQue::EditErase>);
+	static_assert(!MQue::FixedSchema<MQue::EditInsert>);
+	static_assert(!MQue::FixedSchema<MQue::EditDelta>);
+
+	// so do messages too short for their schema, which are not dispatched
+	MQue::Message shortmsg = MQue::create(MQue::EditErase::code, 8);
+	MQue::send(me, shortmsg);
+	MQue::release(shortmsg);
+	MQue::poll();
+	test_assert(erased == 5);
+
+	MQue::finalize();
+
+	report_success();
+	return 0;
+}
@@ -0,0 +1,153 @@
+/**
+ * @cxxparams "-g -I.. -std=c++20"
+ * @ldparams "-lpthread -lrt"
+ **/
+
+#include <stdint.h>
+#include <iostream>
+#include <chrono>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <testmatrix.h>
+#include "mque.cpp"
+
+using namespace std;
+
+template<>
+FILE* mem::shmlog::logfile = nullptr;
+
+template<>
+FILE* log::logfile = nullptr;
+
+#define KICK 7
+#define FLOOD 8
+
+// more than a window, so that a sender that floods from inside a handler has to stall
+#define FLOODS (3 * MQue::inbox::window)
+
+int received = 0;
+bool flooded = false;
+
+static void on_kick (const MQue::Message& msg, void* ctx)
+{
+	for (int i = 0; i < FLOODS; i++) {
+		MQue::send(msg.from_pid, MQue::Message { (MQue::proc_t)getpid(), FLOOD, 0, nullptr });
+	}
+	flooded = true;
+	if (received == FLOODS) {
+		MQue::stop();
+	}
+}
+
+
+static void on_flood (const MQue::Message& msg, void* ctx)
+{
+	if (++received == FLOODS && flooded) {
+		MQue::stop();
+	}
+}
+
+
+/**
+ * Kicks the peer and floods it back when it kicks this process, until both floods are through.
+ */
+static void flood_each_other (MQue::proc_t peer)
+{
+	MQue::handle(KICK, on_kick);
+	MQue::handle(FLOOD, on_flood);
+	MQue::send(peer, MQue::Message { (MQue::proc_t)getpid(), KICK, 0, nullptr });
+	MQue::run();
+}
+
+
+int main (int argc, char *argv[])
+{
+	report_executable_parameters();
+
+	log::initialize();
+	mem::shmlog::initialize();
+
+	int ready[2], go[2];
+	pipe(ready);
+	pipe(go);
+	char c;
+
+	// two peers that flood each other from inside their handlers both get through
+	pid_t child = fork();
+	if (child == 0) {
+		MQue::initialize();
+		write(ready[1], "r", 1);
+		read(go[0], &c, 1);
+		flood_each_other(getppid());
+		write(ready[1], &received, sizeof(received));
+		MQue::finalize();
+		_exit(0);
+	}
+
+	MQue::initialize();
+	read(ready[0], &c, 1);
+	write(go[1], "g", 1);
+	flood_each_other(child);
+	int theirs;
+	read(ready[0], &theirs, sizeof(theirs));
+	test_assert(received == FLOODS);
+	test_assert(theirs == FLOODS);
+	test_assert(MQue::stats(getpid()).dropped == 0);
+	int status;
+	waitpid(child, &status, 0);
+	test_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	MQue::finalize();
+
+	// peers that stop receiving with a full window
+	pid_t dead = fork();
+	if (dead == 0) {
+		MQue::initialize();
+		write(ready[1], "r", 1);
+		read(go[0], &c, 1);
+		_exit(0);
+	}
+	pid_t stopped = fork();
+	if (stopped == 0) {
+		MQue::initialize();
+		write(ready[1], "r", 1);
+		read(go[0], &c, 1);
+		MQue::finalize();
+		_exit(0);
+	}
+	MQue::initialize();
+	read(ready[0], &c, 1);
+	read(ready[0], &c, 1);
+
+	MQue::Message msg = MQue::create(FLOOD, 64);
+	auto hdr = MQue::header_of(msg);
+	for (int i = 0; i < MQue::inbox::window; i++) {
+		MQue::send(dead, msg);
+		MQue::send(stopped, msg);
+	}
+	test_assert(hdr->refs.load() == 1 + 2 * MQue::inbox::window);
+
+	// a peer that died is given up on at once, and its inbox keeps what it never received
+	kill(dead, SIGKILL);
+	waitpid(dead, &status, 0);
+	MQue::send(dead, msg);
+	test_assert(hdr->refs.load() == 1 + 2 * MQue::inbox::window);
+
+	// a live peer that pops nothing has the message dropped once the stall times out
+	auto start = chrono::steady_clock::now();
+	MQue::send(stopped, msg);
+	auto waited = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	test_assert(waited * 1e9 >= MQue::stall_timeout_ns);
+	test_assert(MQue::stats(stopped).dropped == 1);
+	test_assert(hdr->refs.load() == 1 + 2 * MQue::inbox::window);
+
+	write(go[1], "g", 1);
+	waitpid(stopped, &status, 0);
+	test_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	MQue::release(msg);
+	MQue::finalize();
+
+	report_success();
+	return 0;
+}
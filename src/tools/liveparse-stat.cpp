@@ -0,0 +1,137 @@
+/**
+ * Prints the statistics pages of the shared pools of running liveparse processes: those in
+ * /dev/shm, and the persistent ones whose files are kept in the pool directory.
+ * Every pool is opened read-only, so this can be pointed at a live system without disturbing it.
+ *
+ * usage: liveparse-stat [-i seconds] [-a app-name] [-d pool-directory]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "mem/shmstats.hpp"
+
+using mem::shmpool_stats;
+
+
+// where the files of persistent pools are kept, unless mem::pool_directory() was changed
+static const char* default_pool_directory = "/var/tmp";
+
+
+static void find_pools (const std::string& app, const std::string& dirname, std::vector<std::string>& names)
+{
+	std::string prefix = app + "-pool-";
+	DIR* dir = opendir(dirname.c_str());
+	if (!dir) {
+		perror(dirname.c_str());
+		return;
+	}
+	size_t found = names.size();
+	while (struct dirent* e = readdir(dir)) {
+		if (strncmp(e->d_name, prefix.c_str(), prefix.size()) == 0) {
+			names.push_back(dirname + "/" + e->d_name);
+		}
+	}
+	closedir(dir);
+	std::sort(names.begin() + found, names.end());
+}
+
+
+static void print_pool (const std::string& name)
+{
+	int fd = open(name.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return; // detached since the scan
+	}
+	struct stat statbuf;
+	if (fstat(fd, &statbuf) == -1 || (size_t)statbuf.st_size < sizeof(shmpool_stats)) {
+		close(fd);
+		return;
+	}
+	void* addr = mmap(nullptr, sizeof(shmpool_stats), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		perror(name.c_str());
+		return;
+	}
+
+	const shmpool_stats* st = reinterpret_cast<const shmpool_stats*>(addr);
+	if (!st->valid()) {
+		printf("%s: no statistics page (layout version mismatch?)\n", name.c_str());
+		munmap(addr, sizeof(shmpool_stats));
+		return;
+	}
+
+	uint64_t allocs = st->total_allocs();
+	uint64_t frees = st->total_frees();
+	printf("%s  region %lx pool %lx  object %u bytes\n", name.c_str(),
+	       (unsigned long)st->regionid, (unsigned long)st->poolid, st->object_size);
+	printf("  capacity %lu  committed %lu  free objects %lu  released segments %lu\n",
+	       (unsigned long)st->capacity.load(), (unsigned long)st->committed.load(),
+	       (unsigned long)st->free_objects.load(), (unsigned long)st->released_segments.load());
+	printf("  allocs %lu  frees %lu  live %ld  lock waits %lu  growths %lu (last by pid %d)\n",
+	       (unsigned long)allocs, (unsigned long)frees, (long)(allocs - frees),
+	       (unsigned long)st->total_lock_waits(), (unsigned long)st->growths.load(),
+	       st->last_grower.load());
+	for (auto& p : st->processes) {
+		pid_t pid = p.pid.load();
+		if (pid != 0) {
+			printf("    pid %-8d holds %ld objects%s\n", pid, (long)p.objects.load(),
+			       (kill(pid, 0) == -1 && errno == ESRCH) ? " (exited)" : "");
+		}
+	}
+
+	munmap(addr, sizeof(shmpool_stats));
+}
+
+
+int main (int argc, char* argv[])
+{
+	int interval = 0;
+	std::string app = "liveparse";
+	std::string pooldir = default_pool_directory;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "i:a:d:")) != -1) {
+		switch (opt) {
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 'a':
+			app = optarg;
+			break;
+		case 'd':
+			pooldir = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-i seconds] [-a app-name] [-d pool-directory]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	do {
+		std::vector<std::string> pools;
+		find_pools(app, "/dev/shm", pools);
+		find_pools(app, pooldir, pools);
+		if (pools.empty()) {
+			printf("no %s pools in /dev/shm or %s\n", app.c_str(), pooldir.c_str());
+		}
+		for (auto& name : pools) {
+			print_pool(name);
+		}
+		if (interval > 0) {
+			printf("\n");
+			fflush(stdout);
+			sleep(interval);
+		}
+	} while (interval > 0);
+
+	return 0;
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+/**
+ * Implements a region allocator that belongs to one document. Objects are carved out of large chunks
+ * and everything is returned at once when the arena is released or destroyed, so tearing down a
+ * document does not have to visit its nodes. Freed blocks are kept on per-size free lists and reused.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cassert>
+#include <new>
+#include <utility>
+
+namespace util
+{
+
+class arena
+{
+public:
+	constexpr static std::size_t default_chunk_size = 1 << 20;
+	constexpr static std::size_t alignment = 16;
+	constexpr static std::size_t max_recycled_size = 8192; // larger blocks are not reused until release()
+
+	explicit arena (std::size_t chunk_size = default_chunk_size)
+		: chunk_size(chunk_size), chunks(nullptr), cursor(nullptr), limit(nullptr), allocated(0)
+	{
+		for (auto& f : free_lists) { f = nullptr; }
+	}
+
+	arena (const arena&) = delete;
+	arena& operator= (const arena&) = delete;
+
+	~arena () { release(); }
+
+	void* allocate (std::size_t sz) {
+		sz = round_up(sz);
+		if (sz <= max_recycled_size) {
+			free_block*& head = free_lists[sz / alignment];
+			if (head) {
+				free_block* b = head;
+				head = b->next;
+				return b;
+			}
+		}
+		if ((std::size_t)(limit - cursor) < sz) {
+			new_chunk(sz);
+		}
+		void* p = cursor;
+		cursor += sz;
+		allocated += sz;
+		return p;
+	}
+
+	void deallocate (void* p, std::size_t sz) {
+		if (!p) return;
+		sz = round_up(sz);
+		if (sz <= max_recycled_size) {
+			free_block* b = static_cast<free_block*>(p);
+			b->next = free_lists[sz / alignment];
+			free_lists[sz / alignment] = b;
+		}
+	}
+
+	template<typename T, typename... Args>
+	T* make (Args&&... args) {
+		return new (allocate(sizeof(T))) T(std::forward<Args>(args)...);
+	}
+
+	/**
+	 * Returns every chunk at once. Destructors of objects still in the arena are not run.
+	 */
+	void release () {
+		while (chunks) {
+			chunk* next = chunks->next;
+			std::free(chunks);
+			chunks = next;
+		}
+		for (auto& f : free_lists) { f = nullptr; }
+		cursor = limit = nullptr;
+		allocated = 0;
+	}
+
+	std::size_t bytes_allocated () const { return allocated; }
+
+protected:
+	struct free_block { free_block* next; };
+	struct alignas(alignment) chunk { chunk* next; };
+
+	static std::size_t round_up (std::size_t sz) {
+		return (sz + alignment - 1) & ~(alignment - 1);
+	}
+
+	void new_chunk (std::size_t at_least) {
+		std::size_t bytes = sizeof(chunk) + (at_least > chunk_size ? at_least : chunk_size);
+		chunk* c = static_cast<chunk*>(std::malloc(bytes));
+		if (!c) {
+			throw std::bad_alloc();
+		}
+		c->next = chunks;
+		chunks = c;
+		cursor = reinterpret_cast<char*>(c + 1);
+		limit = reinterpret_cast<char*>(c) + bytes;
+	}
+
+	std::size_t chunk_size;
+	chunk* chunks;
+	char* cursor;
+	char* limit;
+	std::size_t allocated;
+	free_block* free_lists[max_recycled_size / alignment + 1];
+
+};
+
+
+/**
+ * An STL allocator over an arena, for parser data that lives as long as its document.
+ */
+template<typename T>
+struct arena_allocator
+{
+	typedef T value_type;
+
+	arena* a;
+
+	explicit arena_allocator (arena* a) : a(a) {}
+	template<typename U>
+	arena_allocator (const arena_allocator<U>& o) : a(o.a) {}
+
+	T* allocate (std::size_t n) { return static_cast<T*>(a->allocate(n * sizeof(T))); }
+	void deallocate (T* p, std::size_t n) { a->deallocate(p, n * sizeof(T)); }
+
+	template<typename U>
+	bool operator== (const arena_allocator<U>& o) const { return a == o.a; }
+	template<typename U>
+	bool operator!= (const arena_allocator<U>& o) const { return a != o.a; }
+};
+
+
+} // namespace util
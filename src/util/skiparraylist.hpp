@@ -10,6 +10,10 @@
 #define NODE_FANOUT 3
 #endif
 
+// Define to an addressing format (a mem::pool_addr_traits) to allocate nodes from the shared heap
+// and link them with 32-bit compressed pointers. The heap must be attached before use.
+// #define SKIPARRAYLIST_ADDR_TRAITS
+
 #ifdef DEBUG_SKIPARRAYLIST
 #define PROTECTED public
 #else
@@ -23,6 +27,12 @@ template<typename T> class leaf;
 }
 
 #include <boost/intrusive/list.hpp>
+#include "util/arena.hpp"
+
+#ifdef SKIPARRAYLIST_ADDR_TRAITS
+#include "mem/cptr.hpp"
+#include "mem/shmallocator.hpp"
+#endif
 
 #include <string>
 #include <algorithm>
@@ -46,9 +56,13 @@ class skiparraylist
 public:
 	typedef T char_type;
 
+	// called after each edit with where it happened, how much it removed, and what it inserted
+	typedef void (*observer) (void* ctx, int pos, int removed, const T* inserted, int length);
+
 	friend std::ostream& operator<<<T>(std::ostream& os, skiparraylist<T>& b);
 	
 	skiparraylist();
+	explicit skiparraylist(arena* nodes); // nodes are allocated from, and released with, the arena
 	~skiparraylist();
 	
 	iterator<T> begin ();
@@ -63,13 +77,26 @@ public:
 	void append (const T* strdata, int length);
 	void remove (int from, int to);
 	void remove (iterator<T>& from, iterator<T>& to);
+
+	void observe (observer fn, void* ctx) { watcher = fn; watcher_ctx = ctx; }
+
+	// calls f with the contents of each leaf in turn, as a pointer and a length
+	template<typename F>
+	void each_run (F f) const;
 	
 	std::ostream& dot (std::ostream& os) const;
 	
 	friend std::ostream& operator<<<> (std::ostream& os, skiparraylist<T>& skip);
 	
 PROTECTED:
+	void notify (int pos, int removed, const T* inserted, int length) {
+		if (watcher) watcher(watcher_ctx, pos, removed, inserted, length);
+	}
+
 	inner<T>* root;
+	arena* nodes;
+	observer watcher = nullptr;
+	void* watcher_ctx = nullptr;
 		
 };
 
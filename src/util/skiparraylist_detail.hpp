@@ -32,22 +32,65 @@ struct subtree_context
 
 namespace bi = boost::intrusive;
 
+#ifdef SKIPARRAYLIST_ADDR_TRAITS
+template<typename N>
+using node_ptr = mem::cptr<N, SKIPARRAYLIST_ADDR_TRAITS>;
+#else
+template<typename N>
+using node_ptr = N*;
+#endif
+
 template<typename T>
 class node
 {
 public:
 	friend class util::skiparraylist<T>;
 	
-	inner<T>* parent;
-	node<T>* _prev;
-	node<T>* _next;
+	node_ptr<inner<T>> parent;
+	node_ptr<node<T>> _prev;
+	node_ptr<node<T>> _next;
 	offset_type offset;
 	int siz;
 	
 	node () : parent(nullptr), offset(0), _prev(nullptr), _next(nullptr), siz(0) {}
 	virtual ~node() { }
+	
+#ifdef SKIPARRAYLIST_ADDR_TRAITS
+	// compressed links can only reach nodes inside the shared region, so no node uses an arena
+	template<typename N>
+	static N* make (arena*) {
+		return new (mem::shmheap<SKIPARRAYLIST_ADDR_TRAITS>::instance().allocate(sizeof(N))) N();
+	}
+	static void destroy (node<T>* n) {
+		std::size_t sz = n->footprint();
+		n->~node();
+		mem::shmheap<SKIPARRAYLIST_ADDR_TRAITS>::instance().deallocate(n, sz);
+	}
+	arena* home () const { return nullptr; }
+#else
+	// a node remembers the arena it came from, if any, and the nodes it splits off come from the same
+	template<typename N>
+	static N* make (arena* a) {
+		N* n = new (a ? a->allocate(sizeof(N)) : ::operator new(sizeof(N))) N();
+		n->_home = a;
+		return n;
+	}
+	static void destroy (node<T>* n) {
+		arena* a = n->_home;
+		std::size_t sz = n->footprint();
+		n->~node();
+		if (a) {
+			a->deallocate(n, sz);
+		} else {
+			::operator delete(n);
+		}
+	}
+	arena* home () const { return _home; }
+	arena* _home = nullptr;
+#endif
   
 	virtual iterator<T> at (int pos) = 0;
+	virtual std::size_t footprint () const = 0;
 	virtual offset_type size() const = 0;
 	virtual void set_size (offset_type) = 0;
 	virtual int insert (const iterator<T>& it, const T* strdata, int length) = 0;
@@ -108,12 +151,15 @@ class inner : public node<T>
 {
 public:
 	
-	node<T>* child;
+	node_ptr<node<T>> child;
 
 	inner() : node<T>(), child(nullptr) {}
 	virtual ~inner();
 
+	static inner<T>* make (arena* a) { return node<T>::template make<inner<T>>(a); }
+
 	iterator<T> at (int pos);
+	std::size_t footprint () const { return sizeof(inner<T>); }
 	offset_type size() const { return this->siz; }
 	void set_size (offset_type n) { this->siz = n; }
 	int insert (const iterator<T>& it, const T* strdata, int length);
@@ -130,8 +176,8 @@ public:
 
 	int num_children () const;
 
-	inner<T>* prev() const { return reinterpret_cast<inner<T>*>(this->_prev); }
-	inner<T>* next() const { return reinterpret_cast<inner<T>*>(this->_next); }
+	inner<T>* prev() const { return reinterpret_cast<inner<T>*>(static_cast<node<T>*>(this->_prev)); }
+	inner<T>* next() const { return reinterpret_cast<inner<T>*>(static_cast<node<T>*>(this->_next)); }
 	
 	bool empty () { return child == nullptr; }
 	
@@ -246,11 +292,11 @@ public:
 	
 	
 	void clear_and_delete_children () {
-		auto c = child;
+		node<T>* c = child;
 		while (c && c->parent == this) {
-			auto next_child = c->_next;
+			node<T>* next_child = c->_next;
 			node<T>::unlink(c);
-			delete c;
+			node<T>::destroy(c);
 			c = next_child;
 		}
 	}
@@ -259,7 +305,7 @@ public:
 	void erase_and_delete (node<T>* n) {
 		assert(n->parent == this);
 		node<T>::unlink(n);
-		delete(n);
+		node<T>::destroy(n);
 	}
 
 	
@@ -287,7 +333,10 @@ public:
 	leaf () : node<T>() {}
 	virtual ~leaf () { }
 	
+	static leaf<T>* make (arena* a) { return node<T>::template make<leaf<T>>(a); }
+
 	iterator<T> at (int pos);
+	std::size_t footprint () const { return sizeof(leaf<T>); }
 	offset_type size() const { return this->siz; }
 	void set_size (offset_type ofs) { this->siz = ofs; }
 	int insert (const iterator<T>& it, const T* strdata, int length);
@@ -297,8 +346,8 @@ public:
 	std::ostream& dot (std::ostream& os, offset_type ofs) const;
 	bool check() const;
 
-	leaf<T>* prev() const { return reinterpret_cast<leaf<T>*>(this->_prev); }
-	leaf<T>* next() const { return reinterpret_cast<leaf<T>*>(this->_next); }
+	leaf<T>* prev() const { return reinterpret_cast<leaf<T>*>(static_cast<node<T>*>(this->_prev)); }
+	leaf<T>* next() const { return reinterpret_cast<leaf<T>*>(static_cast<node<T>*>(this->_next)); }
 	
 	int raw_insert (const iterator<T>& it, const T* strdata, int length, T* carry_data, int* carry_length);
 	int raw_prepend (const T* strdata, int length) { return raw_insert(iterator<T>{this,0}, strdata, length, nullptr, nullptr); }
@@ -316,7 +365,7 @@ public:
 
 
 template<typename T>
-inner<T>::~inner<T> ()
+inner<T>::~inner ()
 {
 	if (child) {
 		clear_and_delete_children();
@@ -442,7 +491,7 @@ int inner<T>::insert (const iterator<T>& it, const T* strdata, int length)
 	
 	while (remaining > 0) {
 		int amt = 0;
-		m = new leaf<T>();
+		m = leaf<T>::make(this->home());
 		node<T>::link(this,last,m,to);
 		amt = std::min(remaining,capacity);
 		
@@ -459,7 +508,7 @@ int inner<T>::insert (const iterator<T>& it, const T* strdata, int length)
 		if (carry_length + last->siz <= capacity) { // put in last node
 			last->raw_append(carry_data, carry_length);
 		} else { // create a separate node
-			m = new leaf<T>();
+			m = leaf<T>::make(this->home());
 			node<T>::link(this, last, m, to);
 			m->raw_prepend(carry_data, carry_length);
 			m->offset = last->offset + last->siz;
@@ -501,7 +550,7 @@ int inner<T>::append (const T* strdata, int length)
 	assert(this->parent == nullptr || num_children() > 0);
 	int r = 0;
 	if (num_children() == 0) {
-		leaf<T>* m = new leaf<T>();
+		leaf<T>* m = leaf<T>::make(this->home());
 		push_back(m);
 		r += m->append(strdata,length);
 	} else {
@@ -526,7 +575,7 @@ int leaf<T>::append (const T* strdata, int length)
 	strdata += r;
 	
 	while (length > 0) {
-		leaf<T>* sib = new leaf<T>();
+		leaf<T>* sib = leaf<T>::make(this->home());
 		parent->push_back(sib);
 		sib->offset = this->offset + this->size();
 		m->_next = sib;
@@ -555,7 +604,7 @@ void inner<T>::rebalance_after_insert (bool full_height)
 		
 		if (this->parent == nullptr) {
 			// special case: root pivot
-			inner<T>* new_root = new inner<T>;
+			inner<T>* new_root = inner<T>::make(this->home());
 			this->parent = new_root;
 			new_root->push_back(this);
 		}
@@ -563,7 +612,7 @@ void inner<T>::rebalance_after_insert (bool full_height)
 		// add new siblings to the current node, then transfer children to those siblings
 		while (num_children() > NODE_FANOUT) {
 			
-			inner<T>* sib = new inner<T>();
+			inner<T>* sib = inner<T>::make(this->home());
 			node<T>::link(this->parent, this, sib, this->next());
 			
 			// transfer some children to the new sibling
@@ -659,7 +708,7 @@ void inner<T>::remove (int from, int to, subtree_context<T>* ctx)
 					auto m = n->_next;
 					node<T>::unlink(n);
 					this->siz -= n->siz; // optional, will be recalculated later since the entire ancestor chain needs it too.
-					delete n;
+					node<T>::destroy(n);
 					n = m;
 					continue;
 				}
@@ -730,7 +779,7 @@ void inner<T>::rebalance_after_remove (inner<T>* left, inner<T>* right, subtree_
 	
 	if (lc == 0) {
 		node<T>::unlink(left);
-		delete left;
+		node<T>::destroy(left);
 	} else {
 		left->fixup_child_extents();
 		left->fixup_my_size();
@@ -739,7 +788,7 @@ void inner<T>::rebalance_after_remove (inner<T>* left, inner<T>* right, subtree_
 	if (left != right) {
 		if (rc == 0) {
 			node<T>::unlink(right);
-			delete right;
+			node<T>::destroy(right);
 		} else  {
 			right->fixup_child_extents();
 			right->fixup_my_size();
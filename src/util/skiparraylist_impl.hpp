@@ -6,14 +6,30 @@ namespace util {
 using namespace util::detail;
 
 template <typename T>
-skiparraylist<T>::skiparraylist() : root(nullptr)
+skiparraylist<T>::skiparraylist() : root(nullptr), nodes(nullptr)
 {
 }
 
+template <typename T>
+skiparraylist<T>::skiparraylist(arena* nodes) : root(nullptr), nodes(nodes)
+{
+}
+
+/**
+ * Nodes of a tree with an arena are left for the arena to reclaim in bulk, unless the payload
+ * has destructors that must run.
+ */
 template <typename T>
 skiparraylist<T>::~skiparraylist()
 {
-	if (root) { delete root; }
+	if (!root) { return; }
+#ifndef SKIPARRAYLIST_ADDR_TRAITS
+	if (nodes && std::is_trivially_destructible<T>::value) {
+		root = nullptr;
+		return;
+	}
+#endif
+	node<T>::destroy(root);
 }
 
 template <typename T>
@@ -45,13 +61,54 @@ iterator<T> skiparraylist<T>::at (int pos)
 }
 
 
+/**
+ * Node offsets are relative to their parent, so a position is summed on the way up to the root.
+ */
+template <typename T>
+int skiparraylist<T>::pos (iterator<T>& it) const
+{
+	if (iterator<T>::is_end(it)) { return size(); }
+	int p = it.offset;
+	for (node<T>* n = it.leaf; n; n = n->parent) {
+		p += n->offset;
+	}
+	return p;
+}
+
+
+template <typename T, typename F>
+static void each_run_below (node<T>* n, F& f)
+{
+	if (auto l = dynamic_cast<leaf<T>*>(n)) {
+		f(static_cast<const T*>(l->data), l->siz);
+		return;
+	}
+	auto in = static_cast<inner<T>*>(n);
+	for (node<T>* c = in->child; c && c->parent == in; c = c->next()) {
+		each_run_below(c, f);
+	}
+}
+
+/**
+ * Visits the leaves in order the way printing does, a parent at a time.
+ */
+template <typename T>
+template <typename F>
+void skiparraylist<T>::each_run (F f) const
+{
+	if (root) {
+		each_run_below<T>(root, f);
+	}
+}
+
+
 template <typename T>
 void skiparraylist<T>::insert (int pos, const T* strdata, int length)
 {
 	if (root == nullptr) {
 		assert(pos == 0);
-		root = new inner<T>();
-		auto l = new leaf<T>();
+		root = inner<T>::make(nodes);
+		auto l = leaf<T>::make(nodes);
 		root->push_back(l);
 	}
 	auto it = at(pos);
@@ -63,10 +120,14 @@ template <typename T>
 void skiparraylist<T>::insert (const iterator<T>& it, const T* strdata, int length)
 {
 	if (iterator<T>::is_end(it)) {
+		int p = size();
 		root->append(strdata,length);
+		notify(p, 0, strdata, length);
 		return;
 	}
 	
+	iterator<T> where = it;
+	int p = watcher ? pos(where) : 0;
 	it.leaf->parent->insert(it, strdata, length);
 	
 	while (root->parent != nullptr) {
@@ -77,14 +138,16 @@ void skiparraylist<T>::insert (const iterator<T>& it, const T* strdata, int leng
 	root->check();
 	#endif
 
+	notify(p, 0, strdata, length);
 }
 
 template <typename T>
 void skiparraylist<T>::append (const T* strdata, int length)
 {
 	if (!root) {
-		root = new inner<T>();
+		root = inner<T>::make(nodes);
 	}
+	int p = size();
 	int r = root->append(strdata,length);
 	
 	assert(r == length);
@@ -98,6 +161,7 @@ void skiparraylist<T>::append (const T* strdata, int length)
 	root->check();
 	#endif
 	
+	notify(p, 0, strdata, length);
 }
 
 
@@ -108,8 +172,9 @@ void skiparraylist<T>::remove (int from, int to)
 	if (to < from)  { throw std::domain_error("Cannot remove with to < from"); }
 	
 	if (to - from == root->size()) {
-		if (root) delete root;
+		if (root) node<T>::destroy(root);
 		root = nullptr;
+		notify(from, to - from, nullptr, 0);
 		return;
 	}
 
@@ -126,12 +191,12 @@ void skiparraylist<T>::remove (int from, int to)
 	// root compaction
 	while (root->num_children() == 1) {
 		auto oldroot = root;
-		auto inner_child = dynamic_cast<inner<T>*>(root->child);
+		auto inner_child = dynamic_cast<inner<T>*>(static_cast<node<T>*>(root->child));
 		if (inner_child) {
 			root = inner_child;
 			root->parent = nullptr;
 			oldroot->child = nullptr;
-			delete oldroot;
+			node<T>::destroy(oldroot);
 		} else {
 			break;
 		}
@@ -143,6 +208,7 @@ void skiparraylist<T>::remove (int from, int to)
 	}
 	#endif
 	
+	notify(from, to - from, nullptr, 0);
 }
 
 
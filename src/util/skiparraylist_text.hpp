@@ -81,12 +81,12 @@ std::ostream& inner<T>::dot (std::ostream& os, offset_type ofs) const
 
 	if (this->parent) {
 		os << "node" << std::hex << ((unsigned long)(this) & GRAPHVIZ_ID_MASK)
-			 << " -> node" << std::hex << ((unsigned long)(this->parent) & GRAPHVIZ_ID_MASK) << " ;" << endl;
+			 << " -> node" << std::hex << ((unsigned long)static_cast<inner<T>*>(this->parent) & GRAPHVIZ_ID_MASK) << " ;" << endl;
 	}
 	
 	if (this->child) {
 		os << "node" << std::hex << ((unsigned long)(this) & GRAPHVIZ_ID_MASK)
-			 << " -> node" << std::hex << ((unsigned long)(this->child) & GRAPHVIZ_ID_MASK);
+			 << " -> node" << std::hex << ((unsigned long)static_cast<node<T>*>(this->child) & GRAPHVIZ_ID_MASK);
 		os << "[color=red];" << endl;
 	}
 	
@@ -118,7 +118,7 @@ std::ostream& leaf<T>::dot (std::ostream& os, offset_type ofs) const
 	
 	if (this->parent) {
 		os << "node" << std::hex << ((unsigned long)(this) & GRAPHVIZ_ID_MASK)
-			 << " -> node" << std::hex << ((unsigned long)(this->parent) & GRAPHVIZ_ID_MASK);
+			 << " -> node" << std::hex << ((unsigned long)static_cast<inner<T>*>(this->parent) & GRAPHVIZ_ID_MASK);
 		os << "[color=black];" << endl;
 	}
 	
@@ -0,0 +1,123 @@
+/**
+ * @include skiparraylist-defines
+ **/
+
+#include <cassert>
+#include <iostream>
+#include <sstream>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include <testmatrix.h>
+
+#define DEBUG_SKIPARRAYLIST
+#include "util/skiparraylist.hpp"
+
+std::string s("This test builds arrays whose nodes live in a per-document arena, edits them, "
+							"and checks that freed nodes are recycled and that teardown does not visit the nodes.");
+
+
+using namespace util;
+using namespace util::detail;
+using namespace std;
+
+#define ARRAY_TARGET_SIZE 20000
+
+bool compare (const std::string& truth, skiparraylist<char>& array) {
+	std::stringstream arraydata;
+	arraydata << array;
+	bool b = arraydata.str() == truth;
+	test_assert(arraydata.str() == truth);
+	return b;
+}
+
+double seconds_since (const struct timespec& t0) {
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+int main (int argc, char* argv[])
+{
+	report_executable_parameters();
+	int n = s.size();
+
+	arena doc;
+	std::string truth;
+
+	{
+		skiparraylist<char> array(&doc);
+
+		unsigned x = 71;
+		while (array.size() < ARRAY_TARGET_SIZE) {
+			x = x * 1103515245 + 12345;
+			int sz = truth.size();
+			int len = (x >> 8) % 50 + 1;
+			int p = sz ? (x >> 4) % sz : 0;
+			int q = (x >> 12) % (n - len);
+			truth.insert(p, &s[q], len);
+			array.insert(p, &s[q], len);
+		}
+		compare(truth, array);
+
+		// removes return nodes to the arena's free lists, and the inserts that follow reuse them
+		std::size_t before = doc.bytes_allocated();
+		for (int i = 0; i < 100; i++) {
+			x = x * 1103515245 + 12345;
+			int p = (x >> 4) % (truth.size() - 100);
+			truth.erase(p, 100);
+			array.remove(p, p + 100);
+			truth.insert(p, &s[0], 100);
+			array.insert(p, &s[0], 100);
+		}
+		compare(truth, array);
+		test_assert(doc.bytes_allocated() <= before + LEAF_CAPACITY * 4);
+
+		// the destructor leaves the nodes to the arena
+	}
+
+	// nodes of a tree without an arena still come from the global heap
+	{
+		std::size_t before = doc.bytes_allocated();
+		skiparraylist<char> plain;
+		plain.insert(0, s.c_str(), 40);
+		test_assert(doc.bytes_allocated() == before);
+	}
+
+	// a plain tree edited from an observer of an arena tree keeps its nodes on the heap
+	{
+		skiparraylist<char> plain;
+		skiparraylist<char> observed(&doc);
+		observed.observe([] (void* ctx, int pos, int removed, const char* inserted, int length) {
+			static_cast<skiparraylist<char>*>(ctx)->insert(pos, inserted, length);
+		}, &plain);
+		std::size_t before = doc.bytes_allocated();
+		observed.insert(0, s.c_str(), 40);
+		std::size_t own = doc.bytes_allocated() - before;
+
+		skiparraylist<char> alone(&doc);
+		before = doc.bytes_allocated();
+		alone.insert(0, s.c_str(), 40);
+		test_assert(doc.bytes_allocated() - before == own);
+		test_assert(plain.size() == 40);
+	}
+
+	struct timespec t0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	doc.release();
+	cout << "released arena in " << seconds_since(t0) << "s" << endl;
+	test_assert(doc.bytes_allocated() == 0);
+
+	// arena_allocator serves containers of parser data that live as long as the document
+	{
+		std::vector<int, arena_allocator<int>> offsets{arena_allocator<int>(&doc)};
+		for (int i = 0; i < 1000; i++) {
+			offsets.push_back(i);
+		}
+		test_assert(offsets[999] == 999);
+		test_assert(doc.bytes_allocated() > 0);
+	}
+
+	report_success();
+	return 0;
+}